@@ -0,0 +1,477 @@
+/* Benchmark for the write path of mod_log_rotate.
+ *
+ * The module is compiled into this program along with stand-ins for the
+ * few httpd functions it calls, and ap_rotated_log_writer is driven
+ * directly from a number of threads with lines split into fragments the
+ * way mod_log_config hands them over. For each storage directory, thread
+ * count and fragment count it reports lines per second, the latency of
+ * a write at the 50th, 99th and 99.9th percentile, and what the module
+ * counted doing it. See build.md for how to build and run it.
+ */
+#include "../src/mod_log_rotate.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_LINES         100000          /* Lines per thread             */
+#define BENCH_LEN           200             /* Length of a line             */
+#define BENCH_MAX_DIRECTIVES 32
+
+typedef struct {
+    server_rec      *s;             /* Server the log belongs to            */
+    rotated_log     *rl;            /* The log under test                   */
+    int             id;             /* Number of the thread                 */
+    int             frags;          /* Fragments per line                   */
+    int             lines;          /* Lines to write                       */
+    int             len;            /* Length of each line                  */
+    int             rollover;       /* Move to the next slot this often     */
+    apr_time_t      base;           /* Request time of the first line       */
+    apr_uint32_t    *lat;           /* Latency of each line in ns           */
+    int             done;           /* Lines written, with a latency        */
+    apr_status_t    rv;             /* First error from the writer          */
+} bench_thread;
+
+static volatile apr_uint32_t bench_go = 0;
+static int bench_threads = 1;
+
+/* Stand-ins for httpd */
+
+AP_DECLARE(void) ap_log_error_(const char *file, int line, int module_index, int level,
+                               apr_status_t status, const server_rec *s,
+                               const char *fmt, ...) {
+    char buf[512];
+    va_list ap;
+
+    if ((level & APLOG_LEVELMASK) > APLOG_WARNING) {
+        return;
+    }
+    va_start(ap, fmt);
+    apr_vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "%s (%d)\n", buf, status);
+}
+
+AP_DECLARE(void) ap_log_rerror_(const char *file, int line, int module_index, int level,
+                                apr_status_t status, const request_rec *r,
+                                const char *fmt, ...) {
+    char buf[512];
+    va_list ap;
+
+    va_start(ap, fmt);
+    apr_vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "%s (%d)\n", buf, status);
+}
+
+AP_DECLARE(apr_status_t) ap_mpm_query(int query_code, int *result) {
+    switch (query_code) {
+    case AP_MPMQ_MAX_THREADS:
+        *result = bench_threads;
+        return APR_SUCCESS;
+    case AP_MPMQ_IS_THREADED:
+        *result = AP_MPMQ_STATIC;
+        return APR_SUCCESS;
+    default:
+        *result = AP_MPMQ_NOT_SUPPORTED;
+        return APR_SUCCESS;
+    }
+}
+
+AP_DECLARE(char *) ap_server_root_relative(apr_pool_t *p, const char *fname) {
+    return apr_pstrdup(p, fname);
+}
+
+AP_DECLARE(piped_log *) ap_open_piped_log(apr_pool_t *p, const char *program) {
+    return NULL;
+}
+
+AP_DECLARE(apr_file_t *) ap_piped_log_write_fd(piped_log *pl) {
+    return NULL;
+}
+
+AP_DECLARE(void) ap_add_version_component(apr_pool_t *pconf, const char *component) {
+}
+
+AP_DECLARE(int) ap_rwrite(const void *buf, int nbyte, request_rec *r) {
+    return nbyte;
+}
+
+AP_DECLARE_NONSTD(int) ap_rprintf(request_rec *r, const char *fmt, ...) {
+    return 0;
+}
+
+AP_DECLARE(void) ap_set_content_type(request_rec *r, const char *ct) {
+}
+
+AP_DECLARE(void) ap_hook_open_logs(ap_HOOK_open_logs_t *pf, const char * const *pre,
+                                   const char * const *succ, int order) {
+}
+
+AP_DECLARE(void) ap_hook_post_config(ap_HOOK_post_config_t *pf, const char * const *pre,
+                                     const char * const *succ, int order) {
+}
+
+AP_DECLARE(void) ap_hook_child_init(ap_HOOK_child_init_t *pf, const char * const *pre,
+                                    const char * const *succ, int order) {
+}
+
+AP_DECLARE(void) ap_hook_handler(ap_HOOK_handler_t *pf, const char * const *pre,
+                                 const char * const *succ, int order) {
+}
+
+/* The benchmark */
+
+#ifdef AP_HAVE_DESIGNATED_INITIALIZER
+#define BENCH_FN(c, how)    ((c)->func.how)
+#else
+#define BENCH_FN(c, how)    ((c)->func)
+#endif
+
+/* Apply a directive such as "RotateLogsBuffer 65536" through the module's
+ * own command table.
+ */
+static const char *bench_directive(apr_pool_t *p, server_rec *s, const char *line) {
+    char *args = apr_pstrdup(p, line), *last;
+    const char *name = apr_strtok(args, " \t", &last);
+    const char *a1   = apr_strtok(NULL, " \t", &last);
+    const char *a2   = apr_strtok(NULL, " \t", &last);
+    const command_rec *c;
+    cmd_parms cmd;
+
+    for (c = rotate_log_cmds; NULL != c->name; ++c) {
+        if (NULL != name && !strcasecmp(c->name, name)) {
+            break;
+        }
+    }
+    if (NULL == c->name) {
+        return "unknown directive";
+    }
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.server    = s;
+    cmd.pool      = p;
+    cmd.temp_pool = p;
+    cmd.cmd       = c;
+
+    switch (c->args_how) {
+    case FLAG:
+        if (NULL == a1 || NULL != a2) {
+            return "takes On or Off";
+        }
+        return BENCH_FN(c, flag)(&cmd, NULL, !strcasecmp(a1, "on"));
+    case TAKE1:
+        if (NULL == a1 || NULL != a2) {
+            return "takes one argument";
+        }
+        return BENCH_FN(c, take1)(&cmd, NULL, a1);
+    case TAKE12:
+        if (NULL == a1) {
+            return "takes one or two arguments";
+        }
+        return BENCH_FN(c, take2)(&cmd, NULL, a1, a2);
+    default:
+        return "directive not supported by the benchmark";
+    }
+}
+
+static apr_uint32_t bench_ns(const struct timespec *a, const struct timespec *b) {
+    apr_uint64_t ns = (apr_uint64_t) (b->tv_sec - a->tv_sec) * 1000000000 +
+                      (apr_uint64_t) b->tv_nsec - (apr_uint64_t) a->tv_nsec;
+
+    return ns > APR_UINT32_MAX ? APR_UINT32_MAX : (apr_uint32_t) ns;
+}
+
+static void * APR_THREAD_FUNC bench_thread_main(apr_thread_t *thd, void *data) {
+    bench_thread *bt = data;
+    const char **strs = malloc(bt->frags * sizeof(char *));
+    int *strl = malloc(bt->frags * sizeof(int));
+    char *line = malloc(bt->len);
+    struct timespec t0, t1;
+    request_rec r;
+    apr_pool_t *p;
+    int i, off;
+
+    /* One line cut into frags pieces, ending in a newline */
+    for (i = 0; i < bt->len - 1; ++i) {
+        line[i] = 'a' + (bt->id + i) % 26;
+    }
+    line[bt->len - 1] = '\n';
+    for (i = 0, off = 0; i < bt->frags; ++i) {
+        int end = (int) ((apr_int64_t) bt->len * (i + 1) / bt->frags);
+
+        strs[i] = line + off;
+        strl[i] = end - off;
+        off = end;
+    }
+
+    apr_pool_create(&p, NULL);
+    memset(&r, 0, sizeof(r));
+    r.pool   = p;
+    r.server = bt->s;
+
+    while (0 == apr_atomic_read32(&bench_go)) {
+        apr_thread_yield();
+    }
+
+    for (i = 0; i < bt->lines; ++i) {
+        r.request_time = bt->base;
+        if (bt->rollover > 0) {
+            r.request_time += (apr_time_t) (i / bt->rollover) * bt->rl->st.interval;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (APR_SUCCESS != (bt->rv = ap_rotated_log_writer(&r, bt->rl, strs, strl,
+                                                           bt->frags, bt->len))) {
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        bt->lat[i] = bench_ns(&t0, &t1);
+    }
+    bt->done = i;
+
+    apr_pool_destroy(p);
+    free(line);
+    free(strl);
+    free(strs);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+static int bench_cmp(const void *a, const void *b) {
+    apr_uint32_t x = *(const apr_uint32_t *) a, y = *(const apr_uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static apr_uint32_t bench_pct(apr_uint32_t *lat, apr_size_t n, double pct) {
+    apr_size_t i = (apr_size_t) (pct * (double) (n - 1));
+
+    return lat[i];
+}
+
+static int bench_run(const char *dir, int threads, int frags, int lines, int len,
+                     int rollover, const char **directives, int ndirectives) {
+    apr_pool_t *pconf, *pchild;
+    apr_thread_t **thd;
+    bench_thread *bt;
+    apr_uint32_t *lat;
+    server_rec *s;
+    log_options *ls;
+    rotated_log *rl;
+    struct timespec t0, t1, t2;
+    const char *err;
+    apr_status_t rv;
+    apr_size_t total, done;
+    double secs;
+    int i;
+
+    apr_pool_create(&pconf, NULL);
+    bench_threads = threads;
+    open_logs = 0;
+    memset(&metrics, 0, sizeof(metrics));
+    memset(metrics_pushed, 0, sizeof(metrics_pushed));
+
+    s = apr_pcalloc(pconf, sizeof(server_rec));
+    s->log.level = APLOG_WARNING;
+    s->module_config = apr_pcalloc(pconf, sizeof(void *));
+    ls = make_log_options(pconf, s);
+    ap_set_module_config(s->module_config, &log_rotate_module, ls);
+
+    for (i = 0; i < ndirectives; ++i) {
+        if (err = bench_directive(pconf, s, directives[i]), NULL != err) {
+            fprintf(stderr, "%s: %s\n", directives[i], err);
+            apr_pool_destroy(pconf);
+            return 1;
+        }
+    }
+
+    rl = ap_rotated_log_writer_init(pconf, s,
+                                    apr_psprintf(pconf, "%s/bench-%d-%d.log", dir, threads, frags));
+    if (NULL == rl) {
+        apr_pool_destroy(pconf);
+        return 1;
+    }
+
+    apr_pool_create(&pchild, pconf);
+    log_rotate_child_init(pchild, s);
+
+    total = (apr_size_t) threads * lines;
+    lat   = calloc(total, sizeof(apr_uint32_t));
+    thd   = apr_pcalloc(pconf, threads * sizeof(apr_thread_t *));
+    bt    = apr_pcalloc(pconf, threads * sizeof(bench_thread));
+
+    apr_atomic_set32(&bench_go, 0);
+    for (i = 0; i < threads; ++i) {
+        bt[i].s        = s;
+        bt[i].rl       = rl;
+        bt[i].id       = i;
+        bt[i].frags    = frags;
+        bt[i].lines    = lines;
+        bt[i].len      = len;
+        bt[i].rollover = rollover;
+        bt[i].base     = apr_time_now();
+        bt[i].lat      = lat + (apr_size_t) i * lines;
+        if (rv = apr_thread_create(&thd[i], NULL, bench_thread_main, &bt[i], pconf),
+            APR_SUCCESS != rv) {
+            fprintf(stderr, "can't create thread (%d)\n", rv);
+            exit(1);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    apr_atomic_set32(&bench_go, 1);
+    for (i = 0; i < threads; ++i) {
+        apr_thread_join(&rv, thd[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    /* Child exit: flush what is buffered and stop the service thread */
+    apr_pool_destroy(pchild);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    /* Only the lines that were written count; a thread that failed
+     * leaves the rest of its part of lat empty.
+     */
+    for (i = 0, done = 0; i < threads; ++i) {
+        if (APR_SUCCESS != bt[i].rv) {
+            fprintf(stderr, "writer failed in thread %d (%d)\n", i, bt[i].rv);
+        }
+        memmove(lat + done, bt[i].lat, (apr_size_t) bt[i].done * sizeof(apr_uint32_t));
+        done += bt[i].done;
+    }
+    if (0 == done) {
+        free(lat);
+        apr_pool_destroy(pconf);
+        return 1;
+    }
+    total = done;
+
+    secs = (double) bench_ns(&t0, &t1) / 1e9;
+    qsort(lat, total, sizeof(apr_uint32_t), bench_cmp);
+    printf("%-16s %3d %3d %10.0f %8u %8u %8u %8.3f %8.4f %8" APR_UINT64_T_FMT
+           " %8" APR_UINT64_T_FMT " %8" APR_UINT64_T_FMT "\n",
+           dir, threads, frags, (double) total / secs,
+           bench_pct(lat, total, 0.50), bench_pct(lat, total, 0.99),
+           bench_pct(lat, total, 0.999),
+           (double) bench_ns(&t1, &t2) / 1e6,
+           (double) ap_metric_read(RL_M_WRITES) / (double) total,
+           (apr_uint64_t) ap_metric_read(RL_M_ROTATIONS),
+           (apr_uint64_t) ap_metric_read(RL_M_LOCK_WAITS),
+           (apr_uint64_t) ap_metric_read(RL_M_WRITE_ERRORS));
+    fflush(stdout);
+
+    free(lat);
+    apr_pool_destroy(pconf);
+    return 0;
+}
+
+/* Parse a comma separated list of numbers.
+ */
+static int bench_list(apr_pool_t *p, const char *arg, int **out) {
+    char *copy = apr_pstrdup(p, arg), *last, *tok;
+    int n = 0, *v = apr_pcalloc(p, (strlen(arg) / 2 + 1) * sizeof(int));
+
+    for (tok = apr_strtok(copy, ",", &last); NULL != tok; tok = apr_strtok(NULL, ",", &last)) {
+        if ((v[n] = atoi(tok)) <= 0) {
+            return 0;
+        }
+        ++n;
+    }
+    *out = v;
+    return n;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-d dir[,dir...]] [-t threads[,threads...]] [-f frags[,frags...]]\n"
+            "       [-n lines] [-l length] [-r rollover] [-c \"Directive args\"]...\n"
+            "  -d  directories to write the logs to (default /tmp)\n"
+            "  -t  thread counts (default 1,2,4,8)\n"
+            "  -f  fragments per line (default 1,8,32)\n"
+            "  -n  lines per thread (default %d)\n"
+            "  -l  bytes per line (default %d)\n"
+            "  -r  move on to the next interval every this many lines (default 0, never)\n"
+            "  -c  a mod_log_rotate directive to apply, e.g. -c \"RotateLogsBuffer 65536\"\n",
+            prog, BENCH_LINES, BENCH_LEN);
+    exit(1);
+}
+
+int main(int argc, const char * const argv[]) {
+    const char *directives[BENCH_MAX_DIRECTIVES];
+    const char *dirs = "/tmp";
+    int *threads, *frags, nthreads, nfrags;
+    int lines = BENCH_LINES, len = BENCH_LEN, rollover = 0, ndirectives = 0;
+    char *dcopy, *dir, *last;
+    apr_pool_t *p;
+    int i, j, k;
+
+    apr_app_initialize(&argc, &argv, NULL);
+    atexit(apr_terminate);
+    apr_pool_create(&p, NULL);
+
+    nthreads = bench_list(p, "1,2,4,8", &threads);
+    nfrags   = bench_list(p, "1,8,32", &frags);
+
+    for (i = 1; i < argc; ++i) {
+        if (i + 1 == argc || '-' != argv[i][0] || '\0' == argv[i][1] || '\0' != argv[i][2]) {
+            usage(argv[0]);
+        }
+        switch (argv[i++][1]) {
+        case 'd':
+            dirs = argv[i];
+            break;
+        case 't':
+            if (nthreads = bench_list(p, argv[i], &threads), 0 == nthreads) {
+                usage(argv[0]);
+            }
+            break;
+        case 'f':
+            if (nfrags = bench_list(p, argv[i], &frags), 0 == nfrags) {
+                usage(argv[0]);
+            }
+            break;
+        case 'n':
+            lines = atoi(argv[i]);
+            break;
+        case 'l':
+            len = atoi(argv[i]);
+            break;
+        case 'r':
+            rollover = atoi(argv[i]);
+            break;
+        case 'c':
+            if (ndirectives == BENCH_MAX_DIRECTIVES) {
+                usage(argv[0]);
+            }
+            directives[ndirectives++] = argv[i];
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (lines <= 0 || len <= 0 || rollover < 0) {
+        usage(argv[0]);
+    }
+
+    /* Behave like a child, which keeps its log files open */
+    setenv("AP_PARENT_PID", "1", 1);
+
+    printf("%-16s %3s %3s %10s %8s %8s %8s %8s %8s %8s %8s %8s\n",
+           "dir", "thr", "frg", "lines/s", "p50 ns", "p99 ns", "p999 ns",
+           "exit ms", "wr/line", "rotates", "waits", "errors");
+
+    dcopy = apr_pstrdup(p, dirs);
+    for (dir = apr_strtok(dcopy, ",", &last); NULL != dir; dir = apr_strtok(NULL, ",", &last)) {
+        for (j = 0; j < nthreads; ++j) {
+            for (k = 0; k < nfrags; ++k) {
+                if (0 != bench_run(dir, threads[j], frags[k], lines, len, rollover,
+                                   directives, ndirectives)) {
+                    return 1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
@@ -16,10 +16,18 @@
 /* Adds RotateLogs and supporting directives that allow logs to be rotated by
  * the server without having to pipe them through rotatelogs.
  *
+ * All of them can be used in a <VirtualHost> as well. A vhost takes whatever
+ * it doesn't set itself from the main server, so busy vhosts can rotate more
+ * often or buffer more than quiet ones.
+ *
  * RotateLogs On|Off    Enable / disable automatic log rotation. If enabled
- *                      mod_log_rotate takes responsibility for all log output
- *                      server wide. That means the BufferedLogs directive
- *                      implemented by mod_log_config will be ignored.
+ *                      mod_log_rotate takes responsibility for all log
+ *                      output server wide, even if only one vhost turns it
+ *                      on. That means the BufferedLogs directive implemented
+ *                      by mod_log_config will be ignored. The logs of a
+ *                      vhost that turns it off are written to the files as
+ *                      named, without the compression, mapping, O_DIRECT or
+ *                      grace options they would otherwise inherit.
  *
  * RotateLogsLocalTime  Normally the log rotation interval is based on UTC.
  *                      For example an interval of 86400 (one day) will cause
@@ -34,6 +42,277 @@
  *                      is on). For example RotateInterval 86400 60 will
  *                      cause logs to be rotated at 23:00 UTC.
  *
+ * RotateLogsBuffer     Buffer log output in memory instead of issuing a
+ *                      write for each request. The first argument is the
+ *                      buffer size in bytes (0 disables buffering, which is
+ *                      the default). An optional second argument gives the
+ *                      maximum age in milliseconds of buffered data; a
+ *                      buffer older than that is flushed by the next write.
+ *                      Buffers are also flushed when they fill up, when the
+ *                      log rotates and when the child process exits.
+ *                      Piped logs are buffered as well, see below.
+ *
+ * RotateLogsAsync      Don't write logs from the request threads. Lines are
+ *                      queued and written in batches, and logs rotated, by a
+ *                      writer thread in each child process. On Linux, when
+ *                      built with HAVE_LIBURING, the writer thread hands its
+ *                      writes to io_uring and falls back to plain writes if
+ *                      the kernel doesn't offer it.
+ *
+ * RotateAsyncQueue     Set the number of lines the async queue of each log
+ *                      can hold. The default is 1024.
+ *
+ * RotateAsyncOverflow  Set what happens to a line when the async queue is
+ *                      full: block (the default) waits for room, drop
+ *                      discards it and counts it in the error log, spill
+ *                      followed by a file name appends it to that file.
+ *
+ * RotateLogsShared     Have the new log file opened once for all child
+ *                      processes at rollover instead of by every child. The
+ *                      file is opened by a broker process that hands the
+ *                      descriptor to each child. The broker runs as the
+ *                      server's User and Group, like the children, so it
+ *                      needs the same access to the log directory. Not
+ *                      available on Windows, which only has a single child
+ *                      process anyway.
+ *
+ * RotatePreopen        Open the file for the next slot this many seconds
+ *                      before the current slot ends, so that the rotation
+ *                      itself doesn't have to wait for the open. Closing the
+ *                      old file is also left to a background thread. The
+ *                      default is 0, which opens the file at rollover.
+ *
+ * RotateCompress       Compress log files as they are written: none (the
+ *                      default), gzip or zstd, with an optional compression
+ *                      level. The file name gets a .gz or .zst extension.
+ *                      Each buffer flush is written as a complete gzip member
+ *                      or zstd frame so the file stays readable up to the
+ *                      last flush after a crash. Compressed logs are always
+ *                      buffered, by default in 64KB with a maximum age of one
+ *                      second; use RotateLogsBuffer to change that. Combine
+ *                      with RotateLogsAsync to keep compression off the
+ *                      request threads.
+ *
+ * RotateMaxSize        Start a new log file within the current interval once
+ *                      the file has grown past this many bytes. Further files
+ *                      in the interval are named with a .1, .2, ... suffix,
+ *                      or the number goes where the file name has a %N. The
+ *                      default is 0, no limit. The size is counted in memory
+ *                      and only checked against the file now and then, so it
+ *                      can be overshot a little when several children write
+ *                      the same file.
+ *
+ * RotateScheduler      On has a background thread in each child rotate every
+ *                      log at rollover in one pass instead of leaving it to
+ *                      the next write to each log. Logs nobody wrote to
+ *                      during the interval just have their file closed and
+ *                      no new file is made until they are written to again.
+ *                      The next file of each busy log is opened ahead of the
+ *                      rollover, spread over a jitter window given in
+ *                      milliseconds by the optional second argument (2000
+ *                      by default) on top of any RotatePreopen time. The
+ *                      default is Off.
+ *
+ * RotateIdleClose      Close the file of a log nobody has written to for this
+ *                      many seconds. It is opened again by the next write.
+ *                      The file is closed between one and two times this
+ *                      long after the last write. The default is 0, which
+ *                      keeps files open.
+ *
+ * RotateMaxOpen        Set the most rotated log files each child keeps open.
+ *                      When a log needs to open its file and the child is at
+ *                      the limit, the file of the least recently used log is
+ *                      closed first. The default is 0, no limit.
+ *
+ * RotateLogsMmap       Write logs by copying lines into a memory mapping of
+ *                      the file instead of with a system call per line.
+ *                      Threads claim their space in the mapping with an
+ *                      atomic add and don't wait for each other. The file is
+ *                      grown 8MB at a time and cut back to its real length
+ *                      when it is rotated or closed, or when the child
+ *                      exits; after a crash the zero bytes left at its end
+ *                      are cut off when it is next opened. As a mapping
+ *                      can't be shared between processes, each child of a
+ *                      forking MPM (prefork, worker and event alike) writes
+ *                      its own file, named with the process id appended. A
+ *                      child that replaces one that has exited, e.g. after
+ *                      MaxConnectionsPerChild or a graceful restart, starts
+ *                      files of its own, so a slot has a file for every
+ *                      child that wrote to it. The lines of each file are in
+ *                      order; cat name.* (with the slot's name) puts the
+ *                      whole log for the slot together. Each file of a
+ *                      binary log starts with its own header. Doesn't
+ *                      combine with RotateLogsBuffer, RotateLogsAsync,
+ *                      RotateCompress or RotateLogsShared. The default is
+ *                      Off.
+ *
+ * RotateSync           Set when log data is pushed out to disk. With none,
+ *                      the default, it is left to the operating system.
+ *                      With rotate each file is synced when it is rotated
+ *                      out or closed, and when the child exits. interval
+ *                      <ms> does that and also syncs the current file every
+ *                      so many milliseconds from the service thread, if it
+ *                      has been written to. always opens the files with
+ *                      O_DSYNC, so each write returns once it is on disk;
+ *                      it turns RotateLogsShared and RotateLogsMmap off.
+ *                      Files that were synced are dropped from the page
+ *                      cache when they are closed.
+ *
+ * RotateCacheHint      Keep log files from filling the page cache. With
+ *                      dontneed a file is dropped from the cache when it is
+ *                      rotated out or closed. An optional size in megabytes
+ *                      also starts writeback each time that much has been
+ *                      written, and drops the stretch before from the cache
+ *                      once it is on disk (Linux only). direct writes the
+ *                      files with O_DIRECT from a buffer of whole blocks
+ *                      (Linux only). The buffer is RotateLogsBuffer rounded
+ *                      up to 4KB blocks, or 256KB flushed every second if
+ *                      that isn't set. As with RotateLogsMmap, each child of
+ *                      a forking MPM writes its own file, named with the
+ *                      process id appended, and a file may end with zero
+ *                      padding until it is closed. direct doesn't combine
+ *                      with RotateLogsAsync, RotateLogsMmap, RotateCompress
+ *                      or RotateLogsShared. The default is none.
+ *
+ * RotateThreadBuffer   Give each request thread of a threaded MPM its own
+ *                      RotateLogsBuffer for each log, so the threads don't
+ *                      wait for each other's buffer lock. Each thread writes
+ *                      its whole buffer in one go, and all of them are
+ *                      written to the old file before a rotation. With a
+ *                      maximum age, the service thread writes out the
+ *                      buffers of threads that have gone quiet. A thread
+ *                      gets its buffer when it first logs to the log, so a
+ *                      child can take up to ThreadsPerChild times the number
+ *                      of such logs times RotateLogsBuffer of memory, freed
+ *                      when the child exits. Not used with RotateLogsAsync,
+ *                      RotateCompress or RotateCacheHint direct. The default
+ *                      is Off.
+ *
+ * RotateOnClose        What to do with a log file once the log has moved on
+ *                      to the next one: rename <dir> moves it into dir,
+ *                      link <dir> makes a hard link to it in dir, compress
+ *                      gzips it and removes the original (needs zlib) and
+ *                      exec <program> runs program with the file name as
+ *                      its argument. The directive can be given more than
+ *                      once, the actions run in that order, each on the
+ *                      file where the one before left it. none forgets the
+ *                      actions given so far. One helper process started by
+ *                      the parent runs the actions for all logs of the
+ *                      server, so the children only send it a note. Files
+ *                      still in use when the server stops are left alone.
+ *                      Not available on Windows.
+ *
+ * RotateOnCloseDelay   How many seconds the helper waits after the last
+ *                      child to report a file before it runs the actions,
+ *                      so that the other children have moved on too. A
+ *                      child only moves on when it writes its next line,
+ *                      or at rollover with RotateScheduler; use that when
+ *                      some children are quiet. The default is 10.
+ *
+ * RotateFormat         text writes each line as mod_log_config made it.
+ *                      binary writes a record for each request instead: the
+ *                      length of the rest of the record and the number of
+ *                      fields, then each field with its length, all lengths
+ *                      as 4 byte big-endian numbers. The fields are the
+ *                      pieces mod_log_config makes of the line, so the
+ *                      literal text of the LogFormat is there too and the
+ *                      last field is the newline. Each new file starts with
+ *                      "RLOGBIN1", a 4 byte length and a text header giving
+ *                      the layout, the log and the start of its interval.
+ *                      Piped logs are always text. The default is text.
+ *
+ * RotateIndex          Keep an index next to each log file, named like it
+ *                      with .idx appended, to find the lines of a given
+ *                      time without reading the whole file. An entry is
+ *                      added when a line is at least the given number of
+ *                      seconds past the last one, on a multiple of it, and
+ *                      with the optional second argument also every so many
+ *                      bytes. Each entry is the request time in
+ *                      microseconds and the offset in the file from where
+ *                      the lines come, both as 8 byte big-endian numbers.
+ *                      The last entry of a finished file gives its end.
+ *                      Every child adds its own entries, so take the
+ *                      smallest offset near the time wanted, and lines of
+ *                      slow requests can come a little after their time.
+ *                      The offsets of compressed files are at the start of
+ *                      a gzip member or zstd frame. The default is 0, no
+ *                      index.
+ *
+ * RotateSample         Write only the given share of the log lines, a
+ *                      number above 0 and up to 1, e.g. 0.1 for every tenth
+ *                      line. Lines are left out evenly rather than at
+ *                      random. The default is 1, all lines.
+ *
+ * RotateLinesPerSec    Write at most this many lines in each calendar second
+ *                      in each child; the rest are left out. The count
+ *                      starts again with each new second, so a burst at the
+ *                      end of one second and the start of the next can let
+ *                      through up to twice as many. The default is 0, no
+ *                      limit; the most is 16777215. With this or
+ *                      RotateSample, a line saying how many lines were left
+ *                      out is written at most once a minute, to the log and
+ *                      to its RotateSink copies and sinks, or logged to the
+ *                      error log for a binary log, and the counts are in the
+ *                      SampledOut and RateLimited metrics.
+ *
+ * RotateSink           Also send the lines of the rotated logs of the server
+ *                      somewhere else, formatted only once. udp://host:port
+ *                      sends each line as a datagram, or as many as fit in
+ *                      the optional batch size in bytes. tcp://host:port
+ *                      sends them over a connection of each child and log,
+ *                      once there are batch bytes of them, 0 by default.
+ *                      Lines older than the RotateLogsBuffer age, or a
+ *                      second, are sent with the next one. Network sinks
+ *                      never block a request: the connection is made without
+ *                      waiting for it, a sink that can't keep up drops lines
+ *                      once its 64KB buffer is full, and logs how many; a
+ *                      lost connection is retried every 5 seconds. file:,
+ *                      gzip: and zstd: with a file name write the lines to
+ *                      another log with the same options, plain or
+ *                      compressed; naming the log itself is an error. The
+ *                      sinks belong to the server, not to one log: every
+ *                      rotated log of the server sends its lines to each of
+ *                      them, in its own format, so with more than one
+ *                      CustomLog in a server a file sink gets the lines of
+ *                      all of them mixed. Give the logs that need a sink of
+ *                      their own a virtual host of their own. Can be given
+ *                      more than once.
+ *
+ * RotateGrace          Lines from requests that started before a rollover go
+ *                      to the file of the slot they started in for this many
+ *                      seconds after it, rather than to the new one. The
+ *                      default is 0, off. While a file can still take lines
+ *                      it is written as name.part. Each child moves on to
+ *                      the new slot at rollover, as with RotateScheduler,
+ *                      and writes out what it holds for the old file then;
+ *                      the first child whose grace is over renames the file
+ *                      to its name. Once a file has its name, only a line
+ *                      that another child was writing at that very moment
+ *                      can still be added to it. Make it longer than the
+ *                      RotateLogsBuffer age and well under the interval.
+ *                      Only children that still have the file before open
+ *                      write late lines to it, and files still taking lines
+ *                      when the server stops keep the .part suffix.
+ *
+ * Piped logs (CustomLog "|program") aren't rotated, but they are written
+ * without blocking so that a slow program doesn't hold up requests. Lines
+ * are written in whole lines of at most PIPE_BUF bytes at a time, so that
+ * lines from different children don't get mixed up. Without a
+ * RotateLogsBuffer each line is written at once; with one, lines are held
+ * until there is PIPE_BUF worth or the maximum age has passed. When the
+ * program can't keep up, lines are kept in the buffer (64KB unless
+ * RotateLogsBuffer says otherwise) and dropped once it is full; the number
+ * dropped is logged.
+ *
+ * On a graceful restart the files of logs whose name and options haven't
+ * changed are kept open rather than opened again; the parent holds one
+ * descriptor per file and new children take it over instead of opening
+ * the file themselves. Files no longer in the config are closed.
+ *
+ * The counts of lines, writes, rotations, lock waits and so on for the whole
+ * server are shown by the log-rotate-status handler and on the mod_status
+ * page.
+ *
  * The current version of this module is available at:
  *   http://www.hexten.net/sw/mod_log_rotate/index.mhtml
  */
@@ -43,25 +322,182 @@
  * 2016/05/05 1.02      leet31337@web.de    Enabled debug logic for debugging
  */
 #include "apr_anylock.h"
+#include "apr_atomic.h"
 #include "apr_file_io.h"
+#include "apr_hash.h"
+#include "apr_mmap.h"
+#include "apr_network_io.h"
+#include "apr_optional_hooks.h"
 #include "apr_pools.h"
+#include "apr_shm.h"
 #include "apr_strings.h"
+#include "apr_tables.h"
+#include "apr_thread_cond.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_proc.h"
 #include "apr_time.h"
+#include "apr_version.h"
+
+#define APR_WANT_IOVEC
+#include "apr_want.h"
+
+#include <limits.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#if APR_HAS_MMAP
+#define RL_HAVE_MMAP        1
+#endif
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+#define RL_HAVE_COMPRESS    1
+#endif
+
+#if defined(HAVE_LIBURING) && APR_HAS_THREADS && !defined(WIN32)
+#include "apr_portable.h"
+#include <liburing.h>
+#define RL_HAVE_URING       1
+#endif
+
+#if !defined(WIN32) && APR_HAS_FORK
+#include "apr_portable.h"
+#include "apr_signal.h"
+#include <sys/socket.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef SCM_RIGHTS
+#define RL_HAVE_BROKER      1
+#endif
+#define RL_HAVE_ONCLOSE     1
+#ifdef O_DSYNC
+#define RL_HAVE_DSYNC       1
+#endif
+#if defined(__linux__) && defined(O_DIRECT)
+#define RL_HAVE_DIRECT      1
+#endif
+#if defined(__linux__) && defined(SYNC_FILE_RANGE_WRITE) && APR_HAS_THREADS
+#define RL_HAVE_WRITEBEHIND 1
+#endif
+#endif
 
 #include "httpd.h"
 #include "http_config.h"
 #include "http_log.h"
+#include "http_protocol.h"
 #include "ap_mpm.h"
+#include "mpm_common.h"
+#include "ap_listen.h"
 
 #include "mod_log_config.h"
+#include "mod_status.h"
 
 #ifndef APR_LARGEFILE
 #define APR_LARGEFILE 0
 #endif
 
+#ifndef APR_STATUS_IS_EALREADY
+#define APR_STATUS_IS_EALREADY(s) ((s) == APR_FROM_OS_ERROR(EALREADY))
+#endif
+
 #define INTERVAL_DEFAULT    (APR_USEC_PER_SEC * APR_TIME_C(3600) * APR_TIME_C(24))
 #define INTERVAL_MIN        (APR_USEC_PER_SEC * APR_TIME_C(60))
 
+/* Maximum number of fragments handed to a single writev. The iovec array
+ * lives on the stack of a request thread so we don't go beyond 64 even if
+ * the system would allow more.
+ */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define RL_MAX_IOVEC        IOV_MAX
+#else
+#define RL_MAX_IOVEC        64
+#endif
+
+/* Build with -DMOD_LOG_ROTATE_TRACE to have every rotation logged at debug
+ * level. Without it tracing costs nothing, not even a log level check.
+ */
+#ifdef MOD_LOG_ROTATE_TRACE
+#ifdef APLOG_IS_LEVEL
+#define RL_TRACE_ON(s)      APLOG_IS_LEVEL(s, APLOG_DEBUG)
+#else
+#define RL_TRACE_ON(s)      1
+#endif
+#define RL_TRACE(s, args)   do { if (RL_TRACE_ON(s)) { ap_log_error args; } } while (0)
+#else
+#define RL_TRACE(s, args)
+#endif
+
+#define ASYNC_QUEUE_DEFAULT 1024
+#define ASYNC_QUEUE_MIN     16
+#define ASYNC_BUFFER        (64 * 1024)     /* Batch buffer if not buffering*/
+#define COMPRESS_BUFFER     (64 * 1024)     /* Buffer for compressed logs   */
+#define COMPRESS_AGE        APR_USEC_PER_SEC
+#define DIRECT_ALIGN        4096            /* Block size for O_DIRECT      */
+#define DIRECT_BUFFER       (256 * 1024)    /* Buffer for O_DIRECT logs     */
+#define DIRECT_AGE          APR_USEC_PER_SEC
+#define ASYNC_CELL_MIN      256             /* Smallest line allocation     */
+#define SERVICE_TICK        (APR_USEC_PER_SEC / 10)
+#define SERVICE_NEVER       APR_INT64_MAX   /* No housekeeping due          */
+#define JITTER_DEFAULT      (2 * APR_USEC_PER_SEC)
+#define LRU_SAMPLE          APR_USEC_PER_SEC /* Last use is this accurate   */
+#define URING_ENTRIES       256             /* Submission queue size        */
+#define MMAP_CHUNK          (8 * 1024 * 1024) /* Log file mapped this much  */
+#define MMAP_ALIGN          (64 * 1024)     /* at a multiple of this offset */
+#define MMAP_LINE_MAX       (MMAP_CHUNK / 4) /* Longer lines are written    */
+#define BROKER_TIMEOUT      5000            /* Wait for the broker, in ms   */
+#define BLOCK_WAIT          (APR_USEC_PER_SEC / 1000)
+#define SIZE_PROBE_MIN      (64 * 1024)     /* Least bytes between probes   */
+#ifdef PIPE_BUF
+#define PIPE_CHUNK          PIPE_BUF        /* Largest atomic pipe write    */
+#else
+#define PIPE_CHUNK          512
+#endif
+#define PIPE_BUFFER         (64 * 1024)     /* Buffer for piped logs        */
+#define PIPE_EXIT_WAIT      APR_USEC_PER_SEC /* Time to drain at child exit */
+#define PIPE_LONG_WAIT      (APR_USEC_PER_SEC / 10) /* Most a long line waits */
+#define ONCLOSE_DELAY       (10 * APR_USEC_PER_SEC) /* Wait for children    */
+#define ONCLOSE_BUFFER      (16 * PIPE_CHUNK) /* Helper's read buffer       */
+#define STRFTIME_WIDTH      64              /* Longest strftime conversion  */
+#define SUMMARY_EVERY       60              /* Seconds between summaries    */
+#define RATE_LINES          0xffffffU       /* Most lines a second we count */
+#define GRACE_SUFFIX        ".part"         /* Files not finished yet       */
+#define GRACE_NONE          APR_INT64_MAX   /* No file to finish            */
+#define SINK_BUFFER         (64 * 1024)     /* Buffer for a network sink    */
+#define SINK_DATAGRAM_MAX   65507           /* Largest UDP payload          */
+#define SINK_AGE            APR_USEC_PER_SEC /* Oldest line held by a sink  */
+#define SINK_RETRY          (5 * APR_USEC_PER_SEC) /* Between reconnects    */
+#define BINARY_MAGIC        "RLOGBIN1"      /* Start of a binary log file   */
+#define BINARY_VERSION      1
+#define METRICS_PUSH        APR_USEC_PER_SEC /* Publish counters this often */
+#define METRICS_PUSH_LINES  256             /* or after this many lines     */
+#define METRICS_SETS        16              /* Sets of counters per child   */
+#define CACHE_LINE          64              /* Bytes in a cache line        */
+
+/* Bytes written to a log are counted with atomics on the request path. A
+ * 64 bit counter needs APR 1.7, older versions limit RotateMaxSize to 4GB.
+ */
+#if APR_VERSION_AT_LEAST(1,7,0)
+typedef apr_uint64_t rl_bytes_t;
+#define RL_BYTES_MAX        APR_UINT64_MAX
+#define RL_BYTES_ADD(p, n)  apr_atomic_add64(p, n)
+#define RL_BYTES_READ(p)    apr_atomic_read64(p)
+#define RL_BYTES_SET(p, n)  apr_atomic_set64(p, n)
+#else
+typedef apr_uint32_t rl_bytes_t;
+#define RL_BYTES_MAX        APR_UINT32_MAX
+#define RL_BYTES_ADD(p, n)  apr_atomic_add32(p, n)
+#define RL_BYTES_READ(p)    apr_atomic_read32(p)
+#define RL_BYTES_SET(p, n)  apr_atomic_set32(p, n)
+#endif
+
 static int xfer_flags = (APR_WRITE | APR_APPEND | APR_CREATE | APR_LARGEFILE);
 static apr_fileperms_t xfer_perms = APR_OS_DEFAULT;
 
@@ -73,348 +509,6356 @@ typedef enum {
     RL_SUBSTITUTIONS = 2            /* Rotation and substitution is enabled */
 } rl_enabled;
 
+typedef enum {
+    RL_COMPRESS_NONE = 0,           /* Logs are written as they are         */
+    RL_COMPRESS_GZIP = 1,           /* Logs are gzip compressed             */
+    RL_COMPRESS_ZSTD = 2            /* Logs are zstd compressed             */
+} rl_compress;
+
+typedef enum {
+    RL_OVERFLOW_BLOCK = 0,          /* Wait for room in the async queue     */
+    RL_OVERFLOW_DROP  = 1,          /* Drop the line and count it           */
+    RL_OVERFLOW_SPILL = 2           /* Write the line to the spill file     */
+} rl_overflow;
+
+typedef enum {
+    RL_SYNC_NONE     = 0,           /* Leave it to the OS                   */
+    RL_SYNC_ROTATE   = 1,           /* Sync a file when it is rotated out   */
+    RL_SYNC_INTERVAL = 2,           /* Also sync from the service thread    */
+    RL_SYNC_ALWAYS   = 3            /* Open files with O_DSYNC              */
+} rl_sync;
+
+typedef enum {
+    RL_CACHE_NONE     = 0,          /* Leave the page cache alone           */
+    RL_CACHE_DONTNEED = 1,          /* Drop files from the cache on close   */
+    RL_CACHE_DIRECT   = 2           /* Bypass the cache with O_DIRECT       */
+} rl_cache;
+
+typedef enum {
+    RL_FORMAT_TEXT   = 0,           /* Lines as mod_log_config made them    */
+    RL_FORMAT_BINARY = 1            /* Length prefixed records of fields    */
+} rl_format;
+
+/* A RotateSink of a server, kept in log_options.sinks.
+ */
+typedef struct {
+    char            type;           /* u udp, t tcp, f file, g gzip, z zstd */
+    const char      *target;        /* host:port or file name               */
+    apr_size_t      batch;          /* Bytes to gather before sending       */
+} rl_sink_conf;
+
+/* Options a server can set, as bits in log_options.set so a vhost can be
+ * merged with the main server one directive at a time.
+ */
+typedef enum {
+    RL_SET_ENABLED,                 /* RotateLogs                           */
+    RL_SET_LOCALT,                  /* RotateLogsLocalTime                  */
+    RL_SET_INTERVAL,                /* RotateInterval                       */
+    RL_SET_OFFSET,                  /* and its offset                       */
+    RL_SET_BUFFER,                  /* RotateLogsBuffer                     */
+    RL_SET_BUFFER_AGE,              /* and its age                          */
+    RL_SET_ASYNC,                   /* RotateLogsAsync                      */
+    RL_SET_ASYNC_QUEUE,             /* RotateAsyncQueue                     */
+    RL_SET_OVERFLOW,                /* RotateAsyncOverflow                  */
+    RL_SET_SHARED,                  /* RotateLogsShared                     */
+    RL_SET_PREOPEN,                 /* RotatePreopen                        */
+    RL_SET_COMPRESS,                /* RotateCompress                       */
+    RL_SET_MAX_SIZE,                /* RotateMaxSize                        */
+    RL_SET_SCHEDULE,                /* RotateScheduler                      */
+    RL_SET_JITTER,                  /* and its jitter                       */
+    RL_SET_IDLE_CLOSE,              /* RotateIdleClose                      */
+    RL_SET_MAX_OPEN,                /* RotateMaxOpen                        */
+    RL_SET_MMAP,                    /* RotateLogsMmap                       */
+    RL_SET_SYNC,                    /* RotateSync                           */
+    RL_SET_CACHE_HINT,              /* RotateCacheHint                      */
+    RL_SET_THREAD_BUFFER,           /* RotateThreadBuffer                   */
+    RL_SET_ON_CLOSE,                /* RotateOnClose                        */
+    RL_SET_ON_CLOSE_DELAY,          /* RotateOnCloseDelay                   */
+    RL_SET_FORMAT,                  /* RotateFormat                         */
+    RL_SET_INDEX,                   /* RotateIndex                          */
+    RL_SET_SAMPLE,                  /* RotateSample                         */
+    RL_SET_MAX_LINES,               /* RotateLinesPerSec                    */
+    RL_SET_SINKS,                   /* RotateSink                           */
+    RL_SET_GRACE                    /* RotateGrace                          */
+} rl_option;
+
+#define RL_SET(ls, o)       ((ls)->set |= (apr_uint64_t) 1 << (o))
+#define RL_IS_SET(ls, o)    (0 != ((ls)->set & ((apr_uint64_t) 1 << (o))))
+
 typedef struct {
+    apr_uint64_t    set;            /* Options given here, bits of rl_option*/
     rl_enabled      enabled;        /* Rotation enabled                     */
     apr_time_t      interval;       /* Rotation interval                    */
     apr_time_t      offset;         /* Offset from midnight                 */
     int             localt;         /* Use local time instead of GMT        */
+    apr_size_t      buffer_size;    /* Size of the write buffer, 0 = off    */
+    apr_time_t      buffer_age;     /* Max age of buffered data, 0 = any    */
+    int             async;          /* Hand lines to the writer thread      */
+    int             async_queue;    /* Number of entries in the async queue */
+    rl_overflow     overflow;       /* What to do when the queue is full    */
+    const char      *spill;         /* Spill file for RL_OVERFLOW_SPILL     */
+    int             shared;         /* Rotate through the broker process    */
+    apr_time_t      preopen;        /* Open the next file this early        */
+    rl_compress     compress;       /* Compression for the log files        */
+    int             compress_level; /* Compression level, -1 = default      */
+    apr_off_t       max_size;       /* Rotate within the slot past this size*/
+    int             schedule;       /* Rotate from the service thread       */
+    apr_time_t      jitter;         /* Spread scheduled opens over this     */
+    apr_time_t      idle_close;     /* Close the file after this idle time  */
+    int             max_open;       /* Most files open in a child, 0 = any  */
+    int             mmap;           /* Write through a memory mapping       */
+    rl_sync         sync;           /* When data is pushed out to disk      */
+    apr_time_t      sync_interval;  /* Time between syncs for interval      */
+    rl_cache        cache_hint;     /* How to treat the page cache          */
+    apr_off_t       writebehind;    /* Start writeback every so many bytes  */
+    int             thread_buffer;  /* A buffer for each request thread     */
+    const char      *on_close;      /* RotateOnClose actions, packed        */
+    apr_size_t      on_close_len;   /* Length of on_close                   */
+    apr_time_t      on_close_delay; /* Wait this long for other children    */
+    rl_format       format;         /* How lines are written to the file    */
+    apr_time_t      index_every;    /* Index entry this often, 0 = never    */
+    apr_off_t       index_bytes;    /* or after this many bytes, 0 = never  */
+    apr_uint32_t    sample;         /* Share of lines kept in 2^-32, 0 = all*/
+    apr_uint32_t    max_lines;      /* Most lines a second, 0 = any         */
+    apr_array_header_t *sinks;      /* rl_sink_conf, NULL if none           */
+    apr_time_t      grace;          /* Late lines go to the old file, 0 = no*/
 } log_options;
 
+/* Compressor state for a log. Every flush of the buffer is compressed into
+ * a complete gzip member or zstd frame and written with a single write, so
+ * concurrent children don't interleave and a file cut short by a crash can
+ * still be read up to the last flush.
+ */
+typedef struct {
+    rl_compress     type;           /* Which compressor                     */
+    char            *out;           /* Output buffer                        */
+    apr_size_t      out_size;       /* Allocated size of out                */
+#ifdef HAVE_ZLIB
+    z_stream        zs;             /* Deflate stream producing gzip        */
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx       *cctx;          /* Zstd compression context             */
+#endif
+} rl_compressor;
+
+/* A piece of a compiled log file name: literal text or a conversion.
+ * Conversions that aren't rendered here keep their text for strftime.
+ */
+typedef struct {
+    char            conv;           /* Conversion character, 0 for literal  */
+    const char      *text;          /* Literal text or strftime conversion  */
+    apr_size_t      len;            /* Length of the text                   */
+} rl_segment;
+
+/* A strftime style log file name compiled into its pieces.
+ */
+typedef struct {
+    rl_segment      *segs;          /* The pieces in order                  */
+    int             nsegs;          /* Number of pieces                     */
+    apr_size_t      max_len;        /* Longest name the template can make   */
+    int             has_seq;        /* Says where the file number goes (%N) */
+} rl_template;
+
+/* The mapped part of a log file for RotateLogsMmap. Writers reserve space
+ * by bumping tail and copy their line in without a lock. A writer whose
+ * reservation runs past the end of the mapping lowers cut to the start of
+ * its reservation instead, so cut tells how much of the mapping really
+ * holds lines when the next chunk is mapped.
+ */
+typedef struct {
+    apr_mmap_t      *mm;            /* The mapping, NULL if not mapped      */
+    char            *base;          /* Start of the mapping                 */
+    apr_off_t       offset;         /* File offset of the mapping           */
+    apr_uint32_t    size;           /* Size of the mapping                  */
+    volatile apr_uint32_t tail;     /* Next free byte of the mapping        */
+    volatile apr_uint32_t cut;      /* First reservation that didn't fit    */
+} rl_map;
+
+/* Where an O_DIRECT log stands. The buffer always starts at a block
+ * boundary of the file, and the partial block at its end is kept after a
+ * flush so that it can be written again, completed, by the next one.
+ */
+typedef struct {
+    apr_off_t       offset;         /* File offset of the start of buf      */
+    apr_size_t      done;           /* Bytes of buf already in the file     */
+} rl_direct;
+
+/* A piped log. Lines are gathered in the buffer of the log and written
+ * to the pipe without blocking, so a slow reader doesn't hold up requests.
+ */
+typedef struct {
+    int             batch;          /* Hold lines as for RotateLogsBuffer   */
+    apr_uint32_t    dropped;        /* Lines dropped since last reported    */
+} rl_pipe;
+
+/* A network RotateSink of a log. Lines are gathered in its own buffer and
+ * sent without blocking; what the other end won't take stays in the buffer
+ * and new lines are dropped once it is full. Each child has its own socket,
+ * made on the first line and again a while after an error.
+ */
+typedef struct rl_sink {
+    struct rl_sink  *next;          /* Next sink of the log                 */
+    const rl_sink_conf *conf;       /* What it was configured as            */
+    apr_pool_t      *pool;          /* Pool of the log                      */
+    apr_pool_t      *conn_pool;     /* Holds the socket, NULL when closed   */
+    apr_sockaddr_t  *addr;          /* Where to send                        */
+    apr_socket_t    *sock;          /* Socket, NULL until made              */
+    int             connecting;     /* TCP connect not finished yet         */
+    apr_anylock_t   lock;           /* Serialises writers                   */
+    char            *buf;           /* Lines not sent yet                   */
+    apr_size_t      len;            /* Bytes in buf                         */
+    apr_size_t      size;           /* Size of buf                          */
+    apr_uint32_t    lines;          /* Lines in buf                         */
+    apr_time_t      time;           /* When the oldest of them came         */
+    apr_time_t      age;            /* Send lines this old even if few      */
+    apr_time_t      retry;          /* No new socket before this            */
+    apr_uint32_t    dropped;        /* Lines dropped since last reported    */
+} rl_sink;
+
+/* The buffer of one request thread for one log, see RotateThreadBuffer.
+ * Its thread only touches it while holding a reference from ap_lock_log,
+ * so whoever has quiesced the log may write out all of them. Otherwise
+ * only the service thread, writing out an old buffer, sets busy too.
+ */
+typedef struct rl_tbuf {
+    struct rl_tbuf  *next;          /* Next buffer of the same log          */
+    char            *buf;           /* The buffered lines                   */
+    apr_size_t      len;            /* Bytes currently held in buf          */
+    apr_time_t      time;           /* When the oldest buffered line came   */
+    volatile apr_uint32_t busy;     /* Set while a thread works on buf      */
+} rl_tbuf;
+
+/* A queued log line. The cell's sequence number tells producers and the
+ * writer thread who owns it, see ap_queue_log and ap_drain_log.
+ */
+typedef struct {
+    volatile apr_uint32_t seq;      /* Sequence number of the cell          */
+    apr_time_t      time;           /* Request time of the queued line      */
+    apr_size_t      len;            /* Length of the queued line            */
+    apr_size_t      size;           /* Allocated size of data               */
+    char            *data;          /* The queued line                      */
+} rl_cell;
+
+/* Bounded lock-free multi-producer queue feeding the writer thread.
+ */
+typedef struct {
+    rl_cell         *cells;         /* The cells, a power of two of them    */
+    apr_uint32_t    mask;           /* Number of cells - 1                  */
+    volatile apr_uint32_t head;     /* Next cell for a producer to claim    */
+    apr_uint32_t    tail;           /* Next cell for the writer thread      */
+    volatile apr_uint32_t dropped;  /* Lines dropped since last reported    */
+    int             flush;          /* Flush after every drained batch      */
+    apr_pool_t      *pool;          /* Child pool for the spill file        */
+    apr_file_t      *spill_fd;      /* Spill file, opened on first use      */
+    apr_anylock_t   spill_lock;     /* Serialises writes to the spill file  */
+} rl_ring;
+
 typedef struct {
     apr_pool_t      *pool;          /* Our working pool                     */
     const char      *fname;         /* Basename for logs without extension  */
+    rl_template     *tpl;           /* Compiled fname if it has conversions */
     apr_file_t      *fd;            /* Current open log file                */
     apr_time_t      logtime;        /* Quantised time of current log file   */
-    apr_anylock_t   read_lock;      /* An alias for the read lock           */
-    apr_anylock_t   write_lock;     /* An alias for the write lock          */
+    apr_time_exp_t  logtime_exp;    /* logtime broken down for file names   */
+    apr_time_t      slot_start;     /* Real time the current slot started   */
+    apr_time_t      slot_end;       /* Real time the current slot ends      */
+    int             seq;            /* Number of the current file in slot   */
+    volatile rl_bytes_t bytes;      /* Bytes in the current file, estimate  */
+    rl_bytes_t      size_check;     /* Look at the real size past this      */
+    apr_anylock_t   rotate_lock;    /* Serialises rotation of the log       */
+    volatile apr_uint32_t active;   /* Writers currently using the log      */
+    volatile apr_uint32_t rotating; /* Non zero while the log is rotated    */
+    volatile apr_uint32_t written;  /* Written to in the current slot       */
+    volatile apr_uint32_t used;     /* Written to since the last visit      */
+    apr_time_t      last_used;      /* When the log was last seen in use    */
+    volatile apr_uint32_t dirty;    /* Written to since the last sync       */
+    apr_time_t      synced;         /* When the log was last synced         */
+    char            *buf;           /* Write buffer, NULL if not buffering  */
+    apr_size_t      buf_len;        /* Bytes currently held in the buffer   */
+    apr_time_t      buf_time;       /* When the oldest buffered line came   */
+    apr_anylock_t   buf_lock;       /* Serialises writers sharing the buffer*/
+    rl_ring         *ring;          /* Async queue, NULL if writing inline  */
+    rl_compressor   *zip;           /* Compressor, NULL if not compressing  */
+    rl_map          *map;           /* Mapping, NULL if not RotateLogsMmap  */
+    rl_direct       *dio;           /* O_DIRECT state, NULL if not direct   */
+    rl_pipe         *pipe;          /* Piped log state, NULL if not piped   */
+    rl_sink         *sinks;         /* Network sinks, NULL if none          */
+    apr_file_t      *prev_fd;       /* RotateGrace: the file before, or NULL*/
+    apr_pool_t      *prev_pool;     /* and its pool                         */
+    const char      *prev_name;     /* Its finished name, NULL if none      */
+    apr_time_t      prev_start;     /* Start of its slot                    */
+    apr_time_t      prev_slot_end;  /* End of its slot                      */
+    apr_time_t      prev_end;       /* When it is finished                  */
+    apr_array_header_t *copies;     /* Other files the lines go to, or NULL */
+    rl_tbuf * volatile tbufs;       /* Buffers of the request threads       */
+    char            *file_name;     /* Current file name for RotateOnClose  */
+    apr_file_t      *idx_fd;        /* RotateIndex file of the current file */
+    apr_time_t      idx_due;        /* Next entry for a line this late      */
+    rl_bytes_t      idx_mark;       /* or once the file is past this        */
+    volatile apr_uint32_t indexing; /* A writer is adding an index entry    */
+    volatile apr_uint32_t sample_seq; /* Lines seen by RotateSample         */
+    volatile apr_uint32_t rate;     /* Second and lines taken in it         */
+    volatile apr_uint32_t sampled_out; /* Lines left out since the summary  */
+    volatile apr_uint32_t limited;  /* Lines over the rate since then       */
+    volatile apr_uint32_t summary_sec; /* When the next summary is due      */
+    apr_off_t       wb_mark;        /* Writeback started up to here         */
+    apr_off_t       wb_prev;        /* and for the stretch from here        */
+#ifdef RL_HAVE_URING
+    char            *ubuf;          /* Spare buffer while buf is written    */
+    apr_size_t      ulen;           /* Bytes of the write in flight         */
+    int             upending;       /* A write is in flight on the ring     */
+    volatile apr_uint32_t ugen;     /* Bumped when a file is retired        */
+#endif
+    int             index;          /* Position in rotated_logs             */
+    apr_file_t      *next_fd;       /* File opened early for the next slot  */
+    apr_pool_t      *next_pool;     /* Pool next_fd was opened in           */
+    apr_time_t      next_logtime;   /* Quantised time next_fd belongs to    */
+    apr_file_t      *old_fd;        /* Rotated out file waiting for close   */
+    apr_pool_t      *old_pool;      /* Pool old_fd was opened in            */
 
+    const log_options *conf;        /* Options as configured for the server */
     log_options     st;             /* Embedded config options              */
 } rotated_log;
 
-static const char *ap_pstrftime(apr_pool_t *p, const char *format, apr_time_exp_t *tm) {
-    size_t got, len = strlen(format) + 1;
-    const char *fp = strchr(format, '%');
-    char *buf = NULL;
-    while (NULL != fp) {
-        len += 10;   /* approx only, will fail if anything generates a huge expansion */
-        fp = strchr(fp + 1, '%');
-    }
-
-    buf = apr_palloc(p, len);
-    apr_strftime(buf, &got, len, format, tm);
-    return buf;
+/* Does a log with these options need the per-child service thread?
+ */
+static int ap_wants_service(const log_options *ls) {
+    return ls->async || ls->preopen > 0 || ls->schedule ||
+           ls->idle_close > 0 || ls->max_open > 0 ||
+           RL_SYNC_ROTATE == ls->sync || RL_SYNC_INTERVAL == ls->sync ||
+           ls->writebehind > 0 || ls->grace > 0 ||
+           (ls->thread_buffer && ls->buffer_age > 0);
 }
 
-static apr_file_t *ap_open_log(apr_pool_t *p, server_rec *s, const char *name, log_options *ls, apr_time_t tm) {
-    apr_file_t *fd;
-    apr_status_t rv;
-    apr_time_t log_time;
-
-    log_time = tm - ls->offset;
-    if (RL_SUBSTITUTIONS == ls->enabled) {
-        apr_time_exp_t e;
+/* Do two servers have the same RotateSinks?
+ */
+static int ap_same_sinks(const apr_array_header_t *a, const apr_array_header_t *b) {
+    int i;
 
-        apr_time_exp_gmt(&e, log_time);
-        name = ap_pstrftime(p, name, &e);
+    if (NULL == a || NULL == b) {
+        return a == b;
     }
-    else
-    {
-        /* Synthesize the log name using the specified time in seconds as a
-         * suffix.  We subtract the offset here because it was added when
-         * quantizing the time but we want the name to reflect the actual
-         * time when the log rotated. We don't reverse the local time
-         * adjustment because, presumably, if you've specified local time
-         * logging you want the filenames to use local time.
-         */
-        name = apr_psprintf(p, "%s.%" APR_TIME_T_FMT, name, apr_time_sec(log_time));
+    if (a->nelts != b->nelts) {
+        return 0;
     }
+    for (i = 0; i < a->nelts; ++i) {
+        const rl_sink_conf *x = &APR_ARRAY_IDX(a, i, rl_sink_conf);
+        const rl_sink_conf *y = &APR_ARRAY_IDX(b, i, rl_sink_conf);
 
-    if (rv = apr_file_open(&fd, name, xfer_flags, xfer_perms, p), APR_SUCCESS != rv) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
-                        "could not open transfer log file %s.", name);
-        return NULL;
+        if (x->type != y->type || x->batch != y->batch || strcmp(x->target, y->target)) {
+            return 0;
+        }
     }
+    return 1;
+}
 
-    return fd;
+/* Can logs configured with these options share one rotated_log?
+ */
+static int ap_same_options(const log_options *a, const log_options *b) {
+    return a->enabled == b->enabled &&
+           a->interval == b->interval &&
+           a->offset == b->offset &&
+           a->localt == b->localt &&
+           a->buffer_size == b->buffer_size &&
+           a->buffer_age == b->buffer_age &&
+           a->async == b->async &&
+           a->async_queue == b->async_queue &&
+           a->overflow == b->overflow &&
+           (a->spill == b->spill ||
+            (NULL != a->spill && NULL != b->spill && !strcmp(a->spill, b->spill))) &&
+           a->shared == b->shared &&
+           a->preopen == b->preopen &&
+           a->compress == b->compress &&
+           a->compress_level == b->compress_level &&
+           a->max_size == b->max_size &&
+           a->schedule == b->schedule &&
+           a->jitter == b->jitter &&
+           a->idle_close == b->idle_close &&
+           a->max_open == b->max_open &&
+           a->mmap == b->mmap &&
+           a->sync == b->sync &&
+           a->sync_interval == b->sync_interval &&
+           a->cache_hint == b->cache_hint &&
+           a->writebehind == b->writebehind &&
+           a->thread_buffer == b->thread_buffer &&
+           a->on_close_len == b->on_close_len &&
+           (0 == a->on_close_len || !memcmp(a->on_close, b->on_close, a->on_close_len)) &&
+           a->on_close_delay == b->on_close_delay &&
+           a->format == b->format &&
+           a->index_every == b->index_every &&
+           a->index_bytes == b->index_bytes &&
+           a->sample == b->sample &&
+           a->max_lines == b->max_lines &&
+           ap_same_sinks(a->sinks, b->sinks) &&
+           a->grace == b->grace;
 }
 
-static apr_status_t ap_close_log(server_rec *s, apr_file_t *fd) {
-    apr_status_t rv;
+/* All rotated logs created for the current configuration so that buffers
+ * can be flushed when a child exits, and the same logs by file name so
+ * that vhosts logging to the same file share one.
+ */
+static apr_array_header_t *rotated_logs = NULL;
+static apr_hash_t *rotated_names = NULL;
 
-    if (rv = apr_file_close(fd), APR_SUCCESS != rv) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
-                        "error closing transfer log file.");
-    }
+/* Piped logs, which aren't rotated but are flushed at child exit too */
+static apr_array_header_t *piped_logs = NULL;
 
-    return rv;
-}
+/* Number of rotated log files this child has open, for RotateMaxOpen */
+static volatile apr_uint32_t open_logs = 0;
 
-/* Quantize the supplied time to the log rotation interval applying offsets as
- * specified in the config.
+/* What the module has been doing, for the log-rotate-status handler and
+ * mod_status. Each child counts with atomics in its own memory, so that
+ * children don't fight over the cache lines, and now and then adds what it
+ * counted since the last time to the totals in shared memory. Within a
+ * child the threads spread over METRICS_SETS sets of counters, each on
+ * cache lines of its own, so that the two counts of every line don't make
+ * all of them take turns at one cache line. Without the shared memory a
+ * child can only report its own counts. The totals live in the process
+ * pool, so they carry on across restarts.
  */
-static apr_time_t ap_get_quantized_time(rotated_log *rl, apr_time_t tm) {
-    apr_time_t localadj = 0;
+typedef enum {
+    RL_M_LINES = 0,                 /* Lines handed to us                   */
+    RL_M_BYTES,                     /* Bytes in those lines                 */
+    RL_M_WRITES,                    /* Write system calls                   */
+    RL_M_WRITE_ERRORS,              /* Writes that failed                   */
+    RL_M_FLUSHES,                   /* Buffers written out                  */
+    RL_M_DROPS,                     /* Lines dropped by queues and pipes    */
+    RL_M_SAMPLED,                   /* Lines left out by RotateSample       */
+    RL_M_LIMITED,                   /* Lines over RotateLinesPerSec         */
+    RL_M_ROTATIONS,                 /* Switches to a new file               */
+    RL_M_ROTATE_USEC,               /* Time taken by those, in microseconds */
+    RL_M_OPEN_FAILURES,             /* Rotations that kept the old file     */
+    RL_M_LOCK_WAITS,                /* Writers that took the rotate lock    */
+    RL_M_WAIT_10US,                 /* and waited less than 10us for it,    */
+    RL_M_WAIT_100US,                /* less than 100us,                     */
+    RL_M_WAIT_1MS,                  /* less than 1ms,                       */
+    RL_M_WAIT_10MS,                 /* less than 10ms,                      */
+    RL_M_WAIT_100MS,                /* less than 100ms                      */
+    RL_M_WAIT_MORE,                 /* or longer                            */
+    RL_M_COUNT
+} rl_metric;
 
-    if (rl->st.localt) {
-        apr_time_exp_t lt;
-        apr_time_exp_lt(&lt, tm);
-        localadj = (apr_time_t) lt.tm_gmtoff * APR_USEC_PER_SEC;
-    }
+static const char *const metric_names[RL_M_COUNT] = {
+    "Lines", "Bytes", "Writes", "WriteErrors", "Flushes", "Drops",
+    "SampledOut", "RateLimited", "Rotations", "RotateMicroseconds",
+    "OpenFailures", "LockWaits",
+    "LockWait10us", "LockWait100us", "LockWait1ms", "LockWait10ms",
+    "LockWait100ms", "LockWaitLonger"
+};
+
+typedef struct {
+    rl_bytes_t      count[RL_M_COUNT];
+} rl_metrics;
+
+/* One set of a child's counters. The padding keeps the first counters of
+ * the next set, the busy ones, off the cache lines of this one.
+ */
+typedef struct {
+    rl_metrics      counts;
+    char            pad[CACHE_LINE];
+} rl_metric_set;
+
+static rl_metric_set metrics[METRICS_SETS];     /* This child's counts      */
+static rl_bytes_t metrics_pushed[RL_M_COUNT];   /* Part already in the shm  */
+static rl_metrics *metrics_shm = NULL;          /* Totals of all children   */
+static volatile apr_uint32_t metrics_pushing = 0;
+
+/* The set of counters for the current thread.
+ */
+static int ap_metric_set(void) {
+#if APR_HAS_THREADS
+    apr_os_thread_t t = apr_os_thread_current();
+    apr_uint64_t h = 0;
 
-    return ((tm + rl->st.offset + localadj) / rl->st.interval) * rl->st.interval;
+    memcpy(&h, &t, sizeof(t) < sizeof(h) ? sizeof(t) : sizeof(h));
+    return (int) ((((apr_uint32_t) (h >> 12) * 2654435761U) >> 16) % METRICS_SETS);
+#else
+    return 0;
+#endif
 }
 
-/* Get a lock on the log, rotating to a new log if the quantized time has
- * rolled over. If it returns APR_SUCCESS, the lock is held, otherwise it is
- * not.
+#define RL_METRIC(m, n)     RL_BYTES_ADD(&metrics[ap_metric_set()].counts.count[m], \
+                                     (rl_bytes_t) (n))
+
+/* A counter of this child, over all the sets.
  */
-static apr_status_t ap_lock_log(rotated_log *rl, request_rec *r) {
-    apr_status_t rv = 0;
-    apr_file_t *ofd;
-    apr_pool_t *par, *np;
-    apr_time_t logt = ap_get_quantized_time(rl, r->request_time);
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, r->server, "New: %lu, old: %lu",
-    (unsigned long) logt, (unsigned long) rl->logtime);
-
-    /* Get a read lock */
-    if (rv = APR_ANYLOCK_LOCK(&rl->read_lock), APR_SUCCESS != rv) {
-        return rv;
+static rl_bytes_t ap_metric_read(int m) {
+    rl_bytes_t v = 0;
+    int i;
+
+    for (i = 0; i < METRICS_SETS; ++i) {
+        v += RL_BYTES_READ(&metrics[i].counts.count[m]);
     }
+    return v;
+}
 
-    /* Decide if the quantized time has rolled over into a new slot. */
-    if (logt == rl->logtime && NULL != rl->fd) { return APR_SUCCESS; }
+/* Add what this child has counted since the last time to the totals.
+ */
+static void ap_push_metrics(void) {
+    rl_bytes_t v;
+    int i;
 
-    /* Unlock the read lock */
-    if (rv = APR_ANYLOCK_UNLOCK(&rl->read_lock), APR_SUCCESS != rv) {
-        return rv;
+    if (NULL == metrics_shm || 0 != apr_atomic_xchg32(&metrics_pushing, 1)) {
+        return;
     }
 
-    /* Get the write lock */
-    if (rv = APR_ANYLOCK_LOCK(&rl->write_lock), APR_SUCCESS != rv) {
-        return rv;
+    for (i = 0; i < RL_M_COUNT; ++i) {
+        if (v = ap_metric_read(i), v != metrics_pushed[i]) {
+            RL_BYTES_ADD(&metrics_shm->count[i], v - metrics_pushed[i]);
+            metrics_pushed[i] = v;
+        }
     }
 
-    /* Now check again in case someone else rotated the log while we waited
-     * for the write lock.
-     */
-    if (logt == rl->logtime && NULL != rl->fd) {
-        /* Unlock the write lock */
-        if (rv = APR_ANYLOCK_UNLOCK(&rl->write_lock), APR_SUCCESS != rv) {
-            return rv;
-        }
+    apr_atomic_set32(&metrics_pushing, 0);
+}
 
-        /* Get the read lock */
-        return APR_ANYLOCK_LOCK(&rl->write_lock);
-    }
+/* Put the time a writer waited for the rotate lock in the histogram.
+ */
+static void ap_metric_wait(apr_interval_time_t t) {
+    apr_interval_time_t limit;
+    int m = RL_M_WAIT_10US;
 
-    ofd = rl->fd;
-    rl->logtime = logt;
-    /* Create a new pool to provide storage for the new file.
-     * Once we have the new file open we'll destroy the old
-     * pool and make this one current.
-     */
-    par = apr_pool_parent_get(rl->pool);
-    if (rv = apr_pool_create(&np, par), APR_SUCCESS != rv) {
-        APR_ANYLOCK_UNLOCK(&rl->write_lock);
-        return rv;
+    for (limit = 10; t >= limit && m < RL_M_WAIT_MORE; limit *= 10) {
+        ++m;
     }
+    RL_METRIC(RL_M_LOCK_WAITS, 1);
+    RL_METRIC(m, 1);
+}
 
-    /* Replace the current log file */
-    if (rl->fd = ap_open_log(np, r->server, rl->fname, &rl->st, logt), NULL == rl->fd) {
-        /* Open failed so keep going with the old log... */
-        rl->fd = ofd;
-        /* ...and destroy the new pool. */
-        apr_pool_destroy(np);
-    } else {
-        /* Close the old log... */
-        ap_close_log(r->server, ofd);
-        /* ...and switch to the new pool. */
-        apr_pool_destroy(rl->pool);
-        rl->pool = np;
-    }
+#ifdef RL_HAVE_BROKER
+/* With RotateLogsShared the log files are opened by a single broker process
+ * forked from the parent. At rollover each child sends it a request for the
+ * new file along with a socket for the reply, and the broker answers with
+ * the descriptor, opening the file only for the first child that asks.
+ */
+typedef struct {
+    apr_uint32_t    index;          /* Position of the log in rotated_logs  */
+    apr_time_t      logtime;        /* Quantized time of the wanted file    */
+    apr_uint32_t    seq;            /* Number of the wanted file in slot    */
+} rl_broker_req;
 
-    /* Unlock the write lock */
-    if (rv = APR_ANYLOCK_UNLOCK(&rl->write_lock), APR_SUCCESS != rv) {
-        return rv;
+typedef struct {
+    apr_status_t    status;         /* APR_SUCCESS if a descriptor follows  */
+} rl_broker_rep;
+
+static int broker_fd = -1;          /* Our end of the broker socket         */
+#endif
+
+#if APR_HAS_THREADS
+/* The per-child service thread. It writes out async logs and looks after
+ * housekeeping such as opening files ahead of rollover.
+ */
+typedef struct {
+    apr_thread_t        *thread;    /* The service thread                   */
+    apr_thread_mutex_t  *mutex;     /* Protects the condition               */
+    apr_thread_cond_t   *cond;      /* Signalled when there is work to do   */
+    volatile apr_uint32_t sleeping; /* Non zero while the thread waits      */
+    volatile apr_uint32_t stop;     /* Non zero when the child exits        */
+    volatile apr_uint32_t poke;     /* Non zero when housekeeping is wanted */
+    server_rec          *s;         /* Main server for error logging        */
+} rl_service;
+
+static rl_service *service = NULL;
+
+/* The buffers of a request thread for RotateThreadBuffer, by the index
+ * of the log, allocated from a pool of the thread's own. All of them are
+ * on the threads list, to be freed when the child exits.
+ */
+typedef struct rl_thread {
+    struct rl_thread    *next;      /* Next thread with buffers             */
+    apr_pool_t          *pool;      /* Arena for the thread's buffers       */
+    rl_tbuf             **bufs;     /* Buffers by rotated_log index         */
+    int                 nbufs;      /* Number of entries in bufs            */
+} rl_thread;
+
+static apr_threadkey_t *thread_key = NULL;
+static rl_thread * volatile threads = NULL;
+#endif
+
+static const char day_names[7][10] = {
+    "Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday"
+};
+
+static const char month_names[12][10] = {
+    "January", "February", "March", "April", "May", "June", "July",
+    "August", "September", "October", "November", "December"
+};
+
+/* The longest expansion of a conversion in a log file name. Conversions
+ * rendered by strftime get STRFTIME_WIDTH, which it truncates them to.
+ */
+static apr_size_t ap_conv_width(char c) {
+    switch (c) {
+    case 'Y': case 'C': case 'N':
+        return 11;
+    case 's':
+        return 20;
+    case 'A': case 'B':
+        return 9;
+    case 'z':
+        return 5;
+    case 'a': case 'b': case 'h': case 'j':
+        return 3;
+    case 'd': case 'e': case 'H': case 'I': case 'k': case 'l': case 'm':
+    case 'M': case 'p': case 'S': case 'U': case 'W': case 'y':
+        return 2;
+    case 'u': case 'w':
+        return 1;
+    default:
+        return STRFTIME_WIDTH;
     }
+}
 
-    /* If we don't have a file, return an error */
-    if (NULL == rl->fd) {
-        return APR_ENOENT;
+/* Parse a strftime style log file name into the segments of a template.
+ * Returns NULL or a description of what is wrong with the name.
+ */
+static const char *ap_parse_template(apr_pool_t *p, rl_template *tpl,
+                                     apr_array_header_t *segs, const char *fmt) {
+    const char *fp, *err = NULL;
+    rl_segment *seg;
+
+    while ('\0' != *fmt && NULL == err) {
+        if (fp = strchr(fmt, '%'), fp != fmt) {
+            /* Literal text up to the next conversion */
+            seg = apr_array_push(segs);
+            seg->conv = 0;
+            seg->text = fmt;
+            seg->len  = NULL == fp ? strlen(fmt) : (apr_size_t) (fp - fmt);
+            tpl->max_len += seg->len;
+            fmt += seg->len;
+            continue;
+        }
+
+        switch (fmt[1]) {
+        case '\0':
+            return "% at the end of the name";
+        case '%':
+            seg = apr_array_push(segs);
+            seg->conv = 0;
+            seg->text = fmt + 1;
+            seg->len  = 1;
+            tpl->max_len += 1;
+            break;
+        case 'D':
+            err = ap_parse_template(p, tpl, segs, "%m/%d/%y");
+            break;
+        case 'F':
+            err = ap_parse_template(p, tpl, segs, "%Y-%m-%d");
+            break;
+        case 'R':
+            err = ap_parse_template(p, tpl, segs, "%H:%M");
+            break;
+        case 'T':
+            err = ap_parse_template(p, tpl, segs, "%H:%M:%S");
+            break;
+        default:
+            /* Anything else is left to strftime, as names always were. The
+             * E and O modifiers go with the conversion they modify.
+             */
+            seg = apr_array_push(segs);
+            seg->conv = fmt[1];
+            seg->text = fmt;
+            seg->len  = ('E' == fmt[1] || 'O' == fmt[1]) && '\0' != fmt[2] ? 3 : 2;
+            tpl->max_len += ap_conv_width(fmt[1]);
+            tpl->has_seq |= ('N' == fmt[1]);
+            fmt += seg->len;
+            continue;
+        }
+        fmt += 2;
     }
 
-    /* Get the read lock */
-    return APR_ANYLOCK_LOCK(&rl->read_lock);
+    return err;
 }
 
-/* Release the lock on the log
+/* Compile a log file name once at startup so that naming a new file neither
+ * reparses the format nor has to guess how long the result will be.
+ * Returns NULL or a description of what is wrong with the name.
  */
-static apr_status_t ap_unlock_log(rotated_log *rl, request_rec *r) {
-    return APR_ANYLOCK_UNLOCK(&rl->read_lock);
+static const char *ap_compile_template(apr_pool_t *p, const char *name, rl_template **tplp) {
+    apr_array_header_t *segs = apr_array_make(p, 8, sizeof(rl_segment));
+    rl_template *tpl = apr_pcalloc(p, sizeof(rl_template));
+    const char *err;
+
+    if (err = ap_parse_template(p, tpl, segs, name), NULL != err) {
+        return err;
+    }
+
+    tpl->segs  = (rl_segment *) segs->elts;
+    tpl->nsegs = segs->nelts;
+    *tplp = tpl;
+
+    return NULL;
 }
 
-/* Called by mod_log_config to write a log file line.
+/* Expand a single conversion into d, which has room for its widest
+ * expansion. Returns the length of the expansion.
  */
-static apr_status_t ap_rotated_log_writer(request_rec *r, void *handle,
-                                          const char **strs, int *strl,
-                                          int nelts, apr_size_t len) {
-    char *str;
-    char *s;
-    int i;
-    apr_status_t rv = 0;
-    rotated_log *rl = (rotated_log *) handle;
+static apr_size_t ap_render_conv(char *d, const rl_segment *seg, const apr_time_exp_t *e,
+                                 apr_time_t tm, int seq) {
+    char c        = seg->conv;
+    apr_size_t n  = ap_conv_width(c) + 1;
+    int year      = e->tm_year + 1900;
+    int hour12    = (e->tm_hour + 11) % 12 + 1;
 
-    if (NULL == rl) {
-        ap_log_rerror(APLOG_MARK, APLOG_CRIT, APR_EGENERAL, r,
-            "log rotation information not found.");
-        return APR_EGENERAL;
-    }
+    switch (c) {
+    case 'Y': return apr_snprintf(d, n, "%d", year);
+    case 'C': return apr_snprintf(d, n, "%02d", year / 100);
+    case 'y': return apr_snprintf(d, n, "%02d", year % 100);
+    case 'm': return apr_snprintf(d, n, "%02d", e->tm_mon + 1);
+    case 'd': return apr_snprintf(d, n, "%02d", e->tm_mday);
+    case 'e': return apr_snprintf(d, n, "%2d", e->tm_mday);
+    case 'j': return apr_snprintf(d, n, "%03d", e->tm_yday + 1);
+    case 'H': return apr_snprintf(d, n, "%02d", e->tm_hour);
+    case 'k': return apr_snprintf(d, n, "%2d", e->tm_hour);
+    case 'I': return apr_snprintf(d, n, "%02d", hour12);
+    case 'l': return apr_snprintf(d, n, "%2d", hour12);
+    case 'M': return apr_snprintf(d, n, "%02d", e->tm_min);
+    case 'S': return apr_snprintf(d, n, "%02d", e->tm_sec);
+    case 'p': return apr_snprintf(d, n, "%s", e->tm_hour < 12 ? "AM" : "PM");
+    case 'u': return apr_snprintf(d, n, "%d", 0 == e->tm_wday ? 7 : e->tm_wday);
+    case 'w': return apr_snprintf(d, n, "%d", e->tm_wday);
+    case 'U': return apr_snprintf(d, n, "%02d", (e->tm_yday + 7 - e->tm_wday) / 7);
+    case 'W': return apr_snprintf(d, n, "%02d", (e->tm_yday + 7 - (e->tm_wday + 6) % 7) / 7);
+    case 'a': return apr_snprintf(d, n, "%.3s", day_names[e->tm_wday]);
+    case 'A': return apr_snprintf(d, n, "%s", day_names[e->tm_wday]);
+    case 'b':
+    case 'h': return apr_snprintf(d, n, "%.3s", month_names[e->tm_mon]);
+    case 'B': return apr_snprintf(d, n, "%s", month_names[e->tm_mon]);
+    case 'z': return apr_snprintf(d, n, "%c%02d%02d", e->tm_gmtoff < 0 ? '-' : '+',
+                                  abs(e->tm_gmtoff) / 3600, abs(e->tm_gmtoff) / 60 % 60);
+    case 's': return apr_snprintf(d, n, "%" APR_TIME_T_FMT, apr_time_sec(tm));
+    case 'N': return apr_snprintf(d, n, "%d", seq);
+    default:
+        {
+            apr_time_exp_t x = *e;
+            char conv[4];
+            apr_size_t got = 0;
 
-    str = apr_palloc(r->pool, len + 1);
-    for (i = 0, s = str; i < nelts; ++i) {
-        memcpy(s, strs[i], strl[i]);
-        s += strl[i];
+            memcpy(conv, seg->text, seg->len);
+            conv[seg->len] = '\0';
+            if (APR_SUCCESS != apr_strftime(d, &got, n, conv, &x)) {
+                got = 0;
+            }
+            return got;
+        }
     }
+}
 
-    if (RL_DISABLED == rl->st.enabled) {
-        return apr_file_write(rl->fd, str, &len);
-    }
+/* Make the name of file number seq of the slot starting at tm, which e
+ * has broken down.
+ */
+static const char *ap_render_template(apr_pool_t *p, const rl_template *tpl,
+                                      const apr_time_exp_t *e, apr_time_t tm, int seq) {
+    char *buf, *d;
+    int i;
 
-    if (rv = ap_lock_log(rl, r), APR_SUCCESS != rv) {
-        return rv;
-    }
+    d = buf = apr_palloc(p, tpl->max_len + 1);
+    for (i = 0; i < tpl->nsegs; ++i) {
+        const rl_segment *seg = &tpl->segs[i];
 
-    if (rv = apr_file_write(rl->fd, str, &len), APR_SUCCESS != rv) {
-        return rv;
+        if (0 == seg->conv) {
+            memcpy(d, seg->text, seg->len);
+            d += seg->len;
+        } else {
+            d += ap_render_conv(d, seg, e, tm, seq);
+        }
     }
+    *d = '\0';
 
-    return ap_unlock_log(rl, r);
+    return buf;
 }
 
-/* Called my mod_log_config to initialise a log writer.
+/* Make the name of file number seq of a log for the quantized time tm.
  */
-static void *ap_rotated_log_writer_init(apr_pool_t *p, server_rec *s, const char* name) {
-    apr_status_t rv;
-    log_options *ls     = ap_get_module_config(s->module_config, &log_rotate_module);
-    rotated_log *rl     = apr_palloc(p, sizeof(rotated_log));
-    rl->pool            = NULL;
-    rl->fname           = NULL;
-    rl->write_lock.type = apr_anylock_none;
-    rl->read_lock.type  = apr_anylock_none;
-    rl->logtime         = 0;
-    rl->st              = *ls;
+static const char *ap_log_name(apr_pool_t *p, rotated_log *rl, apr_time_t tm, int seq) {
+    log_options *ls = &rl->st;
+    const char *name;
+    apr_time_t log_time;
 
-    /* We have piped log handling here because once log rotation has been
-     * enabled we become responsible for /all/ transfer log output server
-     * wide. That's a consequence of the way the log output hooks in
+    /* A log that doesn't rotate is the file as it was given */
+    if (RL_DISABLED == ls->enabled) {
+        return rl->fname;
+    }
+
+    log_time = tm - ls->offset;
+    if (NULL != rl->tpl) {
+        apr_time_exp_t e;
+
+        /* The current file's time was broken down when the slot was set */
+        if (tm != rl->logtime) {
+            apr_time_exp_gmt(&e, log_time);
+        }
+        name = ap_render_template(p, rl->tpl, tm != rl->logtime ? &e : &rl->logtime_exp,
+                                  log_time, seq);
+    }
+    else
+    {
+        /* Synthesize the log name using the specified time in seconds as a
+         * suffix.  We subtract the offset here because it was added when
+         * quantizing the time but we want the name to reflect the actual
+         * time when the log rotated. We don't reverse the local time
+         * adjustment because, presumably, if you've specified local time
+         * logging you want the filenames to use local time.
+         */
+        name = apr_psprintf(p, "%s.%" APR_TIME_T_FMT, rl->fname, apr_time_sec(log_time));
+    }
+
+    /* Files after the first in a slot get a numeric suffix unless the name
+     * says where the number goes.
+     */
+    if (seq > 0 && (NULL == rl->tpl || !rl->tpl->has_seq)) {
+        name = apr_psprintf(p, "%s.%d", name, seq);
+    }
+
+#if !defined(WIN32) && APR_HAS_FORK
+    /* Mapped and O_DIRECT logs can't be shared between processes, each
+     * child has its own. Even with a single child the next one overlaps
+     * with it after a graceful restart or MaxConnectionsPerChild.
+     */
+    if (ls->mmap || RL_CACHE_DIRECT == ls->cache_hint) {
+        int forked = AP_MPMQ_NOT_SUPPORTED;
+
+        ap_mpm_query(AP_MPMQ_IS_FORKED, &forked);
+        if (AP_MPMQ_NOT_SUPPORTED != forked) {
+            name = apr_psprintf(p, "%s.%" APR_PID_T_FMT, name, getpid());
+        }
+    }
+#endif
+
+    if (RL_COMPRESS_GZIP == ls->compress) {
+        name = apr_pstrcat(p, name, ".gz", NULL);
+    } else if (RL_COMPRESS_ZSTD == ls->compress) {
+        name = apr_pstrcat(p, name, ".zst", NULL);
+    }
+
+    return name;
+}
+
+/* Store n in four bytes, most significant first.
+ */
+static void ap_put_u32(char *d, apr_uint32_t n) {
+    d[0] = (char) (n >> 24);
+    d[1] = (char) (n >> 16);
+    d[2] = (char) (n >> 8);
+    d[3] = (char) n;
+}
+
+#ifdef RL_HAVE_COMPRESS
+/* Compress a piece of data on its own into a complete gzip member or zstd
+ * frame, for the header of a compressed binary log or a late line for
+ * RotateGrace.
+ */
+static apr_status_t ap_compress_once(apr_pool_t *p, const log_options *ls,
+                                     const char *in, apr_size_t len,
+                                     const char **out, apr_size_t *out_len) {
+    char *buf;
+
+    switch (ls->compress) {
+#ifdef HAVE_ZLIB
+    case RL_COMPRESS_GZIP: {
+        z_stream zs;
+        uLong bound;
+        int zrv;
+
+        memset(&zs, 0, sizeof(zs));
+        if (Z_OK != deflateInit2(&zs, ls->compress_level < 0 ? Z_DEFAULT_COMPRESSION
+                                                             : ls->compress_level,
+                                 Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY)) {
+            return APR_EGENERAL;
+        }
+        bound = deflateBound(&zs, (uLong) len);
+        buf   = apr_palloc(p, bound);
+        zs.next_in   = (Bytef *) in;
+        zs.avail_in  = (uInt) len;
+        zs.next_out  = (Bytef *) buf;
+        zs.avail_out = (uInt) bound;
+        zrv = deflate(&zs, Z_FINISH);
+        *out_len = zs.total_out;
+        deflateEnd(&zs);
+        if (Z_STREAM_END != zrv) {
+            return APR_EGENERAL;
+        }
+        break;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case RL_COMPRESS_ZSTD: {
+        size_t bound = ZSTD_compressBound(len), n;
+
+        buf = apr_palloc(p, bound);
+        n = ZSTD_compress(buf, bound, in, len,
+                          ls->compress_level < 0 ? ZSTD_CLEVEL_DEFAULT : ls->compress_level);
+        if (ZSTD_isError(n)) {
+            return APR_EGENERAL;
+        }
+        *out_len = n;
+        break;
+    }
+#endif
+    default:
+        return APR_ENOTIMPL;
+    }
+
+    *out = buf;
+    return APR_SUCCESS;
+}
+#endif
+
+/* RotateFormat binary: see that a new log file starts with the schema
+ * header. The header goes into a file of our own which is then linked to
+ * the name, so that nobody can append a record to the file before the
+ * header is in it. If the link finds the file there, somebody else made
+ * it. Only without hard links is the file created in place.
+ */
+static void ap_write_schema(apr_pool_t *p, server_rec *s, rotated_log *rl,
+                            const char *name, apr_time_t tm) {
+    static volatile apr_uint32_t serial = 0;
+    apr_status_t rv;
+    apr_finfo_t finfo;
+    apr_file_t *fd;
+    const char *schema, *tmp, *out;
+    apr_size_t hlen, len;
+    char *hdr;
+
+    if (APR_SUCCESS == apr_stat(&finfo, name, APR_FINFO_TYPE, p)) {
+        return;
+    }
+
+    /* The magic, the length of the text and the text */
+    schema = apr_psprintf(p,
+                          "format: mod_log_rotate binary %d\n"
+                          "byte-order: big-endian\n"
+                          "record: u32 length of the rest, u32 number of fields, "
+                          "then each field as u32 length and bytes\n"
+                          "fields: the pieces of the line from mod_log_config, "
+                          "literal text included\n"
+                          "log: %s\n"
+                          "start: %" APR_TIME_T_FMT "\n",
+                          BINARY_VERSION, rl->fname, apr_time_sec(tm - rl->st.offset));
+    len  = strlen(schema);
+    hlen = sizeof(BINARY_MAGIC) - 1 + 4 + len;
+    hdr  = apr_palloc(p, hlen);
+    memcpy(hdr, BINARY_MAGIC, sizeof(BINARY_MAGIC) - 1);
+    ap_put_u32(hdr + sizeof(BINARY_MAGIC) - 1, (apr_uint32_t) len);
+    memcpy(hdr + sizeof(BINARY_MAGIC) - 1 + 4, schema, len);
+    out = hdr;
+    len = hlen;
+
+#ifdef RL_HAVE_COMPRESS
+    if (RL_COMPRESS_NONE != rl->st.compress &&
+        (rv = ap_compress_once(p, &rl->st, hdr, hlen, &out, &len), APR_SUCCESS != rv)) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "could not compress the schema header for %s.", name);
+        return;
+    }
+#endif
+
+#if !defined(WIN32) && APR_HAS_FORK
+    tmp = apr_psprintf(p, "%s.%" APR_PID_T_FMT ".%u.hdr", name, getpid(),
+                       apr_atomic_inc32(&serial));
+#else
+    tmp = apr_psprintf(p, "%s.%u.hdr", name, apr_atomic_inc32(&serial));
+#endif
+
+    if (rv = apr_file_open(&fd, tmp, APR_WRITE | APR_CREATE | APR_EXCL | APR_BINARY,
+                           xfer_perms, p), APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "could not write the schema header for %s.", name);
+        return;
+    }
+    rv = apr_file_write_full(fd, out, len, NULL);
+    apr_file_close(fd);
+    if (APR_SUCCESS == rv) {
+        rv = apr_file_link(tmp, name);
+    }
+    apr_file_remove(tmp, p);
+
+    if (APR_SUCCESS == rv || APR_STATUS_IS_EEXIST(rv)) {
+        return;
+    }
+
+    /* No hard links here, the file is bare for a moment */
+    if (rv = apr_file_open(&fd, name, APR_WRITE | APR_CREATE | APR_EXCL | APR_BINARY,
+                           xfer_perms, p), APR_SUCCESS == rv) {
+        rv = apr_file_write_full(fd, out, len, NULL);
+        apr_file_close(fd);
+    }
+    if (APR_SUCCESS != rv && !APR_STATUS_IS_EEXIST(rv)) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "could not write the schema header for %s.", name);
+    }
+}
+
+/* RotateFormat binary: turn the pieces of a line into a record. It starts
+ * with its length and the number of fields, and each piece becomes a field
+ * preceded by its length. The arrays are made in p.
+ */
+static void ap_make_record(apr_pool_t *p, const char ***strsp, int **strlp,
+                           int *neltsp, apr_size_t *lenp) {
+    int i, nelts = *neltsp;
+    const char **strs = apr_palloc(p, (2 * nelts + 1) * sizeof(char *));
+    int *strl         = apr_palloc(p, (2 * nelts + 1) * sizeof(int));
+    char *lens        = apr_palloc(p, 4 * (nelts + 2));
+    apr_size_t len    = 8 + 4 * (apr_size_t) nelts + *lenp;
+
+    ap_put_u32(lens, (apr_uint32_t) (len - 4));
+    ap_put_u32(lens + 4, (apr_uint32_t) nelts);
+    strs[0] = lens;
+    strl[0] = 8;
+    for (i = 0; i < nelts; ++i) {
+        ap_put_u32(lens + 8 + 4 * i, (apr_uint32_t) (*strlp)[i]);
+        strs[2 * i + 1] = lens + 8 + 4 * i;
+        strl[2 * i + 1] = 4;
+        strs[2 * i + 2] = (*strsp)[i];
+        strl[2 * i + 2] = (*strlp)[i];
+    }
+
+    *strsp  = strs;
+    *strlp  = strl;
+    *neltsp = 2 * nelts + 1;
+    *lenp   = len;
+}
+
+#if defined(RL_HAVE_DSYNC) || defined(RL_HAVE_DIRECT)
+/* The mode apr_file_open would create a file with for perms.
+ */
+static mode_t ap_perms_mode(apr_fileperms_t perms) {
+    mode_t mode = 0;
+
+    if (APR_OS_DEFAULT == perms) {
+        return 0666;
+    }
+
+    mode |= (perms & APR_USETID)   ? S_ISUID : 0;
+    mode |= (perms & APR_UREAD)    ? S_IRUSR : 0;
+    mode |= (perms & APR_UWRITE)   ? S_IWUSR : 0;
+    mode |= (perms & APR_UEXECUTE) ? S_IXUSR : 0;
+    mode |= (perms & APR_GSETID)   ? S_ISGID : 0;
+    mode |= (perms & APR_GREAD)    ? S_IRGRP : 0;
+    mode |= (perms & APR_GWRITE)   ? S_IWGRP : 0;
+    mode |= (perms & APR_GEXECUTE) ? S_IXGRP : 0;
+    mode |= (perms & APR_WSTICKY)  ? S_ISVTX : 0;
+    mode |= (perms & APR_WREAD)    ? S_IROTH : 0;
+    mode |= (perms & APR_WWRITE)   ? S_IWOTH : 0;
+    mode |= (perms & APR_WEXECUTE) ? S_IXOTH : 0;
+
+    return mode;
+}
+#endif
+
+static apr_file_t *ap_open_log(apr_pool_t *p, server_rec *s, rotated_log *rl,
+                               apr_time_t tm, int seq) {
+    log_options *ls = &rl->st;
+    const char *name = ap_log_name(p, rl, tm, seq), *done = NULL;
+    apr_file_t *fd;
+    apr_finfo_t finfo, pinfo;
+    apr_status_t rv;
+
+    /* RotateGrace: the file gets its name once it is finished. A child that
+     * comes to a file another one has finished already adds to it, so that
+     * its own finish doesn't replace the file with a short one.
+     */
+    if (ls->grace > 0 && RL_DISABLED != ls->enabled &&
+        APR_SUCCESS != apr_stat(&finfo, name, APR_FINFO_TYPE, p)) {
+        done = name;
+        name = apr_pstrcat(p, name, GRACE_SUFFIX, NULL);
+    }
+
+    if (RL_FORMAT_BINARY == ls->format) {
+        ap_write_schema(p, s, rl, name, tm);
+    }
+
+#if defined(RL_HAVE_DSYNC) || defined(RL_HAVE_DIRECT)
+    /* APR has no flags for O_DSYNC or O_DIRECT, so RotateSync always and
+     * RotateCacheHint direct open the file themselves. O_DIRECT files are
+     * written at explicit offsets rather than appended to.
+     */
+    if (RL_SYNC_ALWAYS == ls->sync || RL_CACHE_DIRECT == ls->cache_hint) {
+        int oflags = O_WRONLY | O_APPEND | O_CREAT;
+        int aflags = xfer_flags & ~APR_CREATE;
+        int osfd;
+
+#ifdef RL_HAVE_DSYNC
+        if (RL_SYNC_ALWAYS == ls->sync) {
+            oflags |= O_DSYNC;
+        }
+#endif
+#ifdef RL_HAVE_DIRECT
+        if (RL_CACHE_DIRECT == ls->cache_hint) {
+            oflags = (oflags & ~(O_WRONLY | O_APPEND)) | O_RDWR | O_DIRECT;
+            aflags = (aflags & ~APR_APPEND) | APR_READ;
+        }
+#endif
+        /* Created with the same permissions as apr_file_open would use */
+        if (osfd = open(name, oflags, ap_perms_mode(xfer_perms)), osfd < 0) {
+            rv = APR_FROM_OS_ERROR(errno);
+        } else if (fcntl(osfd, F_SETFD, FD_CLOEXEC),
+                   rv = apr_os_file_put(&fd, &osfd, aflags, p), APR_SUCCESS != rv) {
+            close(osfd);
+        }
+    } else
+#endif
+    rv = apr_file_open(&fd, name, xfer_flags | (ls->mmap ? APR_READ : 0), xfer_perms, p);
+
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "could not open transfer log file %s.", name);
+        return NULL;
+    }
+
+    /* The file may have been finished between the stat and the open, which
+     * then made a new .part. Other children may have it open already, so
+     * it stays for ap_end_grace to add to the finished file, and this one
+     * adds to the finished file straight away.
+     */
+    if (NULL != done && APR_SUCCESS == apr_stat(&finfo, done, APR_FINFO_IDENT, p) &&
+        APR_SUCCESS == apr_file_info_get(&pinfo, APR_FINFO_IDENT, fd) &&
+        (finfo.inode != pinfo.inode || finfo.device != pinfo.device)) {
+        apr_file_close(fd);
+        return ap_open_log(p, s, rl, tm, seq);
+    }
+
+    return fd;
+}
+
+static apr_status_t ap_close_log(server_rec *s, apr_file_t *fd) {
+    apr_status_t rv;
+
+    if (rv = apr_file_close(fd), APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "error closing transfer log file.");
+    }
+
+    return rv;
+}
+
+/* Push the data written to a log file out to disk.
+ */
+static apr_status_t ap_sync_file(server_rec *s, apr_file_t *fd) {
+    apr_status_t rv;
+
+#if APR_VERSION_AT_LEAST(1,6,0)
+    rv = apr_file_datasync(fd);
+#else
+    rv = APR_ENOTIMPL;
+#endif
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "error syncing transfer log file.");
+    }
+
+    return rv;
+}
+
+/* Close a file that has been rotated out of a log, syncing it first if the
+ * log asks for that. Synced files, and with RotateCacheHint dontneed all
+ * files, are dropped from the page cache as nobody is going to read them
+ * back.
+ */
+static apr_status_t ap_finish_log(rotated_log *rl, server_rec *s, apr_file_t *fd) {
+    int drop = (RL_SYNC_ALWAYS == rl->st.sync || RL_CACHE_DONTNEED == rl->st.cache_hint);
+
+    if ((RL_SYNC_ROTATE == rl->st.sync || RL_SYNC_INTERVAL == rl->st.sync) &&
+        APR_SUCCESS == ap_sync_file(s, fd)) {
+        drop = 1;
+    }
+#if defined(POSIX_FADV_DONTNEED) && !defined(WIN32)
+    if (drop) {
+        apr_os_file_t osfd;
+
+        if (APR_SUCCESS == apr_os_file_get(&osfd, fd)) {
+            posix_fadvise(osfd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+    }
+#endif
+
+    return ap_close_log(s, fd);
+}
+
+/* The size of an open log file, 0 if it can't be found out.
+ */
+static apr_off_t ap_file_size(apr_file_t *fd) {
+    apr_finfo_t finfo;
+
+    if (APR_SUCCESS != apr_file_info_get(&finfo, APR_FINFO_SIZE, fd)) {
+        return 0;
+    }
+    return finfo.size;
+}
+
+/* Count bytes written to the current file of a log for RotateMaxSize.
+ */
+static void ap_count_log(rotated_log *rl, apr_size_t n) {
+    if (rl->st.max_size > 0 || rl->st.index_bytes > 0) {
+        RL_BYTES_ADD(&rl->bytes, (rl_bytes_t) n);
+    }
+}
+
+/* Set the byte count of a log from the real size of its file. Other
+ * children may be appending to the same file without us knowing, so the
+ * count is only an estimate and the real size is looked at again once the
+ * count passes size_check. The check moves halfway towards RotateMaxSize
+ * each time, so there are few probes and the last one is exact for a file
+ * that only we write to. The caller must have exclusive access to the log.
+ */
+static void ap_set_size(rotated_log *rl, apr_off_t size) {
+    apr_off_t step;
+
+    rl->wb_mark = size;
+    rl->wb_prev = size;
+
+    if (0 == rl->st.max_size) {
+        rl->size_check = RL_BYTES_MAX;
+        return;
+    }
+
+    if (size >= rl->st.max_size) {
+        /* We couldn't move to a new file, try again a bit later */
+        step = SIZE_PROBE_MIN;
+    } else if (step = (rl->st.max_size - size) / 2, step < SIZE_PROBE_MIN) {
+        step = rl->st.max_size - size;
+    }
+
+    RL_BYTES_SET(&rl->bytes, (rl_bytes_t) size);
+    rl->size_check = ((apr_uint64_t) (size + step) > (apr_uint64_t) RL_BYTES_MAX) ?
+                        RL_BYTES_MAX : (rl_bytes_t) (size + step);
+}
+
+/* One gathered write for ap_writev_log.
+ */
+static apr_status_t ap_writev_full(apr_file_t *fd, struct iovec *vec, apr_size_t n) {
+    apr_status_t rv = apr_file_writev_full(fd, vec, n, NULL);
+
+    RL_METRIC(RL_M_WRITES, 1);
+    if (APR_SUCCESS != rv) {
+        RL_METRIC(RL_M_WRITE_ERRORS, 1);
+    }
+    return rv;
+}
+
+/* Write a log line straight from the fragments supplied by mod_log_config,
+ * optionally preceded by head_len bytes at head. Fragments are gathered into
+ * writev calls of at most RL_MAX_IOVEC entries so no copy is needed.
+ */
+static apr_status_t ap_writev_log(apr_file_t *fd, const char *head, apr_size_t head_len,
+                                  const char **strs, int *strl, int nelts) {
+    struct iovec vec[RL_MAX_IOVEC];
+    apr_size_t n = 0;
+    apr_status_t rv;
+    int i;
+
+    if (head_len > 0) {
+        vec[n].iov_base = (void *) head;
+        vec[n].iov_len  = head_len;
+        ++n;
+    }
+
+    for (i = 0; i < nelts; ++i) {
+        if (0 == strl[i]) {
+            continue;
+        }
+
+        vec[n].iov_base = (void *) strs[i];
+        vec[n].iov_len  = strl[i];
+        if (++n == RL_MAX_IOVEC) {
+            if (rv = ap_writev_full(fd, vec, n), APR_SUCCESS != rv) {
+                return rv;
+            }
+            n = 0;
+        }
+    }
+
+    if (n > 0) {
+        return ap_writev_full(fd, vec, n);
+    }
+
+    return APR_SUCCESS;
+}
+
+#ifdef RL_HAVE_COMPRESS
+/* Make sure the compressor's output buffer can hold need bytes.
+ */
+static apr_status_t ap_compress_reserve(rl_compressor *z, apr_size_t need) {
+    if (z->out_size < need) {
+        free(z->out);
+        if (z->out = malloc(need), NULL == z->out) {
+            z->out_size = 0;
+            return APR_ENOMEM;
+        }
+        z->out_size = need;
+    }
+    return APR_SUCCESS;
+}
+
+/* Compress the fragments, len bytes in all, into one complete gzip member or
+ * zstd frame and append it to the log with a single write. The caller must
+ * have the same access to the log as for ap_flush_log.
+ */
+static apr_status_t ap_compress_log(rotated_log *rl, const char **strs,
+                                    const int *strl, int nelts, apr_size_t len) {
+    rl_compressor *z = rl->zip;
+    apr_size_t out_len = 0;
+    apr_status_t rv;
+    int i;
+
+    switch (z->type) {
+#ifdef HAVE_ZLIB
+    case RL_COMPRESS_GZIP:
+        deflateReset(&z->zs);
+        if (rv = ap_compress_reserve(z, deflateBound(&z->zs, (uLong) len) + 32),
+            APR_SUCCESS != rv) {
+            return rv;
+        }
+
+        z->zs.next_out  = (Bytef *) z->out;
+        z->zs.avail_out = (uInt) z->out_size;
+        for (i = 0; i < nelts; ++i) {
+            /* deflate says Z_BUF_ERROR for an empty field, e.g. %q */
+            if (0 == strl[i]) {
+                continue;
+            }
+            z->zs.next_in  = (Bytef *) strs[i];
+            z->zs.avail_in = (uInt) strl[i];
+            if (Z_OK != deflate(&z->zs, Z_NO_FLUSH)) {
+                return APR_EGENERAL;
+            }
+        }
+        if (Z_STREAM_END != deflate(&z->zs, Z_FINISH)) {
+            return APR_EGENERAL;
+        }
+        out_len = z->out_size - z->zs.avail_out;
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case RL_COMPRESS_ZSTD:
+    {
+        ZSTD_outBuffer out;
+        ZSTD_inBuffer in;
+        size_t left;
+
+        if (rv = ap_compress_reserve(z, ZSTD_compressBound(len)), APR_SUCCESS != rv) {
+            return rv;
+        }
+
+        out.dst  = z->out;
+        out.size = z->out_size;
+        out.pos  = 0;
+        for (i = 0; i < nelts; ++i) {
+            in.src  = strs[i];
+            in.size = strl[i];
+            in.pos  = 0;
+            while (in.pos < in.size) {
+                if (ZSTD_isError(ZSTD_compressStream2(z->cctx, &out, &in, ZSTD_e_continue))) {
+                    return APR_EGENERAL;
+                }
+            }
+        }
+
+        in.src  = NULL;
+        in.size = 0;
+        in.pos  = 0;
+        do {
+            left = ZSTD_compressStream2(z->cctx, &out, &in, ZSTD_e_end);
+            if (ZSTD_isError(left) || (left > 0 && out.pos == out.size)) {
+                return APR_EGENERAL;
+            }
+        } while (left > 0);
+        out_len = out.pos;
+        break;
+    }
+#endif
+    default:
+        return APR_ENOTIMPL;
+    }
+
+    RL_METRIC(RL_M_WRITES, 1);
+    if (rv = apr_file_write_full(rl->fd, z->out, out_len, NULL), APR_SUCCESS == rv) {
+        ap_count_log(rl, out_len);
+    } else {
+        RL_METRIC(RL_M_WRITE_ERRORS, 1);
+    }
+    return rv;
+}
+
+/* Release a compressor when its configuration goes away.
+ */
+static apr_status_t ap_compressor_cleanup(void *data) {
+    rl_compressor *z = data;
+
+#ifdef HAVE_ZLIB
+    if (RL_COMPRESS_GZIP == z->type) {
+        deflateEnd(&z->zs);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (NULL != z->cctx) {
+        ZSTD_freeCCtx(z->cctx);
+        z->cctx = NULL;
+    }
+#endif
+    free(z->out);
+    z->out = NULL;
+
+    return APR_SUCCESS;
+}
+
+/* Set up the compressor configured for a log.
+ */
+static apr_status_t ap_compressor_create(apr_pool_t *p, rotated_log *rl) {
+    rl_compressor *z = apr_pcalloc(p, sizeof(rl_compressor));
+    int level = rl->st.compress_level;
+
+    z->type = rl->st.compress;
+    switch (z->type) {
+#ifdef HAVE_ZLIB
+    case RL_COMPRESS_GZIP:
+        /* windowBits + 16 asks zlib for a gzip wrapper */
+        if (Z_OK != deflateInit2(&z->zs, level < 0 ? Z_DEFAULT_COMPRESSION : level,
+                                 Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY)) {
+            return APR_EGENERAL;
+        }
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case RL_COMPRESS_ZSTD:
+        if (z->cctx = ZSTD_createCCtx(), NULL == z->cctx) {
+            return APR_ENOMEM;
+        }
+        if (level >= 0) {
+            ZSTD_CCtx_setParameter(z->cctx, ZSTD_c_compressionLevel, level);
+        }
+        break;
+#endif
+    default:
+        return APR_ENOTIMPL;
+    }
+
+    apr_pool_cleanup_register(p, z, ap_compressor_cleanup, apr_pool_cleanup_null);
+    rl->zip = z;
+
+    return APR_SUCCESS;
+}
+#endif
+
+#ifdef RL_HAVE_URING
+/* With io_uring the service thread doesn't write async logs itself. When a
+ * log's buffer is flushed it is queued on the ring as a write to the log's
+ * slot in a registered file table and the log carries on with a spare
+ * buffer; all the writes of a pass over the queues are then submitted and
+ * reaped with a single system call. A write in flight holds a reference
+ * through the file table, so the file may be rotated out and closed under
+ * it. Each log has at most one write in flight, which keeps its writes in
+ * order. A slot is keyed on the file and the log's ugen, which goes up
+ * whenever a file of the log is retired, as a new file may get the same
+ * descriptor or even the same apr_file_t; once nothing is in flight the
+ * slots of retired files are cleared so the table doesn't keep them open.
+ */
+typedef struct {
+    struct io_uring ring;           /* The ring                             */
+    apr_os_thread_t owner;          /* The service thread, the only user    */
+    int             ready;          /* owner has been set                   */
+    apr_file_t      **files;        /* File registered for each log         */
+    apr_uint32_t    *gens;          /* and the log's ugen at the time       */
+    unsigned        inflight;       /* Writes queued and not yet reaped     */
+} rl_uring;
+
+static rl_uring *uring = NULL;
+
+/* Does the current thread write this log through the ring?
+ */
+static int ap_uring_mine(rotated_log *rl) {
+    return NULL != uring && NULL != rl->ubuf && uring->ready &&
+           apr_os_thread_equal(uring->owner, apr_os_thread_current());
+}
+
+/* Clear the slots of files that have been retired since they were
+ * registered. Nothing may be in flight.
+ */
+static void ap_uring_forget(void) {
+    int i, none = -1;
+
+    for (i = 0; i < rotated_logs->nelts; ++i) {
+        rotated_log *rl = APR_ARRAY_IDX(rotated_logs, i, rotated_log *);
+
+        if (NULL != uring->files[i] && uring->gens[i] != apr_atomic_read32(&rl->ugen) &&
+            io_uring_register_files_update(&uring->ring, i, &none, 1) >= 0) {
+            uring->files[i] = NULL;
+        }
+    }
+}
+
+/* Submit whatever is queued on the ring and wait for every write in flight.
+ */
+static void ap_uring_reap(server_rec *s) {
+    struct io_uring_cqe *cqe;
+    rotated_log *rl;
+    int ret, i;
+
+    if (NULL == uring) {
+        return;
+    }
+    if (0 == uring->inflight) {
+        ap_uring_forget();
+        return;
+    }
+
+    io_uring_submit_and_wait(&uring->ring, uring->inflight);
+    while (uring->inflight > 0) {
+        while (ret = io_uring_wait_cqe(&uring->ring, &cqe), -EINTR == ret)
+            ;
+        if (ret < 0) {
+            /* We can't tell what became of the writes, forget them */
+            ap_log_error(APLOG_MARK, APLOG_ERR, APR_FROM_OS_ERROR(-ret), s,
+                            "error waiting for transfer log writes.");
+            for (i = 0; i < rotated_logs->nelts; ++i) {
+                APR_ARRAY_IDX(rotated_logs, i, rotated_log *)->upending = 0;
+            }
+            uring->inflight = 0;
+            return;
+        }
+
+        rl = io_uring_cqe_get_data(cqe);
+        RL_METRIC(RL_M_WRITES, 1);
+        if (cqe->res < 0 || (apr_size_t) cqe->res != rl->ulen) {
+            RL_METRIC(RL_M_WRITE_ERRORS, 1);
+            ap_log_error(APLOG_MARK, APLOG_ERR,
+                            cqe->res < 0 ? APR_FROM_OS_ERROR(-cqe->res) : APR_EGENERAL, s,
+                            "error writing buffered transfer log data, "
+                            "%" APR_SIZE_T_FMT " bytes lost.",
+                            rl->ulen - (cqe->res > 0 ? (apr_size_t) cqe->res : 0));
+        } else {
+            ap_count_log(rl, rl->ulen);
+        }
+        rl->upending = 0;
+        io_uring_cqe_seen(&uring->ring, cqe);
+        --uring->inflight;
+    }
+    ap_uring_forget();
+}
+
+/* Queue the buffer of a log as a write on the ring and give the log the
+ * spare buffer. Returns APR_SUCCESS if the write was queued; anything else
+ * leaves the buffer alone for the caller to write itself.
+ */
+static apr_status_t ap_uring_write(rotated_log *rl, server_rec *s) {
+    struct io_uring_sqe *sqe;
+    apr_os_file_t osfd;
+    apr_uint32_t gen = apr_atomic_read32(&rl->ugen);
+    char *b;
+
+    if (rl->upending) {
+        ap_uring_reap(s);
+    }
+
+    /* The file table is brought up to date lazily after a rotation */
+    if (uring->files[rl->index] != rl->fd || uring->gens[rl->index] != gen) {
+        if (APR_SUCCESS != apr_os_file_get(&osfd, rl->fd) ||
+            io_uring_register_files_update(&uring->ring, rl->index, &osfd, 1) < 0) {
+            return APR_EGENERAL;
+        }
+        uring->files[rl->index] = rl->fd;
+        uring->gens[rl->index]  = gen;
+    }
+
+    if (sqe = io_uring_get_sqe(&uring->ring), NULL == sqe) {
+        ap_uring_reap(s);
+        if (sqe = io_uring_get_sqe(&uring->ring), NULL == sqe) {
+            return APR_EAGAIN;
+        }
+    }
+
+    io_uring_prep_write(sqe, rl->index, rl->buf, (unsigned) rl->buf_len, (__u64) -1);
+    sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_sqe_set_data(sqe, rl);
+    rl->ulen     = rl->buf_len;
+    rl->upending = 1;
+    ++uring->inflight;
+
+    b        = rl->buf;
+    rl->buf  = rl->ubuf;
+    rl->ubuf = b;
+
+    return APR_SUCCESS;
+}
+
+/* Tear the ring down when the child exits, after the service thread.
+ */
+static apr_status_t ap_uring_cleanup(void *data) {
+    rl_uring *u = data;
+
+    io_uring_queue_exit(&u->ring);
+    uring = NULL;
+
+    return APR_SUCCESS;
+}
+
+/* Set up the ring for the async logs of this child. Without io_uring in
+ * the kernel, or if it is not allowed, logs are written with write().
+ */
+static void ap_uring_create(apr_pool_t *p, server_rec *s) {
+    rl_uring *u;
+    int *fds;
+    int i, ret, want = 0;
+
+    for (i = 0; i < rotated_logs->nelts; ++i) {
+        rotated_log *rl = APR_ARRAY_IDX(rotated_logs, i, rotated_log *);
+        want |= (NULL != rl->ring && NULL == rl->zip);
+    }
+
+    if (!want) {
+        return;
+    }
+
+    u = apr_pcalloc(p, sizeof(rl_uring));
+    if (ret = io_uring_queue_init(URING_ENTRIES, &u->ring, 0), ret < 0) {
+        ap_log_error(APLOG_MARK, APLOG_INFO, APR_FROM_OS_ERROR(-ret), s,
+                        "io_uring not available, writing async logs directly.");
+        return;
+    }
+
+    /* A sparse table with a slot for each log */
+    fds      = apr_palloc(p, rotated_logs->nelts * sizeof(int));
+    u->files = apr_pcalloc(p, rotated_logs->nelts * sizeof(apr_file_t *));
+    u->gens  = apr_pcalloc(p, rotated_logs->nelts * sizeof(apr_uint32_t));
+    for (i = 0; i < rotated_logs->nelts; ++i) {
+        fds[i] = -1;
+    }
+    if (ret = io_uring_register_files(&u->ring, fds, rotated_logs->nelts), ret < 0) {
+        ap_log_error(APLOG_MARK, APLOG_INFO, APR_FROM_OS_ERROR(-ret), s,
+                        "can't register log files with io_uring, "
+                        "writing async logs directly.");
+        io_uring_queue_exit(&u->ring);
+        return;
+    }
+
+    for (i = 0; i < rotated_logs->nelts; ++i) {
+        rotated_log *rl = APR_ARRAY_IDX(rotated_logs, i, rotated_log *);
+        if (NULL != rl->ring && NULL == rl->zip) {
+            rl->ubuf = apr_palloc(p, rl->st.buffer_size);
+        }
+    }
+
+    apr_pool_cleanup_register(p, u, ap_uring_cleanup, apr_pool_cleanup_null);
+    uring = u;
+}
+#endif
+
+#ifdef RL_HAVE_DIRECT
+/* RotateCacheHint direct: write the buffer to the file at its offset in
+ * whole blocks, padding the last one with zeros, then keep the partial
+ * last block at the start of the buffer. The caller must either hold the
+ * buffer lock or otherwise have exclusive access to the log.
+ */
+static apr_status_t ap_direct_flush(rotated_log *rl, server_rec *s) {
+    rl_direct *d = rl->dio;
+    apr_os_file_t osfd;
+    apr_size_t len, off, full;
+    apr_status_t rv;
+    ssize_t n;
+
+    if (rl->buf_len == d->done) {
+        return APR_SUCCESS;
+    }
+    if (NULL == rl->fd) {
+        rl->buf_len = d->done;
+        return APR_ENOENT;
+    }
+    if (rv = apr_os_file_get(&osfd, rl->fd), APR_SUCCESS != rv) {
+        return rv;
+    }
+
+    /* After a short write the rest goes again from the start of the block
+     * it stopped in, as O_DIRECT takes nothing but whole blocks.
+     */
+    len = APR_ALIGN(rl->buf_len, DIRECT_ALIGN);
+    memset(rl->buf + rl->buf_len, 0, len - rl->buf_len);
+    RL_METRIC(RL_M_FLUSHES, 1);
+    for (off = 0; off < len; off = (off + n) - (off + n) % DIRECT_ALIGN) {
+        RL_METRIC(RL_M_WRITES, 1);
+        if (n = pwrite(osfd, rl->buf + off, len - off, d->offset + off), n < 0) {
+            if (EINTR == errno) {
+                n = 0;
+                continue;
+            }
+            rv = APR_FROM_OS_ERROR(errno);
+            RL_METRIC(RL_M_WRITE_ERRORS, 1);
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                            "error writing buffered transfer log data, "
+                            "%" APR_SIZE_T_FMT " bytes lost.", rl->buf_len - d->done);
+            rl->buf_len = d->done;
+            return rv;
+        }
+    }
+    ap_count_log(rl, rl->buf_len - d->done);
+
+    if (full = rl->buf_len - rl->buf_len % DIRECT_ALIGN, full > 0) {
+        memmove(rl->buf, rl->buf + full, rl->buf_len - full);
+        d->offset   += full;
+        rl->buf_len -= full;
+    }
+    d->done = rl->buf_len;
+
+    return APR_SUCCESS;
+}
+
+/* Add a line to the buffer of an O_DIRECT log, flushing whenever it fills
+ * up. Lines of any length go through the buffer as nothing may be written
+ * around it. The caller must hold the buffer lock.
+ */
+static apr_status_t ap_direct_buffer(rotated_log *rl, server_rec *s,
+                                     const char **strs, int *strl, int nelts) {
+    apr_status_t rv;
+    apr_size_t n, left;
+    const char *str;
+    int i;
+
+    if (rl->buf_len == rl->dio->done) {
+        rl->buf_time = apr_time_now();
+    }
+
+    for (i = 0; i < nelts; ++i) {
+        for (str = strs[i], left = strl[i]; left > 0; str += n, left -= n) {
+            if (rl->buf_len == rl->st.buffer_size &&
+                (rv = ap_direct_flush(rl, s)) != APR_SUCCESS) {
+                return rv;
+            }
+            n = rl->st.buffer_size - rl->buf_len;
+            if (n > left) {
+                n = left;
+            }
+            memcpy(rl->buf + rl->buf_len, str, n);
+            rl->buf_len += n;
+        }
+    }
+
+    if (rl->st.buffer_age > 0 &&
+        apr_time_now() - rl->buf_time >= rl->st.buffer_age) {
+        return ap_direct_flush(rl, s);
+    }
+    return APR_SUCCESS;
+}
+
+/* Pick up an O_DIRECT log file where it ends, reading back its partial
+ * last block. The caller must have exclusive access to the log.
+ */
+static void ap_direct_open(rotated_log *rl, server_rec *s) {
+    rl_direct *d = rl->dio;
+    apr_off_t size = ap_file_size(rl->fd);
+    apr_os_file_t osfd;
+
+    d->offset   = size - size % DIRECT_ALIGN;
+    d->done     = 0;
+    rl->buf_len = 0;
+
+    if (size > d->offset) {
+        if (APR_SUCCESS == apr_os_file_get(&osfd, rl->fd) &&
+            pread(osfd, rl->buf, DIRECT_ALIGN, d->offset) >= size - d->offset) {
+            rl->buf_len = d->done = (apr_size_t) (size - d->offset);
+        } else {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, APR_FROM_OS_ERROR(errno), s,
+                            "could not read the end of transfer log file %s, "
+                            "continuing at the next block.", rl->fname);
+            d->offset += DIRECT_ALIGN;
+        }
+    }
+}
+
+/* Write out what is left of an O_DIRECT log and cut the padding off the
+ * end of the file. The caller must have exclusive access to the log.
+ */
+static void ap_direct_close(rotated_log *rl, server_rec *s) {
+    rl_direct *d = rl->dio;
+    apr_status_t rv;
+
+    ap_direct_flush(rl, s);
+    if (rv = apr_file_trunc(rl->fd, d->offset + rl->buf_len), APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "could not truncate transfer log file %s.", rl->fname);
+    }
+
+    d->offset   = 0;
+    d->done     = 0;
+    rl->buf_len = 0;
+}
+#endif
+
+/* Write out any buffered log data. The caller must either hold the buffer
+ * lock or otherwise have exclusive access to the log.
+ */
+static apr_status_t ap_flush_log(rotated_log *rl, server_rec *s) {
+    apr_status_t rv = APR_SUCCESS;
+
+    if (0 == rl->buf_len) {
+        return APR_SUCCESS;
+    }
+
+    if (NULL == rl->fd) {
+        rv = APR_ENOENT;
+#ifdef RL_HAVE_DIRECT
+    } else if (NULL != rl->dio) {
+        return ap_direct_flush(rl, s);
+#endif
+#ifdef RL_HAVE_COMPRESS
+    } else if (NULL != rl->zip) {
+        const char *str = rl->buf;
+        int strl = (int) rl->buf_len;
+
+        rv = ap_compress_log(rl, &str, &strl, 1, rl->buf_len);
+#endif
+#ifdef RL_HAVE_URING
+    } else if (ap_uring_mine(rl) && APR_SUCCESS == ap_uring_write(rl, s)) {
+        rv = APR_SUCCESS;
+#endif
+    } else {
+        RL_METRIC(RL_M_WRITES, 1);
+        if (rv = apr_file_write_full(rl->fd, rl->buf, rl->buf_len, NULL), APR_SUCCESS == rv) {
+            ap_count_log(rl, rl->buf_len);
+        } else {
+            RL_METRIC(RL_M_WRITE_ERRORS, 1);
+        }
+    }
+
+    RL_METRIC(RL_M_FLUSHES, 1);
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "error writing buffered transfer log data, "
+                        "%" APR_SIZE_T_FMT " bytes lost.", rl->buf_len);
+    }
+
+    rl->buf_len = 0;
+    return rv;
+}
+
+/* Append a log line to the buffer, flushing it first if the line would not
+ * fit. Lines larger than the buffer itself are written straight through,
+ * together with whatever is already buffered.
+ * The caller must hold a reference from ap_lock_log so that the file can't
+ * be rotated under us.
+ */
+static apr_status_t ap_buffer_log(rotated_log *rl, server_rec *srv,
+                                  const char **strs, int *strl,
+                                  int nelts, apr_size_t len) {
+    apr_status_t rv = APR_SUCCESS;
+    char *s;
+    int i;
+
+    if (rv = APR_ANYLOCK_LOCK(&rl->buf_lock), APR_SUCCESS != rv) {
+        return rv;
+    }
+
+#ifdef RL_HAVE_DIRECT
+    if (NULL != rl->dio) {
+        rv = ap_direct_buffer(rl, srv, strs, strl, nelts);
+        APR_ANYLOCK_UNLOCK(&rl->buf_lock);
+        return rv;
+    }
+#endif
+
+#ifdef RL_HAVE_COMPRESS
+    if (len > rl->st.buffer_size && NULL != rl->zip) {
+        /* Too big to buffer: compress what we have and the line separately */
+        if (rv = ap_flush_log(rl, srv), APR_SUCCESS == rv) {
+            rv = ap_compress_log(rl, strs, strl, nelts, len);
+        }
+    } else
+#endif
+    if (len > rl->st.buffer_size) {
+#ifdef RL_HAVE_URING
+        /* Don't overtake a write still in flight on the ring */
+        if (rl->upending && ap_uring_mine(rl)) {
+            ap_uring_reap(srv);
+        }
+#endif
+        /* Too big to buffer: write what we have and the line in one go */
+        if (rv = ap_writev_log(rl->fd, rl->buf, rl->buf_len, strs, strl, nelts),
+            APR_SUCCESS != rv) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, srv,
+                            "error writing buffered transfer log data.");
+        } else {
+            ap_count_log(rl, rl->buf_len + len);
+        }
+        rl->buf_len = 0;
+    } else {
+        if (rl->buf_len + len > rl->st.buffer_size) {
+            rv = ap_flush_log(rl, srv);
+        }
+
+        if (0 == rl->buf_len) {
+            rl->buf_time = apr_time_now();
+        }
+        for (i = 0, s = rl->buf + rl->buf_len; i < nelts; ++i) {
+            memcpy(s, strs[i], strl[i]);
+            s += strl[i];
+        }
+        rl->buf_len += len;
+
+        if (rl->st.buffer_age > 0 &&
+            apr_time_now() - rl->buf_time >= rl->st.buffer_age) {
+            rv = ap_flush_log(rl, srv);
+        }
+    }
+
+    APR_ANYLOCK_UNLOCK(&rl->buf_lock);
+    return rv;
+}
+
+#if APR_HAS_THREADS
+/* Find the buffer of the calling thread for the log, creating it on first
+ * use. The caller must hold a reference from ap_lock_log, which keeps a
+ * rotation from walking the list of buffers while we add to it.
+ */
+static rl_tbuf *ap_thread_buffer(rotated_log *rl) {
+    rl_thread *t = NULL;
+    rl_tbuf *tb, *head;
+    void *data;
+
+    if (NULL == thread_key) {
+        return NULL;
+    }
+    if (APR_SUCCESS == apr_threadkey_private_get(&data, thread_key)) {
+        t = data;
+    }
+
+    if (NULL == t) {
+        apr_pool_t *tp;
+
+        /* Not a child of anything the thread could outlive, the buffers
+         * may still be written at rotation or exit. ap_drop_threads frees
+         * it when the child exits.
+         */
+        if (APR_SUCCESS != apr_pool_create(&tp, NULL)) {
+            return NULL;
+        }
+        t = apr_pcalloc(tp, sizeof(rl_thread));
+        t->pool  = tp;
+        t->nbufs = rotated_logs->nelts;
+        t->bufs  = apr_pcalloc(tp, t->nbufs * sizeof(rl_tbuf *));
+        if (APR_SUCCESS != apr_threadkey_private_set(t, thread_key)) {
+            apr_pool_destroy(tp);
+            return NULL;
+        }
+        do {
+            t->next = threads;
+        } while (apr_atomic_casptr((volatile void **) &threads, t, t->next) != t->next);
+    }
+
+    if (rl->index >= t->nbufs) {
+        return NULL;
+    }
+    if (tb = t->bufs[rl->index], NULL == tb) {
+        tb = apr_pcalloc(t->pool, sizeof(rl_tbuf));
+        tb->buf = apr_palloc(t->pool, rl->st.buffer_size);
+        do {
+            head = rl->tbufs;
+            tb->next = head;
+        } while (apr_atomic_casptr((volatile void **) &rl->tbufs, tb, head) != head);
+        t->bufs[rl->index] = tb;
+    }
+
+    return tb;
+}
+
+/* Write out a thread's buffer with a single write. The caller must hold a
+ * reference from ap_lock_log, and either own the buffer or have quiesced
+ * the log.
+ */
+static apr_status_t ap_thread_flush(rotated_log *rl, server_rec *s, rl_tbuf *tb) {
+    apr_status_t rv;
+
+    if (0 == tb->len) {
+        return APR_SUCCESS;
+    }
+
+    if (NULL == rl->fd) {
+        rv = APR_ENOENT;
+    } else {
+        RL_METRIC(RL_M_WRITES, 1);
+        if (rv = apr_file_write_full(rl->fd, tb->buf, tb->len, NULL), APR_SUCCESS == rv) {
+            ap_count_log(rl, tb->len);
+        } else {
+            RL_METRIC(RL_M_WRITE_ERRORS, 1);
+        }
+    }
+
+    RL_METRIC(RL_M_FLUSHES, 1);
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "error writing buffered transfer log data, "
+                        "%" APR_SIZE_T_FMT " bytes lost.", tb->len);
+    }
+
+    tb->len = 0;
+    return rv;
+}
+
+/* Take a thread's buffer for writing into or out of it, from its thread
+ * or from the service thread writing out an old buffer.
+ */
+static void ap_take_tbuf(rl_tbuf *tb) {
+    while (0 != apr_atomic_cas32(&tb->busy, 1, 0)) {
+        apr_thread_yield();
+    }
+}
+
+/* Write out the buffers of every thread before the file of the log goes
+ * away. The caller must have exclusive access to the log.
+ */
+static void ap_flush_threads(rotated_log *rl, server_rec *s) {
+    rl_tbuf *tb;
+
+    for (tb = rl->tbufs; NULL != tb; tb = tb->next) {
+        ap_thread_flush(rl, s, tb);
+    }
+}
+
+/* RotateThreadBuffer: append a log line to the calling thread's buffer,
+ * which works like the buffer of ap_buffer_log without the lock. Threads
+ * only meet in the kernel, each appending whole buffers to the file.
+ * The caller must hold a reference from ap_lock_log.
+ */
+static apr_status_t ap_thread_log(rotated_log *rl, server_rec *srv,
+                                  const char **strs, int *strl,
+                                  int nelts, apr_size_t len) {
+    apr_status_t rv = APR_SUCCESS;
+    rl_tbuf *tb;
+    char *s;
+    int i;
+
+    if (tb = ap_thread_buffer(rl), NULL == tb) {
+        /* No buffer to be had, write the line as it is */
+        if (rv = ap_writev_log(rl->fd, NULL, 0, strs, strl, nelts), APR_SUCCESS == rv) {
+            ap_count_log(rl, len);
+        }
+        return rv;
+    }
+
+    ap_take_tbuf(tb);
+    if (len > rl->st.buffer_size) {
+        /* Too big to buffer: write what we have and the line in one go */
+        if (rv = ap_writev_log(rl->fd, tb->buf, tb->len, strs, strl, nelts),
+            APR_SUCCESS != rv) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, srv,
+                            "error writing buffered transfer log data.");
+        } else {
+            ap_count_log(rl, tb->len + len);
+        }
+        tb->len = 0;
+        apr_atomic_set32(&tb->busy, 0);
+        return rv;
+    }
+
+    if (tb->len + len > rl->st.buffer_size) {
+        rv = ap_thread_flush(rl, srv, tb);
+    }
+
+    if (0 == tb->len) {
+        tb->time = apr_time_now();
+    }
+    for (i = 0, s = tb->buf + tb->len; i < nelts; ++i) {
+        memcpy(s, strs[i], strl[i]);
+        s += strl[i];
+    }
+    tb->len += len;
+
+    if (rl->st.buffer_age > 0 &&
+        apr_time_now() - tb->time >= rl->st.buffer_age) {
+        rv = ap_thread_flush(rl, srv, tb);
+    }
+
+    apr_atomic_set32(&tb->busy, 0);
+    return rv;
+}
+#endif
+
+/* Forget the rotated logs belonging to a configuration that is going away.
+ */
+static apr_status_t ap_clear_rotated_logs(void *data) {
+    rotated_logs  = NULL;
+    rotated_names = NULL;
+    piped_logs    = NULL;
+    return APR_SUCCESS;
+}
+
+/* The log files the parent keeps open from one generation of the config to
+ * the next, so that a graceful restart doesn't open and close every file
+ * again and the children can take the file over instead of opening it. The
+ * registry is in the process pool, which outlives the generations and this
+ * module's statics.
+ */
+typedef struct {
+    apr_pool_t      *pool;          /* Holds the entry and its file         */
+    const char      *fname;         /* Name of the log, the key             */
+    log_options     conf;           /* Options the log was configured with  */
+    apr_file_t      *fd;            /* File of the slot, NULL in a child    */
+    apr_time_t      logtime;        /* Start of that slot                   */
+    apr_time_t      slot_end;       /* and its end                          */
+    apr_uint32_t    gen;            /* Last generation that had the log     */
+} rl_kept;
+
+typedef struct {
+    apr_pool_t      *pool;          /* Child of the process pool            */
+    apr_hash_t      *logs;          /* rl_kept by log name                  */
+    apr_uint32_t    gen;            /* Current generation of the config     */
+} rl_registry;
+
+/* Get the registry, making it first if create is set.
+ */
+static rl_registry *ap_registry(server_rec *s, int create) {
+    apr_pool_t *pp = s->process->pool;
+    apr_pool_t *rp;
+    rl_registry *reg;
+    void *data;
+    const char *key = "log_rotate_registry";
+
+    apr_pool_userdata_get(&data, key, pp);
+    if (reg = data, NULL != reg || !create) {
+        return reg;
+    }
+
+    if (APR_SUCCESS != apr_pool_create(&rp, pp)) {
+        return NULL;
+    }
+    reg = apr_palloc(rp, sizeof(rl_registry));
+    reg->pool = rp;
+    reg->logs = apr_hash_make(rp);
+    reg->gen  = 0;
+    apr_pool_userdata_set(reg, key, apr_pool_cleanup_null, pp);
+    return reg;
+}
+
+/* Is fd still the file the log's current slot is written to? A kept
+ * file can have been given its name by RotateGrace, or moved away by the
+ * RotateOnClose helper, since it was opened.
+ */
+static int ap_kept_current(apr_pool_t *p, rotated_log *rl, apr_file_t *fd) {
+    const char *name = ap_log_name(p, rl, rl->logtime, 0);
+    apr_finfo_t finfo, kinfo;
+
+    if (APR_SUCCESS != apr_file_info_get(&kinfo, APR_FINFO_IDENT, fd)) {
+        return 0;
+    }
+    if (APR_SUCCESS != apr_stat(&finfo, name, APR_FINFO_IDENT, p) &&
+        (rl->st.grace <= 0 || RL_DISABLED == rl->st.enabled ||
+         APR_SUCCESS != apr_stat(&finfo, apr_pstrcat(p, name, GRACE_SUFFIX, NULL),
+                                 APR_FINFO_IDENT, p))) {
+        return 0;
+    }
+    return finfo.inode == kinfo.inode && finfo.device == kinfo.device;
+}
+
+/* In the parent: make sure the log's file for the current slot is open,
+ * reusing the one kept for a log with the same name and options by an
+ * earlier generation, as long as it is still that file. The log itself
+ * doesn't hold the file in the parent.
+ */
+static int ap_keep_log(server_rec *s, rotated_log *rl) {
+    rl_registry *reg = ap_registry(s, 1);
+    rl_kept *k = NULL;
+    apr_pool_t *kp;
+    apr_file_t *fd;
+
+    if (NULL != reg) {
+        k = apr_hash_get(reg->logs, rl->fname, APR_HASH_KEY_STRING);
+    }
+    if (NULL != k && NULL != k->fd && k->logtime == rl->logtime &&
+        ap_same_options(&k->conf, rl->conf) && ap_kept_current(rl->pool, rl, k->fd)) {
+        RL_TRACE(s, (APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, s,
+                     "reusing %s from the last generation", rl->fname));
+        k->gen = reg->gen;
+        return 1;
+    }
+    if (NULL != k) {
+        apr_hash_set(reg->logs, rl->fname, APR_HASH_KEY_STRING, NULL);
+        apr_pool_destroy(k->pool);
+    }
+
+    /* Without a registry, just check that the file can be opened */
+    if (NULL == reg || APR_SUCCESS != apr_pool_create(&kp, reg->pool)) {
+        if (fd = ap_open_log(rl->pool, s, rl, rl->logtime, 0), NULL == fd) {
+            return 0;
+        }
+        ap_close_log(s, fd);
+        return 1;
+    }
+
+    k = apr_palloc(kp, sizeof(rl_kept));
+    if (k->fd = ap_open_log(kp, s, rl, rl->logtime, 0), NULL == k->fd) {
+        apr_pool_destroy(kp);
+        return 0;
+    }
+    k->pool          = kp;
+    k->fname         = apr_pstrdup(kp, rl->fname);
+    k->conf          = *rl->conf;
+    k->conf.spill    = rl->conf->spill ? apr_pstrdup(kp, rl->conf->spill) : NULL;
+    k->conf.on_close = rl->conf->on_close_len > 0 ?
+                       apr_pmemdup(kp, rl->conf->on_close, rl->conf->on_close_len) : NULL;
+    if (NULL != rl->conf->sinks) {
+        int i;
+
+        k->conf.sinks = apr_array_copy(kp, rl->conf->sinks);
+        for (i = 0; i < k->conf.sinks->nelts; ++i) {
+            rl_sink_conf *sc = &APR_ARRAY_IDX(k->conf.sinks, i, rl_sink_conf);
+            sc->target = apr_pstrdup(kp, sc->target);
+        }
+    }
+    k->logtime       = rl->logtime;
+    k->slot_end      = rl->slot_end;
+    k->gen           = reg->gen;
+    apr_hash_set(reg->logs, k->fname, APR_HASH_KEY_STRING, k);
+    return 1;
+}
+
+/* In the parent, after the logs of a generation have been opened: close
+ * the files no log of it uses any more.
+ */
+static void ap_sweep_registry(server_rec *s) {
+    rl_registry *reg = ap_registry(s, 0);
+    apr_hash_index_t *hi;
+
+    if (NULL == reg) {
+        return;
+    }
+
+    for (hi = apr_hash_first(NULL, reg->logs); NULL != hi; hi = apr_hash_next(hi)) {
+        void *v;
+        rl_kept *k;
+
+        apr_hash_this(hi, NULL, NULL, &v);
+        if (k = v, k->gen != reg->gen) {
+            RL_TRACE(s, (APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, s,
+                         "closing %s, not used any more", k->fname));
+            apr_hash_set(reg->logs, k->fname, APR_HASH_KEY_STRING, NULL);
+            apr_pool_destroy(k->pool);
+        }
+    }
+}
+
+/* In the parent, from the monitor hook: close the kept files of slots that
+ * have ended. The children took them over when they started and have moved
+ * on to the next slot since; a child started from now on opens the file of
+ * its slot itself.
+ */
+static int log_rotate_monitor(apr_pool_t *p, server_rec *s) {
+    rl_registry *reg = ap_registry(s, 0);
+    apr_time_t now = apr_time_now();
+    apr_hash_index_t *hi;
+
+    if (NULL == reg) {
+        return DECLINED;
+    }
+
+    for (hi = apr_hash_first(NULL, reg->logs); NULL != hi; hi = apr_hash_next(hi)) {
+        void *v;
+        rl_kept *k;
+
+        apr_hash_this(hi, NULL, NULL, &v);
+        if (k = v, NULL != k->fd && now >= k->slot_end) {
+            RL_TRACE(s, (APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, s,
+                         "closing %s, its slot has ended", k->fname));
+            apr_file_close(k->fd);
+            k->fd = NULL;
+        }
+    }
+    return DECLINED;
+}
+
+/* In a process forked from the parent: close its copies of the kept files,
+ * which only the parent needs.
+ */
+static void ap_drop_kept(server_rec *s) {
+    rl_registry *reg = ap_registry(s, 0);
+    apr_hash_index_t *hi;
+
+    if (NULL == reg) {
+        return;
+    }
+
+    for (hi = apr_hash_first(NULL, reg->logs); NULL != hi; hi = apr_hash_next(hi)) {
+        void *v;
+        rl_kept *k;
+
+        apr_hash_this(hi, NULL, NULL, &v);
+        if (k = v, NULL != k->fd) {
+            apr_file_close(k->fd);
+            k->fd = NULL;
+        }
+    }
+}
+
+#if defined(RL_HAVE_BROKER) || defined(RL_HAVE_ONCLOSE)
+/* In a helper process forked from the parent, which still runs as root:
+ * let go of what only the parent needs and become the server's User and
+ * Group as the children do, so that the files the helper creates belong
+ * to the server. Of the descriptors the parent had open the helper keeps
+ * stdin, stdout, stderr, the error logs and keep, its end of the line to
+ * the children; the listening sockets, log files and pipes to piped
+ * loggers would otherwise stay open for as long as the helper lives.
+ */
+static void ap_helper_init(apr_pool_t *p, server_rec *s, int keep) {
+    apr_hash_t *logs = apr_hash_make(p);
+    apr_os_file_t osfd;
+    server_rec *sv;
+    long fd, max;
+    int rv;
+
+    ap_drop_kept(s);
+    ap_close_listeners();
+
+    for (sv = s; NULL != sv; sv = sv->next) {
+        if (NULL != sv->error_log && APR_SUCCESS == apr_os_file_get(&osfd, sv->error_log)) {
+            apr_hash_set(logs, apr_pmemdup(p, &osfd, sizeof(osfd)), sizeof(osfd), sv);
+        }
+    }
+    if (max = sysconf(_SC_OPEN_MAX), max < 0) {
+        max = 1024;
+    }
+    for (fd = 3; fd < max; ++fd) {
+        osfd = (apr_os_file_t) fd;
+        if (fd != keep && NULL == apr_hash_get(logs, &osfd, sizeof(osfd))) {
+            close((int) fd);
+        }
+    }
+
+    if (rv = ap_run_drop_privileges(p, s), OK != rv && DECLINED != rv) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, APR_EGENERAL, s,
+                        "log helper process could not drop privileges.");
+        exit(1);
+    }
+}
+#endif
+
+/* Write out as much of the buffer of a piped log as the pipe takes without
+ * blocking. Only whole lines are written, in chunks of at most PIPE_BUF so
+ * that each write is atomic and lines from different children don't get
+ * mixed up; a longer line goes in a write of its own. What the pipe won't
+ * take now stays in the buffer. The caller must hold the buffer lock.
+ */
+static apr_status_t ap_pipe_flush(rotated_log *rl, server_rec *s) {
+    apr_status_t rv = APR_SUCCESS;
+    apr_size_t off = 0, n, chunk;
+    const char *nl;
+
+    while (off < rl->buf_len) {
+        if (chunk = rl->buf_len - off, chunk > PIPE_CHUNK) {
+            /* Up to the last line that ends within the chunk, or else to
+             * the end of the first line.
+             */
+            for (n = PIPE_CHUNK; n > 0 && '\n' != rl->buf[off + n - 1]; --n)
+                ;
+            if (0 == n) {
+                nl = memchr(rl->buf + off + PIPE_CHUNK, '\n', chunk - PIPE_CHUNK);
+                n  = NULL != nl ? (apr_size_t) (nl - (rl->buf + off)) + 1 : chunk;
+            }
+            chunk = n;
+        }
+
+        n = chunk;
+        RL_METRIC(RL_M_WRITES, 1);
+        rv = apr_file_write(rl->fd, rl->buf + off, &n);
+        off += n;
+        if (APR_SUCCESS != rv) {
+            break;
+        }
+    }
+
+    RL_METRIC(RL_M_FLUSHES, 1);
+    if (APR_SUCCESS != rv && !APR_STATUS_IS_EAGAIN(rv)) {
+        RL_METRIC(RL_M_WRITE_ERRORS, 1);
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "error writing to piped log %s, %" APR_SIZE_T_FMT " bytes lost.",
+                        rl->fname, rl->buf_len - off);
+        off = rl->buf_len;
+    } else {
+        rv = APR_SUCCESS;
+    }
+
+    memmove(rl->buf, rl->buf + off, rl->buf_len - off);
+    rl->buf_len -= off;
+
+    return rv;
+}
+
+/* Write a line that doesn't fit in the buffer of a piped log straight to
+ * the pipe, waiting for the reader when the pipe is full: once part of the
+ * line is in the pipe the rest has to follow. The buffer must be empty, so
+ * that the line doesn't overtake lines buffered before it. A reader that
+ * has stalled holds the request up for PIPE_LONG_WAIT at most, after that
+ * the rest of the line is dropped and counted.
+ */
+static apr_status_t ap_pipe_direct(rotated_log *rl, server_rec *s,
+                                   const char **strs, int *strl, int nelts) {
+    apr_status_t rv = APR_SUCCESS;
+    apr_time_t deadline = apr_time_now() + PIPE_LONG_WAIT;
+    apr_size_t off, n, sent = 0, left = 0;
+    int i;
+
+    RL_METRIC(RL_M_WRITES, 1);
+    for (i = 0; i < nelts && APR_SUCCESS == rv; ++i) {
+        for (off = 0; off < (apr_size_t) strl[i]; off += n) {
+            n = strl[i] - off;
+            rv = apr_file_write(rl->fd, strs[i] + off, &n);
+            sent += n;
+            if (APR_STATUS_IS_EAGAIN(rv) && apr_time_now() < deadline) {
+                apr_sleep(BLOCK_WAIT);
+            } else if (APR_SUCCESS != rv) {
+                break;
+            }
+        }
+    }
+
+    if (APR_STATUS_IS_EAGAIN(rv)) {
+        for (i = 0; i < nelts; ++i) {
+            left += strl[i];
+        }
+        left -= sent;
+
+        /* End the part that went, so the next line starts on its own */
+        if (sent > 0) {
+            n = 1;
+            apr_file_write(rl->fd, "\n", &n);
+        }
+        RL_METRIC(RL_M_DROPS, 1);
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                        "piped log %s stalled, %" APR_SIZE_T_FMT " bytes of a "
+                        "long line dropped.", rl->fname, left);
+        rv = APR_SUCCESS;
+    } else if (APR_SUCCESS != rv) {
+        RL_METRIC(RL_M_WRITE_ERRORS, 1);
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "error writing to piped log %s.", rl->fname);
+    }
+    return rv;
+}
+
+/* Add a line to a piped log and write out what the pipe will take. If the
+ * buffer is full because the program reading the pipe can't keep up the
+ * line is dropped and counted, rather than holding up the request. A line
+ * longer than the whole buffer is written directly once the buffer has
+ * been emptied, and waits a little for the reader.
+ */
+static apr_status_t ap_pipe_log(rotated_log *rl, server_rec *srv,
+                                const char **strs, int *strl,
+                                int nelts, apr_size_t len) {
+    rl_pipe *pipe = rl->pipe;
+    apr_status_t rv;
+    char *s;
+    int i;
+
+    if (rv = APR_ANYLOCK_LOCK(&rl->buf_lock), APR_SUCCESS != rv) {
+        return rv;
+    }
+
+    if (rl->buf_len + len > rl->st.buffer_size && rl->buf_len > 0) {
+        ap_pipe_flush(rl, srv);
+    }
+
+    if (0 == rl->buf_len && len > rl->st.buffer_size) {
+        rv = ap_pipe_direct(rl, srv, strs, strl, nelts);
+    } else if (rl->buf_len + len > rl->st.buffer_size) {
+        ++pipe->dropped;
+        RL_METRIC(RL_M_DROPS, 1);
+    } else {
+        if (0 == rl->buf_len) {
+            rl->buf_time = apr_time_now();
+        }
+        for (i = 0, s = rl->buf + rl->buf_len; i < nelts; ++i) {
+            memcpy(s, strs[i], strl[i]);
+            s += strl[i];
+        }
+        rl->buf_len += len;
+
+        if (!pipe->batch || rl->buf_len >= PIPE_CHUNK ||
+            (rl->st.buffer_age > 0 && apr_time_now() - rl->buf_time >= rl->st.buffer_age)) {
+            rv = ap_pipe_flush(rl, srv);
+        }
+    }
+
+    /* Say how much went missing once the reader has caught up */
+    if (pipe->dropped > 0 && 0 == rl->buf_len) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, srv,
+                        "piped log %s overflowed, %lu lines dropped.",
+                        rl->fname, (unsigned long) pipe->dropped);
+        pipe->dropped = 0;
+    }
+
+    APR_ANYLOCK_UNLOCK(&rl->buf_lock);
+    return rv;
+}
+
+/* Close the socket of a sink after an error and wait a while before the
+ * next one.
+ */
+static void ap_sink_close(rl_sink *sk) {
+    if (NULL != sk->conn_pool) {
+        apr_pool_destroy(sk->conn_pool);
+    }
+    sk->conn_pool  = NULL;
+    sk->sock       = NULL;
+    sk->connecting = 0;
+    sk->retry      = apr_time_now() + SINK_RETRY;
+}
+
+/* Make the socket of a sink in this child, once every SINK_RETRY at most.
+ * A TCP connection is started without waiting for it, so that a request
+ * never waits for the other end; until it is up this says APR_EAGAIN and
+ * the lines wait in the buffer.
+ */
+static apr_status_t ap_sink_open(rl_sink *sk, server_rec *s) {
+    apr_status_t rv = APR_SUCCESS;
+    int tcp = 't' == sk->conf->type;
+
+    if (NULL == sk->sock) {
+        if (apr_time_now() < sk->retry) {
+            return APR_EAGAIN;
+        }
+        if (rv = apr_pool_create(&sk->conn_pool, sk->pool), APR_SUCCESS != rv) {
+            sk->conn_pool = NULL;
+            return rv;
+        }
+
+        rv = apr_socket_create(&sk->sock, sk->addr->family, tcp ? SOCK_STREAM : SOCK_DGRAM,
+                               tcp ? APR_PROTO_TCP : APR_PROTO_UDP, sk->conn_pool);
+        if (APR_SUCCESS == rv) {
+            rv = apr_socket_timeout_set(sk->sock, 0);
+        }
+        sk->connecting = (APR_SUCCESS == rv && tcp);
+    }
+
+    if (sk->connecting) {
+        if (rv = apr_socket_connect(sk->sock, sk->addr), APR_SUCCESS == rv) {
+            sk->connecting = 0;
+        } else if (APR_STATUS_IS_EINPROGRESS(rv) || APR_STATUS_IS_EALREADY(rv) ||
+                   APR_STATUS_IS_EAGAIN(rv)) {
+            return APR_EAGAIN;
+        }
+    }
+
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                        "can't reach log sink %s, trying again later.", sk->conf->target);
+        ap_sink_close(sk);
+    }
+    return rv;
+}
+
+/* Send what a sink has gathered without blocking. A UDP sink sends it as
+ * one datagram, which is lost if it can't go now. A TCP sink keeps what
+ * the other end won't take yet; after an error the rest goes over the
+ * next connection, starting at a whole line. The caller must hold the
+ * lock of the sink.
+ */
+static apr_status_t ap_sink_flush(rl_sink *sk, server_rec *s) {
+    apr_status_t rv = APR_SUCCESS;
+    apr_size_t off = 0, n;
+    const char *nl;
+
+    if (0 == sk->len) {
+        return APR_SUCCESS;
+    }
+    if ((NULL == sk->sock || sk->connecting) && (rv = ap_sink_open(sk, s), APR_SUCCESS != rv)) {
+        if ('u' == sk->conf->type) {
+            sk->dropped += sk->lines;
+            RL_METRIC(RL_M_DROPS, sk->lines);
+            sk->len   = 0;
+            sk->lines = 0;
+        }
+        return rv;
+    }
+
+    RL_METRIC(RL_M_FLUSHES, 1);
+    if ('u' == sk->conf->type) {
+        n = sk->len;
+        RL_METRIC(RL_M_WRITES, 1);
+        if (rv = apr_socket_sendto(sk->sock, sk->addr, 0, sk->buf, &n), APR_SUCCESS != rv) {
+            sk->dropped += sk->lines;
+            RL_METRIC(RL_M_DROPS, sk->lines);
+            if (!APR_STATUS_IS_EAGAIN(rv)) {
+                RL_METRIC(RL_M_WRITE_ERRORS, 1);
+                ap_sink_close(sk);
+            }
+        }
+        sk->len   = 0;
+        sk->lines = 0;
+        return rv;
+    }
+
+    while (off < sk->len) {
+        n = sk->len - off;
+        RL_METRIC(RL_M_WRITES, 1);
+        rv = apr_socket_send(sk->sock, sk->buf + off, &n);
+        off += n;
+        if (APR_SUCCESS != rv) {
+            break;
+        }
+    }
+
+    if (APR_SUCCESS != rv && !APR_STATUS_IS_EAGAIN(rv)) {
+        RL_METRIC(RL_M_WRITE_ERRORS, 1);
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "error sending to log sink %s.", sk->conf->target);
+        ap_sink_close(sk);
+        if (off > 0 && '\n' != sk->buf[off - 1]) {
+            nl  = memchr(sk->buf + off, '\n', sk->len - off);
+            off = NULL != nl ? (apr_size_t) (nl - sk->buf) + 1 : sk->len;
+        }
+    } else {
+        rv = APR_SUCCESS;
+    }
+
+    memmove(sk->buf, sk->buf + off, sk->len - off);
+    sk->len -= off;
+    if (0 == sk->len) {
+        sk->lines = 0;
+    }
+
+    return rv;
+}
+
+/* Add a line to a sink, and send the lines once there are batch bytes of
+ * them or the oldest has waited long enough. A datagram never holds more
+ * than batch bytes, unless it is a single longer line. If the buffer is
+ * full the line is dropped and counted, rather than holding up the request.
+ */
+static void ap_sink_log(rl_sink *sk, server_rec *srv, const char **strs,
+                        const int *strl, int nelts, apr_size_t len) {
+    apr_time_t now;
+    char *s;
+    int i;
+
+    if (APR_SUCCESS != APR_ANYLOCK_LOCK(&sk->lock)) {
+        return;
+    }
+
+    now = apr_time_now();
+    if (sk->len > 0 && (sk->len + len > sk->size ||
+                        ('u' == sk->conf->type && sk->len + len > sk->conf->batch))) {
+        ap_sink_flush(sk, srv);
+    }
+
+    if (sk->len + len > sk->size) {
+        ++sk->dropped;
+        RL_METRIC(RL_M_DROPS, 1);
+    } else {
+        if (0 == sk->len) {
+            sk->time = now;
+        }
+        for (i = 0, s = sk->buf + sk->len; i < nelts; ++i) {
+            memcpy(s, strs[i], strl[i]);
+            s += strl[i];
+        }
+        sk->len += len;
+        ++sk->lines;
+
+        if (sk->len >= sk->conf->batch || now - sk->time >= sk->age) {
+            ap_sink_flush(sk, srv);
+        }
+    }
+
+    /* Say how much went missing once the other end has caught up */
+    if (sk->dropped > 0 && 0 == sk->len) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, srv,
+                        "log sink %s overflowed, %lu lines dropped.",
+                        sk->conf->target, (unsigned long) sk->dropped);
+        sk->dropped = 0;
+    }
+
+    APR_ANYLOCK_UNLOCK(&sk->lock);
+}
+
+/* Set up a network sink for a log. The name is looked up now, once for
+ * every generation of the config.
+ */
+static void ap_make_sink(apr_pool_t *p, server_rec *s, rotated_log *rl,
+                         const rl_sink_conf *sc) {
+    apr_status_t rv;
+    rl_sink *sk = apr_pcalloc(p, sizeof(rl_sink)), **tail;
+    char *host, *scope;
+    apr_port_t port;
+
+    if (rv = apr_parse_addr_port(&host, &scope, &port, sc->target, p), APR_SUCCESS == rv) {
+        rv = apr_sockaddr_info_get(&sk->addr, host, APR_UNSPEC, port, 0, p);
+    }
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "can't find log sink %s, not sending %s there.",
+                        sc->target, rl->fname);
+        return;
+    }
+
+    sk->conf      = sc;
+    sk->pool      = p;
+    sk->lock.type = apr_anylock_none;
+    sk->size      = 'u' == sc->type ? SINK_DATAGRAM_MAX : SINK_BUFFER;
+    if ('t' == sc->type && sk->size < rl->st.buffer_size) {
+        sk->size = rl->st.buffer_size;
+    }
+    if (sk->size < sc->batch) {
+        sk->size = sc->batch;
+    }
+    sk->age = rl->st.buffer_age > 0 ? rl->st.buffer_age : SINK_AGE;
+    sk->buf = apr_palloc(p, sk->size);
+
+#if APR_HAS_THREADS
+    {
+        int mpm_threads;
+
+        ap_mpm_query(AP_MPMQ_MAX_THREADS, &mpm_threads);
+        if (mpm_threads > 1) {
+            if (rv = apr_thread_mutex_create(&sk->lock.lock.tm,
+                                             APR_THREAD_MUTEX_DEFAULT, p),
+                APR_SUCCESS != rv) {
+                ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
+                        "could not initialize log sink lock, "
+                        "not sending %s to %s.", rl->fname, sc->target);
+                return;
+            }
+            sk->lock.type = apr_anylock_threadmutex;
+        }
+    }
+#endif
+
+    for (tail = &rl->sinks; NULL != *tail; tail = &(*tail)->next)
+        ;
+    *tail = sk;
+}
+
+/* The offset of local time from UTC at the supplied time, or zero if the
+ * config doesn't ask for local time.
+ */
+static apr_time_t ap_get_local_adjust(rotated_log *rl, apr_time_t tm) {
+    apr_time_exp_t lt;
+
+    if (!rl->st.localt) {
+        return 0;
+    }
+
+    apr_time_exp_lt(&lt, tm);
+    return (apr_time_t) lt.tm_gmtoff * APR_USEC_PER_SEC;
+}
+
+/* Find the slot containing tm, quantizing tm to the log rotation interval
+ * applying offsets as specified in the config. Besides the quantized time
+ * that names the log we keep the real times [slot_start, slot_end) covered
+ * by the slot so that writers only need a single compare to find out that
+ * the log is still current. The local time adjustment can differ at the
+ * end of the slot when a DST change falls inside it, so the end is worked
+ * out with the adjustment in force at that point.
+ */
+static void ap_get_slot(rotated_log *rl, apr_time_t tm, apr_time_t *logtime,
+                        apr_time_t *start, apr_time_t *end) {
+    apr_time_t localadj = ap_get_local_adjust(rl, tm);
+    apr_time_t e;
+
+    *logtime = ((tm + rl->st.offset + localadj) / rl->st.interval) * rl->st.interval;
+    *start   = *logtime - rl->st.offset - localadj;
+
+    e = *logtime + rl->st.interval - rl->st.offset;
+    if (rl->st.localt) {
+        localadj = ap_get_local_adjust(rl, e - localadj);
+    }
+    *end = e - localadj;
+
+    /* Never end up with an empty slot however the clocks change */
+    if (*end <= tm) {
+        *end = tm + 1;
+    }
+}
+
+static void ap_set_slot(rotated_log *rl, apr_time_t tm) {
+    ap_get_slot(rl, tm, &rl->logtime, &rl->slot_start, &rl->slot_end);
+    apr_time_exp_gmt(&rl->logtime_exp, rl->logtime - rl->st.offset);
+}
+
+#ifdef RL_HAVE_BROKER
+/* Send a message over a unix domain socket, passing the descriptor fd with it
+ * unless fd is negative.
+ */
+static apr_status_t ap_send_fd(int sock, const void *data, apr_size_t len, int fd) {
+    struct msghdr msg;
+    struct iovec vec;
+    union {
+        struct cmsghdr  hdr;
+        char            buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+
+    memset(&msg, 0, sizeof(msg));
+    vec.iov_base   = (void *) data;
+    vec.iov_len    = len;
+    msg.msg_iov    = &vec;
+    msg.msg_iovlen = 1;
+
+    if (fd >= 0) {
+        struct cmsghdr *cmsg;
+
+        memset(&ctl, 0, sizeof(ctl));
+        msg.msg_control    = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    while (sendmsg(sock, &msg, 0) < 0) {
+        if (EINTR != errno) {
+            return APR_FROM_OS_ERROR(errno);
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Receive a message sent by ap_send_fd. *fd is set to the descriptor that
+ * came with it or -1 if there was none. Returns APR_EOF once every sender
+ * has gone away.
+ */
+static apr_status_t ap_recv_fd(int sock, void *data, apr_size_t len, int *fd) {
+    struct msghdr msg;
+    struct iovec vec;
+    struct cmsghdr *cmsg;
+    ssize_t got;
+    union {
+        struct cmsghdr  hdr;
+        char            buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+
+    memset(&msg, 0, sizeof(msg));
+    vec.iov_base       = data;
+    vec.iov_len        = len;
+    msg.msg_iov        = &vec;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    *fd = -1;
+
+    while (got = recvmsg(sock, &msg, 0), got < 0) {
+        if (EINTR != errno) {
+            return APR_FROM_OS_ERROR(errno);
+        }
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); NULL != cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type) {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    if (0 == got) {
+        return APR_EOF;
+    }
+
+    return (apr_size_t) got == len ? APR_SUCCESS : APR_EGENERAL;
+}
+
+/* Ask the broker for file number seq of a log for the quantized time logtime. Returns
+ * NULL if the broker can't help, in which case the caller opens the file itself.
+ */
+static apr_file_t *ap_open_shared_log(apr_pool_t *p, server_rec *s,
+                                      rotated_log *rl, apr_time_t logtime, int seq) {
+    apr_status_t rv;
+    apr_file_t *fd;
+    rl_broker_req req;
+    rl_broker_rep rep;
+    struct pollfd pfd;
+    int sv[2], osfd = -1;
+
+    if (broker_fd < 0) {
+        return NULL;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, APR_FROM_OS_ERROR(errno), s,
+                        "could not create log broker reply socket.");
+        return NULL;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.index   = rl->index;
+    req.logtime = logtime;
+    req.seq     = (apr_uint32_t) seq;
+    rv = ap_send_fd(broker_fd, &req, sizeof(req), sv[1]);
+    close(sv[1]);
+
+    if (APR_SUCCESS == rv) {
+        pfd.fd     = sv[0];
+        pfd.events = POLLIN;
+        while (rv = poll(&pfd, 1, BROKER_TIMEOUT), rv < 0 && EINTR == errno)
+            ;
+        if (rv > 0) {
+            rv = ap_recv_fd(sv[0], &rep, sizeof(rep), &osfd);
+            if (APR_SUCCESS == rv) {
+                rv = rep.status;
+            }
+        } else {
+            rv = rv < 0 ? APR_FROM_OS_ERROR(errno) : APR_TIMEUP;
+        }
+    }
+    close(sv[0]);
+
+    if (APR_SUCCESS != rv || osfd < 0) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                        "log broker did not supply %s, opening it directly.",
+                        rl->fname);
+        if (osfd >= 0) {
+            close(osfd);
+        }
+        return NULL;
+    }
+
+    fcntl(osfd, F_SETFD, FD_CLOEXEC);
+    if (rv = apr_os_file_put(&fd, &osfd, xfer_flags & ~APR_CREATE, p), APR_SUCCESS != rv) {
+        close(osfd);
+        return NULL;
+    }
+
+    return fd;
+}
+
+/* The broker: answer requests for log files until the parent and all the
+ * children have gone away. Each log keeps its newest file open so the file
+ * is opened once however many children ask for it. A child asking for an
+ * older file, e.g. one skipping files that RotateMaxSize filled before it
+ * started, gets it opened just for the one reply.
+ */
+static void ap_broker_main(apr_pool_t *p, server_rec *s, int sock) {
+    int n = rotated_logs->nelts;
+    apr_file_t **fds     = apr_pcalloc(p, n * sizeof(apr_file_t *));
+    apr_pool_t **pools   = apr_pcalloc(p, n * sizeof(apr_pool_t *));
+    apr_time_t *logtimes = apr_pcalloc(p, n * sizeof(apr_time_t));
+    apr_uint32_t *seqs   = apr_pcalloc(p, n * sizeof(apr_uint32_t));
+
+    for (;;) {
+        apr_status_t rv;
+        rl_broker_req req;
+        rl_broker_rep rep;
+        apr_os_file_t osfd = -1;
+        apr_file_t *fd = NULL;
+        apr_pool_t *np = NULL;
+        int reply;
+
+        if (rv = ap_recv_fd(sock, &req, sizeof(req), &reply), APR_STATUS_IS_EOF(rv)) {
+            break;
+        }
+        if (reply < 0) {
+            continue;
+        }
+
+        rep.status = APR_SUCCESS;
+        if (APR_SUCCESS != rv || req.index >= (apr_uint32_t) n) {
+            rep.status = APR_EINVAL;
+        } else if (NULL != fds[req.index] && req.logtime == logtimes[req.index] &&
+                   req.seq == seqs[req.index]) {
+            fd = fds[req.index];
+        } else if (rep.status = apr_pool_create(&np, p), APR_SUCCESS == rep.status) {
+            rotated_log *rl = APR_ARRAY_IDX(rotated_logs, req.index, rotated_log *);
+
+            if (fd = ap_open_log(np, s, rl, req.logtime, (int) req.seq),
+                NULL == fd) {
+                rep.status = APR_EGENERAL;
+            } else if (NULL == fds[req.index] || req.logtime > logtimes[req.index] ||
+                       (req.logtime == logtimes[req.index] && req.seq > seqs[req.index])) {
+                if (NULL != fds[req.index]) {
+                    apr_file_close(fds[req.index]);
+                    apr_pool_destroy(pools[req.index]);
+                }
+                fds[req.index]      = fd;
+                pools[req.index]    = np;
+                logtimes[req.index] = req.logtime;
+                seqs[req.index]     = req.seq;
+                np = NULL;
+            }
+        }
+
+        if (APR_SUCCESS == rep.status) {
+            apr_os_file_get(&osfd, fd);
+        }
+        ap_send_fd(reply, &rep, sizeof(rep), osfd);
+        close(reply);
+
+        /* An older file we opened just for this reply */
+        if (NULL != np) {
+            apr_pool_destroy(np);
+        }
+    }
+}
+
+/* Forget the broker when its configuration goes away. The broker itself is
+ * killed as a subprocess of the configuration pool.
+ */
+static apr_status_t ap_close_broker(void *data) {
+    if (broker_fd >= 0) {
+        close(broker_fd);
+        broker_fd = -1;
+    }
+    return APR_SUCCESS;
+}
+
+/* Fork the broker if any log in this configuration is shared.
+ */
+static void ap_start_broker(apr_pool_t *p, server_rec *s) {
+    apr_status_t rv;
+    apr_proc_t *proc;
+    int i, want = 0, sv[2];
+
+    if (NULL == rotated_logs) {
+        return;
+    }
+
+    for (i = 0; i < rotated_logs->nelts; ++i) {
+        rotated_log *rl = APR_ARRAY_IDX(rotated_logs, i, rotated_log *);
+        want |= (rl->st.shared && RL_DISABLED != rl->st.enabled);
+    }
+
+    if (!want) {
+        return;
+    }
+
+    /* Requests from all the children share one socket, so it has to keep
+     * the messages apart and tell the broker when everybody has gone.
+     */
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, APR_FROM_OS_ERROR(errno), s,
+                        "could not create log broker socket, "
+                        "every child will open its own logs.");
+        return;
+    }
+
+    proc = apr_pcalloc(p, sizeof(apr_proc_t));
+    if (rv = apr_proc_fork(proc, p), APR_INCHILD == rv) {
+        close(sv[1]);
+        apr_signal(SIGHUP, SIG_DFL);
+        apr_signal(SIGTERM, SIG_DFL);
+#ifdef SIGWINCH
+        apr_signal(SIGWINCH, SIG_DFL);
+#endif
+        apr_signal(SIGUSR1, SIG_DFL);
+        ap_helper_init(p, s, sv[0]);
+        ap_broker_main(p, s, sv[0]);
+        exit(0);
+    }
+
+    close(sv[0]);
+    if (APR_INPARENT != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "could not start log broker, "
+                        "every child will open its own logs.");
+        close(sv[1]);
+        return;
+    }
+
+    fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+    broker_fd = sv[1];
+    apr_pool_note_subprocess(p, proc, APR_KILL_AFTER_TIMEOUT);
+    apr_pool_cleanup_register(p, NULL, ap_close_broker, apr_pool_cleanup_null);
+}
+#endif
+
+#ifdef RL_HAVE_ONCLOSE
+/* RotateOnClose. The children tell one helper process for the whole server
+ * about every file they rotate out of, over a pipe they all inherit. The
+ * helper waits until no child has mentioned the file for a while, so that
+ * the other children have moved on too, and then runs the actions of the
+ * log on it once. Each note is a single write of at most PIPE_BUF bytes so
+ * notes from different children don't mix: this header, the file name and
+ * the packed actions, a type character and a string each.
+ */
+typedef struct {
+    apr_uint32_t    len;            /* Length of the note with this header  */
+    apr_uint32_t    delay;          /* Seconds to wait for more notes       */
+} rl_close_msg;
+
+/* A file the helper is waiting to run the actions on.
+ */
+typedef struct {
+    apr_pool_t      *pool;          /* Pool of the note, gone once it ran   */
+    const char      *path;          /* The file                             */
+    char            *acts;          /* The actions to run, packed           */
+    apr_size_t      alen;           /* Length of acts                       */
+    apr_time_t      due;            /* When to run them                     */
+} rl_close_note;
+
+static apr_file_t *onclose_fd = NULL;   /* Write end of the helper's pipe   */
+
+#ifdef HAVE_ZLIB
+/* Compress a closed log file into name.gz and remove it.
+ */
+static apr_status_t ap_onclose_gzip(apr_pool_t *p, const char *path, const char **out) {
+    apr_status_t rv;
+    apr_file_t *in;
+    const char *dest = apr_pstrcat(p, path, ".gz", NULL);
+    char *buf = apr_palloc(p, COMPRESS_BUFFER);
+    apr_size_t n;
+    gzFile gz;
+
+    if (rv = apr_file_open(&in, path, APR_READ | APR_BINARY, APR_OS_DEFAULT, p),
+        APR_SUCCESS != rv) {
+        return rv;
+    }
+    if (gz = gzopen(dest, "wb"), NULL == gz) {
+        apr_file_close(in);
+        return APR_EGENERAL;
+    }
+
+    do {
+        n  = COMPRESS_BUFFER;
+        rv = apr_file_read(in, buf, &n);
+        if (n > 0 && gzwrite(gz, buf, (unsigned) n) != (int) n) {
+            rv = APR_EGENERAL;
+        }
+    } while (APR_SUCCESS == rv);
+
+    apr_file_close(in);
+    if (Z_OK != gzclose(gz) && APR_STATUS_IS_EOF(rv)) {
+        rv = APR_EGENERAL;
+    }
+    if (!APR_STATUS_IS_EOF(rv)) {
+        apr_file_remove(dest, p);
+        return rv;
+    }
+
+    *out = dest;
+    return apr_file_remove(path, p);
+}
+#endif
+
+/* Run a program with the name of a closed log file as its argument and
+ * wait for it.
+ */
+static apr_status_t ap_onclose_exec(apr_pool_t *p, const char *prog, const char *path) {
+    apr_status_t rv;
+    apr_procattr_t *attr;
+    apr_proc_t proc;
+    apr_exit_why_e why;
+    const char *argv[3];
+    int code;
+
+    argv[0] = prog;
+    argv[1] = path;
+    argv[2] = NULL;
+
+    if (rv = apr_procattr_create(&attr, p), APR_SUCCESS != rv) {
+        return rv;
+    }
+    apr_procattr_cmdtype_set(attr, APR_PROGRAM_PATH);
+    apr_procattr_error_check_set(attr, 1);
+    if (rv = apr_proc_create(&proc, prog, argv, NULL, attr, p), APR_SUCCESS != rv) {
+        return rv;
+    }
+    if (rv = apr_proc_wait(&proc, &code, &why, APR_WAIT), APR_CHILD_DONE != rv) {
+        return rv;
+    }
+
+    return APR_PROC_EXIT == why && 0 == code ? APR_SUCCESS : APR_EGENERAL;
+}
+
+/* Run the actions on a closed log file in order. The file moves with
+ * rename and compress, and an action that fails stops the ones after it.
+ */
+static void ap_onclose_run(apr_pool_t *p, server_rec *s, const char *path,
+                           const char *acts, apr_size_t alen) {
+    const char *end = acts + alen;
+    apr_status_t rv = APR_SUCCESS;
+
+    while (acts < end && APR_SUCCESS == rv) {
+        char type       = *acts++;
+        const char *arg = acts;
+        const char *dest;
+        apr_size_t n;
+
+        acts += strlen(arg) + 1;
+        switch (type) {
+        case 'r':
+            dest = apr_pstrcat(p, arg, "/", apr_filepath_name_get(path), NULL);
+            if (rv = apr_file_rename(path, dest, p), APR_SUCCESS == rv) {
+                path = dest;
+            }
+            break;
+        case 'l':
+            dest = apr_pstrcat(p, arg, "/", apr_filepath_name_get(path), NULL);
+            rv = apr_file_link(path, dest);
+            break;
+        case 'c':
+            /* RotateCompress got there first */
+            n = strlen(path);
+            if ((n > 3 && !strcmp(path + n - 3, ".gz")) ||
+                (n > 4 && !strcmp(path + n - 4, ".zst"))) {
+                break;
+            }
+#ifdef HAVE_ZLIB
+            rv = ap_onclose_gzip(p, path, &path);
+#endif
+            break;
+        case 'x':
+            rv = ap_onclose_exec(p, arg, path);
+            break;
+        }
+
+        if (APR_SUCCESS != rv) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                            "RotateOnClose action failed for %s.", path);
+        }
+    }
+}
+
+/* Take a note from a child: run its actions once nobody has mentioned the
+ * file for its delay.
+ */
+static void ap_onclose_note(apr_pool_t *p, apr_hash_t *pending,
+                            const char *msg, apr_size_t len) {
+    rl_close_msg hdr;
+    rl_close_note *note;
+    const char *path = msg + sizeof(rl_close_msg);
+    apr_size_t plen  = strlen(path) + 1;
+
+    memcpy(&hdr, msg, sizeof(hdr));
+    if (sizeof(rl_close_msg) + plen > len) {
+        return;
+    }
+
+    if (note = apr_hash_get(pending, path, APR_HASH_KEY_STRING), NULL == note) {
+        apr_pool_t *np;
+
+        if (APR_SUCCESS != apr_pool_create(&np, p)) {
+            return;
+        }
+        note = apr_pcalloc(np, sizeof(rl_close_note));
+        note->pool = np;
+        note->path = apr_pstrdup(np, path);
+        apr_hash_set(pending, note->path, APR_HASH_KEY_STRING, note);
+    }
+
+    note->alen = len - sizeof(rl_close_msg) - plen;
+    note->acts = apr_pmemdup(note->pool, path + plen, note->alen);
+    note->due  = apr_time_now() + apr_time_from_sec(hdr.delay);
+}
+
+/* The helper process: gather notes until every child and the parent have
+ * closed the pipe, then run whatever is left straight away.
+ */
+static void ap_onclose_main(apr_pool_t *p, server_rec *s, apr_file_t *rd) {
+    apr_hash_t *pending = apr_hash_make(p);
+    char *buf = apr_palloc(p, ONCLOSE_BUFFER);
+    apr_size_t have = 0;
+    int eof = 0;
+
+    while (!eof || apr_hash_count(pending) > 0) {
+        apr_hash_index_t *hi;
+        apr_status_t rv;
+        apr_time_t now = apr_time_now(), next = SERVICE_NEVER;
+        apr_size_t n, used;
+
+        for (hi = apr_hash_first(NULL, pending); NULL != hi; hi = apr_hash_next(hi)) {
+            rl_close_note *note;
+            void *val;
+
+            apr_hash_this(hi, NULL, NULL, &val);
+            note = val;
+            if (eof || note->due <= now) {
+                apr_hash_set(pending, note->path, APR_HASH_KEY_STRING, NULL);
+                ap_onclose_run(note->pool, s, note->path, note->acts, note->alen);
+                apr_pool_destroy(note->pool);
+            } else if (note->due < next) {
+                next = note->due;
+            }
+        }
+        if (eof) {
+            continue;
+        }
+
+        apr_file_pipe_timeout_set(rd, SERVICE_NEVER == next ? -1 : next - now);
+        n  = ONCLOSE_BUFFER - have;
+        rv = apr_file_read(rd, buf + have, &n);
+        if (APR_STATUS_IS_EOF(rv)) {
+            eof = 1;
+            continue;
+        }
+        if (APR_SUCCESS != rv) {
+            if (!APR_STATUS_IS_TIMEUP(rv) && !APR_STATUS_IS_EAGAIN(rv) &&
+                !APR_STATUS_IS_EINTR(rv)) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                                "RotateOnClose helper can't read its pipe.");
+                eof = 1;
+            }
+            continue;
+        }
+
+        /* Take every complete note, and keep the start of the next one */
+        have += n;
+        for (used = 0; have - used >= sizeof(rl_close_msg); ) {
+            rl_close_msg hdr;
+
+            memcpy(&hdr, buf + used, sizeof(hdr));
+            if (hdr.len > sizeof(rl_close_msg) && hdr.len <= PIPE_CHUNK &&
+                hdr.len > have - used) {
+                break;
+            }
+            if (hdr.len <= sizeof(rl_close_msg) || hdr.len > PIPE_CHUNK ||
+                '\0' != buf[used + hdr.len - 1]) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, APR_EINVAL, s,
+                                "RotateOnClose helper got a garbled note.");
+                used = have;
+                break;
+            }
+            ap_onclose_note(p, pending, buf + used, hdr.len);
+            used += hdr.len;
+        }
+        memmove(buf, buf + used, have - used);
+        have -= used;
+    }
+}
+
+/* Start the helper when a log has RotateOnClose actions. There is only
+ * one for the life of the server: it keeps the pipe in the process pool,
+ * so the children of later generations write to the same helper, and it
+ * goes away once the last child of the last one has.
+ */
+static void ap_start_onclose(server_rec *s) {
+    apr_status_t rv;
+    apr_pool_t *pp = s->process->pool;
+    apr_file_t *rd, *wr;
+    apr_proc_t *proc;
+    apr_os_file_t osfd;
+    void *data;
+    const char *key = "log_rotate_onclose";
+    int i, want = 0;
+
+    apr_pool_userdata_get(&data, key, pp);
+    if (onclose_fd = data, NULL != onclose_fd || NULL == rotated_logs) {
+        return;
+    }
+
+    for (i = 0; i < rotated_logs->nelts; ++i) {
+        rotated_log *rl = APR_ARRAY_IDX(rotated_logs, i, rotated_log *);
+        want |= (rl->st.on_close_len > 0 && RL_DISABLED != rl->st.enabled);
+    }
+
+    if (!want) {
+        return;
+    }
+
+    /* The children mustn't wait for the helper, a note it can't take is
+     * lost rather than holding up a request.
+     */
+    if (rv = apr_file_pipe_create_ex(&rd, &wr, APR_READ_BLOCK, pp), APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "could not create RotateOnClose pipe, "
+                        "no actions will run.");
+        return;
+    }
+
+    proc = apr_pcalloc(pp, sizeof(apr_proc_t));
+    if (rv = apr_proc_fork(proc, pp), APR_INCHILD == rv) {
+        apr_file_close(wr);
+        apr_signal(SIGHUP, SIG_IGN);
+        apr_signal(SIGTERM, SIG_IGN);
+#ifdef SIGWINCH
+        apr_signal(SIGWINCH, SIG_IGN);
+#endif
+        apr_signal(SIGUSR1, SIG_IGN);
+        apr_os_file_get(&osfd, rd);
+        ap_helper_init(pp, s, osfd);
+        ap_onclose_main(pp, s, rd);
+        exit(0);
+    }
+
+    apr_file_close(rd);
+    if (APR_INPARENT != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "could not start RotateOnClose helper, "
+                        "no actions will run.");
+        apr_file_close(wr);
+        return;
+    }
+
+    apr_os_file_get(&osfd, wr);
+    fcntl(osfd, F_SETFD, FD_CLOEXEC);
+    apr_pool_userdata_set(wr, key, apr_pool_cleanup_null, pp);
+    onclose_fd = wr;
+}
+
+/* Tell the helper that this child is done with a file of the log.
+ */
+static void ap_notify_close(rotated_log *rl, server_rec *s, const char *name) {
+    apr_status_t rv;
+    char msg[PIPE_CHUNK];
+    rl_close_msg hdr;
+    apr_size_t plen = strlen(name) + 1, n;
+
+    if (NULL == onclose_fd) {
+        return;
+    }
+
+    hdr.len   = (apr_uint32_t) (sizeof(rl_close_msg) + plen + rl->st.on_close_len);
+    hdr.delay = (apr_uint32_t) apr_time_sec(rl->st.on_close_delay);
+    if (hdr.len > sizeof(msg)) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, APR_ENAMETOOLONG, s,
+                        "RotateOnClose can't take %s.", name);
+        return;
+    }
+    memcpy(msg, &hdr, sizeof(hdr));
+    memcpy(msg + sizeof(hdr), name, plen);
+    memcpy(msg + sizeof(hdr) + plen, rl->st.on_close, rl->st.on_close_len);
+
+    n = hdr.len;
+    if (rv = apr_file_write(onclose_fd, msg, &n), APR_SUCCESS != rv || n != hdr.len) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                        "RotateOnClose helper didn't take %s.", name);
+    }
+}
+
+/* The log moves on to the file called name. If that isn't the file it
+ * wrote before, the one before is done with. Reopening the same file
+ * after RotateIdleClose doesn't count.
+ */
+static void ap_switch_name(rotated_log *rl, server_rec *s, const char *name) {
+    if (NULL == rl->file_name || !strcmp(rl->file_name, name)) {
+        return;
+    }
+    if ('\0' != *rl->file_name) {
+        ap_notify_close(rl, s, rl->file_name);
+    }
+    apr_cpystrn(rl->file_name, name, PIPE_CHUNK);
+}
+#endif
+
+/* Open file number seq of a log for the quantized time logtime in pool p.
+ */
+static apr_file_t *ap_open_slot(apr_pool_t *p, server_rec *s, rotated_log *rl,
+                                apr_time_t logtime, int seq) {
+    apr_file_t *fd = NULL;
+
+#ifdef RL_HAVE_BROKER
+    if (rl->st.shared) {
+        fd = ap_open_shared_log(p, s, rl, logtime, seq);
+    }
+#endif
+    if (NULL == fd) {
+        fd = ap_open_log(p, s, rl, logtime, seq);
+    }
+
+    return fd;
+}
+
+/* Dispose of a file that has been rotated out. If there is a service thread
+ * the close is left to it so that it doesn't hold up a request.
+ */
+static void ap_retire_log(rotated_log *rl, server_rec *s, apr_file_t *fd, apr_pool_t *pool) {
+#ifdef RL_HAVE_URING
+    /* Its slot in the ring's file table, if any, is stale now */
+    apr_atomic_inc32(&rl->ugen);
+#endif
+#if APR_HAS_THREADS
+    if (NULL != service && NULL == rl->old_pool &&
+        apr_anylock_none != rl->rotate_lock.type) {
+        rl->old_fd   = fd;
+        rl->old_pool = pool;
+        apr_atomic_set32(&service->poke, 1);
+        return;
+    }
+#endif
+
+    if (NULL != fd) {
+        ap_finish_log(rl, s, fd);
+    }
+    apr_pool_destroy(pool);
+}
+
+/* RotateGrace: the file before is done with. Give it its name and dispose
+ * of it. Every child that had it open tries the rename, the first one wins.
+ * A .part that turns up once the file has its name was made by a child
+ * that raced with the rename in ap_open_log; renaming it over the file
+ * would replace the file, so the first child to claim it adds it to the
+ * end instead. The caller holds the rotate lock.
+ */
+static void ap_end_grace(rotated_log *rl, server_rec *s) {
+    const char *part, *claim;
+    apr_finfo_t finfo;
+    apr_status_t rv;
+
+    if (NULL == rl->prev_name) {
+        return;
+    }
+
+    part = apr_pstrcat(rl->prev_pool, rl->prev_name, GRACE_SUFFIX, NULL);
+    if (APR_SUCCESS == apr_stat(&finfo, rl->prev_name, APR_FINFO_TYPE, rl->prev_pool)) {
+        claim = apr_psprintf(rl->prev_pool, "%s.%" APR_PID_T_FMT, part, getpid());
+        if (APR_SUCCESS == apr_file_rename(part, claim, rl->prev_pool)) {
+            if (rv = apr_file_append(claim, rl->prev_name, APR_FILE_SOURCE_PERMS,
+                                     rl->prev_pool), APR_SUCCESS != rv) {
+                ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                                "can't add %s to %s, left it as it is.",
+                                claim, rl->prev_name);
+            } else {
+                apr_file_remove(claim, rl->prev_pool);
+            }
+        }
+    } else if (rv = apr_file_rename(part, rl->prev_name, rl->prev_pool),
+               APR_SUCCESS != rv && !APR_STATUS_IS_ENOENT(rv)) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                        "can't rename %s to %s.", part, rl->prev_name);
+    }
+#ifdef RL_HAVE_ONCLOSE
+    if (NULL != rl->file_name) {
+        ap_notify_close(rl, s, rl->prev_name);
+    }
+#endif
+
+    ap_retire_log(rl, s, rl->prev_fd, rl->prev_pool);
+    rl->prev_fd   = NULL;
+    rl->prev_pool = NULL;
+    rl->prev_name = NULL;
+    rl->prev_end  = GRACE_NONE;
+}
+
+/* Keep new writers away from the log and wait for the ones in flight. The
+ * caller must hold the rotate lock and call ap_resume_log when done.
+ */
+static void ap_quiesce_log(rotated_log *rl) {
+    apr_atomic_xchg32(&rl->rotating, 1);
+    while (0 != apr_atomic_read32(&rl->active)) {
+#if APR_HAS_THREADS
+        apr_thread_yield();
+#endif
+    }
+}
+
+static void ap_resume_log(rotated_log *rl) {
+    apr_atomic_xchg32(&rl->rotating, 0);
+}
+
+/* Note that the log has been written to in the current slot. It is only
+ * needed by RotateScheduler, RotateGrace, RotateIdleClose and RotateMaxOpen,
+ * and we only store when a flag changes so the writers don't fight over the
+ * cache line.
+ */
+static void ap_touch_log(rotated_log *rl) {
+    if ((rl->st.schedule || rl->st.grace > 0) && 0 == rl->written) {
+        apr_atomic_set32(&rl->written, 1);
+    }
+    if ((rl->st.idle_close > 0 || rl->st.max_open > 0) && 0 == rl->used) {
+        apr_atomic_set32(&rl->used, 1);
+    }
+    if (RL_SYNC_INTERVAL == rl->st.sync && 0 == rl->dirty) {
+        apr_atomic_set32(&rl->dirty, 1);
+    }
+}
+
+#ifdef RL_HAVE_MMAP
+/* How much of the mapping holds lines. Only meaningful with exclusive
+ * access, when nobody is still copying a line in.
+ */
+static apr_uint32_t ap_map_fill(rl_map *m) {
+    apr_uint32_t cut  = apr_atomic_read32(&m->cut);
+    apr_uint32_t tail = apr_atomic_read32(&m->tail);
+
+    if (cut < tail) {
+        tail = cut;
+    }
+    return tail < m->size ? tail : m->size;
+}
+
+/* Grow the file of a log and map the chunk in which the byte at off
+ * falls, ready to take lines from off onwards.
+ */
+static apr_status_t ap_map_chunk(rotated_log *rl, apr_off_t off) {
+    rl_map *m = rl->map;
+    apr_off_t start = off - off % MMAP_ALIGN;
+    apr_status_t rv;
+
+    if (rv = apr_file_trunc(rl->fd, start + MMAP_CHUNK), APR_SUCCESS != rv) {
+        return rv;
+    }
+#ifdef __linux__
+    {
+        /* Allocate the blocks now, so running out of space is an error
+         * here rather than a SIGBUS in a writer.
+         */
+        apr_os_file_t osfd;
+        int err;
+
+        if (APR_SUCCESS == apr_os_file_get(&osfd, rl->fd) &&
+            (err = posix_fallocate(osfd, start, MMAP_CHUNK)) != 0 &&
+            EINVAL != err && EOPNOTSUPP != err) {
+            apr_file_trunc(rl->fd, off);
+            return APR_FROM_OS_ERROR(err);
+        }
+    }
+#endif
+    if (rv = apr_mmap_create(&m->mm, rl->fd, start, MMAP_CHUNK,
+                             APR_MMAP_READ | APR_MMAP_WRITE, rl->pool), APR_SUCCESS != rv) {
+        m->mm = NULL;
+        apr_file_trunc(rl->fd, off);
+        return rv;
+    }
+
+    m->base   = m->mm->mm;
+    m->offset = start;
+    m->size   = MMAP_CHUNK;
+    apr_atomic_set32(&m->tail, (apr_uint32_t) (off - start));
+    apr_atomic_set32(&m->cut, APR_UINT32_MAX);
+
+    return APR_SUCCESS;
+}
+
+/* Read a number stored by ap_put_u32.
+ */
+static apr_uint32_t ap_get_u32(const unsigned char *d) {
+    return ((apr_uint32_t) d[0] << 24) | ((apr_uint32_t) d[1] << 16) |
+           ((apr_uint32_t) d[2] << 8) | (apr_uint32_t) d[3];
+}
+
+/* Where the lines of a mapped log file of size bytes end. After a crash
+ * the file ends in the zeros of the part of the last mapping that was
+ * never written. Text lines hold no NUL; a binary record may end in zeros,
+ * so the records are walked from the header instead.
+ */
+static apr_off_t ap_map_end(rotated_log *rl, apr_off_t size) {
+    apr_mmap_t *mm;
+    const unsigned char *b;
+    apr_off_t end = size, off = sizeof(BINARY_MAGIC) - 1;
+
+    if (0 == size || APR_SUCCESS != apr_mmap_create(&mm, rl->fd, 0, (apr_size_t) size,
+                                                    APR_MMAP_READ, rl->pool)) {
+        return size;
+    }
+    b = mm->mm;
+
+    if ('\0' != b[size - 1]) {
+        end = size;
+    } else if (RL_FORMAT_BINARY == rl->st.format && size >= off + 4 &&
+               !memcmp(b, BINARY_MAGIC, off)) {
+        off += 4 + ap_get_u32(b + off);
+        while (off + 4 <= size) {
+            apr_uint32_t n = ap_get_u32(b + off);
+
+            if (0 == n || off + 4 + n > size) {
+                break;
+            }
+            off += 4 + n;
+        }
+        end = off < size ? off : size;
+    } else {
+        while (end > 0 && '\0' == b[end - 1]) {
+            --end;
+        }
+    }
+
+    apr_mmap_delete(mm);
+    return end;
+}
+
+/* Map the end of a freshly opened log file. If that fails the log is
+ * written with plain writes until it is next opened.
+ */
+static void ap_map_log(rotated_log *rl, server_rec *s) {
+    apr_off_t size = ap_file_size(rl->fd), end = ap_map_end(rl, size);
+    apr_status_t rv;
+
+    if (end < size) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, s,
+                        "cutting %" APR_OFF_T_FMT " unwritten bytes off the end of "
+                        "transfer log file %s.", size - end, rl->fname);
+        apr_file_trunc(rl->fd, end);
+    }
+
+    if (rv = ap_map_chunk(rl, end), APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "could not map transfer log file %s, writing it directly.",
+                        rl->fname);
+    }
+}
+
+/* Unmap the file of a log and cut it back to the bytes that hold lines.
+ * The caller must have exclusive access to the log.
+ */
+static void ap_unmap_log(rotated_log *rl, server_rec *s) {
+    rl_map *m = rl->map;
+    apr_off_t used;
+    apr_status_t rv;
+
+    if (NULL == m || NULL == m->mm) {
+        return;
+    }
+
+    used = m->offset + ap_map_fill(m);
+    apr_mmap_delete(m->mm);
+    m->mm   = NULL;
+    m->base = NULL;
+
+    if (rv = apr_file_trunc(rl->fd, used), APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "could not truncate transfer log file %s.", rl->fname);
+    }
+}
+#endif
+
+/* RotateIndex: where the next line will go at the earliest. Lines held in
+ * buffers or queues only reach the file later, further on.
+ */
+static apr_off_t ap_index_offset(rotated_log *rl) {
+#ifdef RL_HAVE_MMAP
+    if (NULL != rl->map && NULL != rl->map->mm) {
+        apr_uint32_t tail = apr_atomic_read32(&rl->map->tail);
+
+        return rl->map->offset + (tail < rl->map->size ? tail : rl->map->size);
+    }
+#endif
+#ifdef RL_HAVE_DIRECT
+    if (NULL != rl->dio) {
+        return rl->dio->offset;
+    }
+#endif
+    return ap_file_size(rl->fd);
+}
+
+/* Append an entry to the index: the time and the offset, each as an 8 byte
+ * big-endian number, so that the index can be searched in place.
+ */
+static void ap_index_entry(rotated_log *rl, server_rec *s, apr_time_t tm, apr_off_t off) {
+    apr_status_t rv;
+    char e[16];
+    apr_size_t n = sizeof(e);
+
+    ap_put_u32(e,      (apr_uint32_t) ((apr_uint64_t) tm >> 32));
+    ap_put_u32(e + 4,  (apr_uint32_t) tm);
+    ap_put_u32(e + 8,  (apr_uint32_t) ((apr_uint64_t) off >> 32));
+    ap_put_u32(e + 12, (apr_uint32_t) off);
+    if (rv = apr_file_write(rl->idx_fd, e, &n), APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "error writing the index of %s.", rl->fname);
+    }
+}
+
+/* Open the index of the file the log has just switched to. The caller must
+ * have exclusive access to the log.
+ */
+static void ap_open_index(rotated_log *rl, server_rec *s) {
+    apr_status_t rv;
+    const char *name;
+
+    if ((rl->st.index_every <= 0 && rl->st.index_bytes <= 0) || NULL == rl->fd) {
+        return;
+    }
+
+    name = apr_pstrcat(rl->pool, ap_log_name(rl->pool, rl, rl->logtime, rl->seq),
+                       ".idx", NULL);
+    if (rv = apr_file_open(&rl->idx_fd, name, xfer_flags | APR_BINARY, xfer_perms, rl->pool),
+        APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "could not open index file %s.", name);
+        rl->idx_fd = NULL;
+    }
+    rl->idx_due  = 0;
+    rl->idx_mark = 0;
+}
+
+/* Close the index of the current file, last with an entry for the end of
+ * the file when the log is done with it. The caller must have exclusive
+ * access to the log.
+ */
+static void ap_close_index(rotated_log *rl, server_rec *s, int done) {
+    if (NULL == rl->idx_fd) {
+        return;
+    }
+    if (done && NULL != rl->fd) {
+        ap_index_entry(rl, s, apr_time_now(), ap_file_size(rl->fd));
+    }
+    apr_file_close(rl->idx_fd);
+    rl->idx_fd = NULL;
+}
+
+/* Add an entry for a line of time tm if one is due. Only one writer at a
+ * time does, the others carry on. The caller holds a reference from
+ * ap_lock_log.
+ */
+static void ap_index_log(rotated_log *rl, server_rec *s, apr_time_t tm) {
+    if (0 != apr_atomic_cas32(&rl->indexing, 1, 0)) {
+        return;
+    }
+
+    if (tm >= rl->idx_due || RL_BYTES_READ(&rl->bytes) >= rl->idx_mark) {
+        ap_index_entry(rl, s, tm, ap_index_offset(rl));
+        rl->idx_due  = rl->st.index_every > 0
+                     ? (tm / rl->st.index_every + 1) * rl->st.index_every : SERVICE_NEVER;
+        rl->idx_mark = rl->st.index_bytes > 0
+                     ? RL_BYTES_READ(&rl->bytes) + (rl_bytes_t) rl->st.index_bytes
+                     : RL_BYTES_MAX;
+    }
+
+    apr_atomic_set32(&rl->indexing, 0);
+}
+
+/* Flush the buffers of every rotated log when the child exits.
+ */
+static apr_status_t ap_flush_all_logs(void *data) {
+    server_rec *s = data;
+    int i;
+
+    if (NULL == rotated_logs && NULL == piped_logs) {
+        return APR_SUCCESS;
+    }
+
+    for (i = 0; NULL != rotated_logs && i < rotated_logs->nelts; ++i) {
+        rotated_log *rl = APR_ARRAY_IDX(rotated_logs, i, rotated_log *);
+        if (NULL != rl->buf && APR_SUCCESS == APR_ANYLOCK_LOCK(&rl->buf_lock)) {
+            ap_flush_log(rl, s);
+#ifdef RL_HAVE_DIRECT
+            if (NULL != rl->dio && NULL != rl->fd) {
+                ap_direct_close(rl, s);
+            }
+#endif
+            APR_ANYLOCK_UNLOCK(&rl->buf_lock);
+        }
+#ifdef RL_HAVE_MMAP
+        /* Cut the file back to its lines */
+        if (NULL != rl->map && APR_SUCCESS == APR_ANYLOCK_LOCK(&rl->rotate_lock)) {
+            ap_quiesce_log(rl);
+            ap_unmap_log(rl, s);
+            ap_resume_log(rl);
+            APR_ANYLOCK_UNLOCK(&rl->rotate_lock);
+        }
+#endif
+        if (NULL != rl->fd &&
+            (RL_SYNC_ROTATE == rl->st.sync || RL_SYNC_INTERVAL == rl->st.sync)) {
+            ap_sync_file(s, rl->fd);
+        }
+        /* Only once its grace is over, other children may still have late
+         * lines for the file before.
+         */
+        if (apr_time_now() >= rl->prev_end &&
+            APR_SUCCESS == APR_ANYLOCK_LOCK(&rl->rotate_lock)) {
+            ap_end_grace(rl, s);
+            APR_ANYLOCK_UNLOCK(&rl->rotate_lock);
+        }
+    }
+
+    /* Give the readers of piped logs a moment to take what is left. The
+     * pipe is shared with the other children so it stays non-blocking.
+     */
+    if (NULL != piped_logs) {
+        apr_time_t end = apr_time_now() + PIPE_EXIT_WAIT;
+
+        for (i = 0; i < piped_logs->nelts; ++i) {
+            rotated_log *rl = APR_ARRAY_IDX(piped_logs, i, rotated_log *);
+
+            if (APR_SUCCESS != APR_ANYLOCK_LOCK(&rl->buf_lock)) {
+                continue;
+            }
+            while (APR_SUCCESS == ap_pipe_flush(rl, s) && rl->buf_len > 0 &&
+                   apr_time_now() < end) {
+                apr_sleep(BLOCK_WAIT);
+            }
+            APR_ANYLOCK_UNLOCK(&rl->buf_lock);
+        }
+    }
+
+    /* The same for the network sinks */
+    if (NULL != rotated_logs) {
+        apr_time_t end = apr_time_now() + PIPE_EXIT_WAIT;
+
+        for (i = 0; i < rotated_logs->nelts; ++i) {
+            rotated_log *rl = APR_ARRAY_IDX(rotated_logs, i, rotated_log *);
+            rl_sink *sk;
+
+            for (sk = rl->sinks; NULL != sk; sk = sk->next) {
+                if (APR_SUCCESS != APR_ANYLOCK_LOCK(&sk->lock)) {
+                    continue;
+                }
+                while (APR_SUCCESS == ap_sink_flush(sk, s) && sk->len > 0 &&
+                       apr_time_now() < end) {
+                    apr_sleep(BLOCK_WAIT);
+                }
+                APR_ANYLOCK_UNLOCK(&sk->lock);
+            }
+        }
+    }
+
+    ap_push_metrics();
+    return APR_SUCCESS;
+}
+
+#if APR_HAS_THREADS
+/* At child exit: write out the buffers of the request threads and free
+ * them. A thread that still logs after this writes its lines directly.
+ */
+static apr_status_t ap_drop_threads(void *data) {
+    server_rec *s = data;
+    rl_thread *t, *next;
+    int i;
+
+    thread_key = NULL;
+    for (i = 0; NULL != rotated_logs && i < rotated_logs->nelts; ++i) {
+        rotated_log *rl = APR_ARRAY_IDX(rotated_logs, i, rotated_log *);
+
+        if (NULL != rl->tbufs && APR_SUCCESS == APR_ANYLOCK_LOCK(&rl->rotate_lock)) {
+            ap_quiesce_log(rl);
+            ap_flush_threads(rl, s);
+            rl->tbufs = NULL;
+            ap_resume_log(rl);
+            APR_ANYLOCK_UNLOCK(&rl->rotate_lock);
+        }
+    }
+
+    for (t = apr_atomic_xchgptr((volatile void **) &threads, NULL); NULL != t; t = next) {
+        next = t->next;
+        apr_pool_destroy(t->pool);
+    }
+    return APR_SUCCESS;
+}
+#endif
+
+/* Close the file of a log without opening another one. The next write
+ * opens it again. The caller must have exclusive access to the log.
+ */
+static void ap_release_log(rotated_log *rl, server_rec *s) {
+    apr_pool_t *np;
+
+    if (NULL != rl->buf) {
+        ap_flush_log(rl, s);
+    }
+#if APR_HAS_THREADS
+    ap_flush_threads(rl, s);
+#endif
+#ifdef RL_HAVE_MMAP
+    ap_unmap_log(rl, s);
+#endif
+#ifdef RL_HAVE_DIRECT
+    if (NULL != rl->dio && NULL != rl->fd) {
+        ap_direct_close(rl, s);
+    }
+#endif
+    ap_close_index(rl, s, 0);
+
+    if (NULL == rl->fd ||
+        APR_SUCCESS != apr_pool_create(&np, apr_pool_parent_get(rl->pool))) {
+        return;
+    }
+
+    ap_retire_log(rl, s, rl->fd, rl->pool);
+    rl->fd   = NULL;
+    rl->pool = np;
+    apr_atomic_dec32(&open_logs);
+}
+
+/* RotateMaxOpen: before a log opens a file, close the file of the least
+ * recently used other log if the child is at the limit. A log whose rotate
+ * lock is busy is passed over so that we can't deadlock with a writer that
+ * is rotating it; the limit may then be exceeded for a while.
+ */
+static void ap_make_room(rotated_log *self, server_rec *s) {
+    rotated_log *victim = NULL;
+    int i;
+
+    if (self->st.max_open <= 0 ||
+        apr_atomic_read32(&open_logs) < (apr_uint32_t) self->st.max_open) {
+        return;
+    }
+
+    /* Unlocked peeks, checked again below under the victim's lock */
+    for (i = 0; i < rotated_logs->nelts; ++i) {
+        rotated_log *rl = APR_ARRAY_IDX(rotated_logs, i, rotated_log *);
+
+        if (rl == self || NULL == rl->fd || apr_anylock_none == rl->rotate_lock.type) {
+            continue;
+        }
+        if (NULL == victim ||
+            (rl->used < victim->used) ||
+            (rl->used == victim->used && rl->last_used < victim->last_used)) {
+            victim = rl;
+        }
+    }
+
+    if (NULL == victim || APR_SUCCESS != APR_ANYLOCK_TRYLOCK(&victim->rotate_lock)) {
+        return;
+    }
+
+#ifdef RL_HAVE_URING
+    /* Its buffer is still being written by the service thread */
+    if (victim->upending) {
+        APR_ANYLOCK_UNLOCK(&victim->rotate_lock);
+        return;
+    }
+#endif
+
+    if (NULL != victim->fd) {
+        RL_TRACE(s, (APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, s,
+                     "closing %s to make room for %s", victim->fname, self->fname));
+        ap_quiesce_log(victim);
+        ap_release_log(victim, s);
+        ap_resume_log(victim);
+    }
+
+    APR_ANYLOCK_UNLOCK(&victim->rotate_lock);
+}
+
+/* Switch the log over to the file for the slot containing tm, or to the
+ * next file in the slot if the current one has reached RotateMaxSize. The
+ * caller must have exclusive access to the log: it holds the rotate lock
+ * and no writer is active.
+ */
+static void ap_rotate_log(rotated_log *rl, server_rec *s, apr_time_t tm) {
+    apr_status_t rv;
+    apr_file_t *nfd = NULL;
+    apr_pool_t *np = NULL;
+    apr_off_t size = 0;
+    apr_time_t start = apr_time_now();
+    apr_time_t old_logtime = rl->logtime;
+    apr_time_t old_start = rl->slot_start, old_end = rl->slot_end;
+    int seq = rl->seq;
+
+    /* Anything still buffered belongs in the old log file. Nobody else can
+     * be using the buffers while we have exclusive access.
+     */
+    if (NULL != rl->buf) {
+        ap_flush_log(rl, s);
+    }
+#if APR_HAS_THREADS
+    ap_flush_threads(rl, s);
+#endif
+
+    /* A line from before the current slot, e.g. from a request that started
+     * before the last rotation, doesn't take us back to an older file.
+     */
+    if (tm >= rl->slot_end) {
+        RL_TRACE(s, (APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, s,
+                     "rotating %s: time %" APR_TIME_T_FMT ", slot end %" APR_TIME_T_FMT,
+                     rl->fname, apr_time_sec(tm), apr_time_sec(rl->slot_end)));
+        ap_set_slot(rl, tm);
+        seq = 0;
+    } else if (NULL != rl->fd) {
+        /* Our count has passed size_check, see how big the file really is */
+#ifdef RL_HAVE_MMAP
+        if (NULL != rl->map && NULL != rl->map->mm) {
+            size = rl->map->offset + ap_map_fill(rl->map);
+        } else
+#endif
+        size = ap_file_size(rl->fd);
+        ap_set_size(rl, size);
+        if (size < rl->st.max_size) {
+            return;
+        }
+
+        RL_TRACE(s, (APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, s,
+                     "rotating %s: size %" APR_OFF_T_FMT " reached %" APR_OFF_T_FMT,
+                     rl->fname, size, rl->st.max_size));
+        ++seq;
+    }
+
+    /* Use the file opened ahead of time if it is the right one */
+    if (NULL != rl->next_pool && rl->next_logtime <= rl->logtime) {
+        if (rl->next_logtime == rl->logtime && 0 == seq) {
+            nfd = rl->next_fd;
+            np  = rl->next_pool;
+        } else {
+            ap_retire_log(rl, s, rl->next_fd, rl->next_pool);
+        }
+        rl->next_fd   = NULL;
+        rl->next_pool = NULL;
+    }
+
+    if (NULL == rl->fd) {
+        ap_make_room(rl, s);
+    }
+
+    if (NULL == nfd) {
+        /* Create a new pool to provide storage for the new file.
+         * Once we have the new file open we'll destroy the old
+         * pool and make this one current.
+         */
+        if (rv = apr_pool_create(&np, apr_pool_parent_get(rl->pool)), APR_SUCCESS != rv) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                            "can't make log rotation pool.");
+            return;
+        }
+
+        if (nfd = ap_open_slot(np, s, rl, rl->logtime, seq), NULL == nfd) {
+            /* Open failed so keep going with the old log and destroy the
+             * new pool.
+             */
+            RL_METRIC(RL_M_OPEN_FAILURES, 1);
+            apr_pool_destroy(np);
+            return;
+        }
+    }
+
+    /* Skip files that are full already, e.g. from before a restart */
+    while (rl->st.max_size > 0 && (size = ap_file_size(nfd)) >= rl->st.max_size) {
+        ap_close_log(s, nfd);
+        if (nfd = ap_open_slot(np, s, rl, rl->logtime, ++seq), NULL == nfd) {
+            RL_METRIC(RL_M_OPEN_FAILURES, 1);
+            apr_pool_destroy(np);
+            return;
+        }
+    }
+
+    /* Switch to the new file and get rid of the old one */
+    if (NULL == rl->fd) {
+        apr_atomic_inc32(&open_logs);
+    }
+#ifdef RL_HAVE_MMAP
+    ap_unmap_log(rl, s);
+#endif
+#ifdef RL_HAVE_DIRECT
+    if (NULL != rl->dio && NULL != rl->fd) {
+        ap_direct_close(rl, s);
+    }
+#endif
+    ap_close_index(rl, s, 1);
+    if (rl->st.grace > 0 && old_end > 0 &&
+        (old_logtime != rl->logtime || seq != rl->seq)) {
+        /* RotateGrace: keep the file before open for late lines. After a
+         * size rotation the grace counts from now.
+         */
+        ap_end_grace(rl, s);
+        rl->prev_fd       = rl->fd;
+        rl->prev_pool     = rl->pool;
+        rl->prev_name     = ap_log_name(rl->pool, rl, old_logtime, rl->seq);
+        rl->prev_start    = old_start;
+        rl->prev_slot_end = old_end;
+        rl->prev_end      = (old_logtime != rl->logtime ? old_end : start) + rl->st.grace;
+    } else {
+        ap_retire_log(rl, s, rl->fd, rl->pool);
+    }
+    rl->fd   = nfd;
+    rl->pool = np;
+    rl->seq  = seq;
+    ap_set_size(rl, size);
+#ifdef RL_HAVE_ONCLOSE
+    if (0 == rl->st.grace) {
+        ap_switch_name(rl, s, ap_log_name(np, rl, rl->logtime, seq));
+    }
+#endif
+    if (start >= rl->prev_end) {
+        ap_end_grace(rl, s);
+    }
+#ifdef RL_HAVE_MMAP
+    if (NULL != rl->map) {
+        ap_map_log(rl, s);
+    }
+#endif
+#ifdef RL_HAVE_DIRECT
+    if (NULL != rl->dio) {
+        ap_direct_open(rl, s);
+    }
+#endif
+    ap_open_index(rl, s);
+    RL_METRIC(RL_M_ROTATIONS, 1);
+    RL_METRIC(RL_M_ROTATE_USEC, apr_time_now() - start);
+
+#if APR_HAS_THREADS
+    /* The service thread has a file to close and a new slot to look at */
+    if (NULL != service) {
+        apr_atomic_set32(&service->poke, 1);
+    }
+#endif
+}
+
+/* Get a reference to the log, rotating to a new log if tm is past the end
+ * of the current slot or the current file may have grown past RotateMaxSize.
+ * If it returns APR_SUCCESS the reference is held and rl->fd may be used
+ * until ap_unlock_log, otherwise it is not.
+ *
+ * Rotation happens maybe once a day so the common case must not touch a
+ * lock. A writer announces itself by bumping rl->active and then checks
+ * that nobody is rotating and that the current file is still the right
+ * one. A rotation raises rl->rotating and waits for rl->active to drain
+ * before it touches rl->fd, so the old file stays valid until the last
+ * writer using it has finished. Both sides use full barrier atomics so
+ * one of them always sees the other.
+ */
+static apr_status_t ap_lock_log(rotated_log *rl, server_rec *s, apr_time_t tm) {
+    apr_status_t rv = 0;
+    apr_time_t start;
+
+    apr_atomic_inc32(&rl->active);
+
+    /* Decide if the time has rolled over into a new slot. */
+    if (0 == apr_atomic_read32(&rl->rotating) &&
+        tm < rl->slot_end && NULL != rl->fd && tm < rl->prev_end &&
+        RL_BYTES_READ(&rl->bytes) < rl->size_check) {
+        ap_touch_log(rl);
+        if (NULL != rl->idx_fd &&
+            (tm >= rl->idx_due || RL_BYTES_READ(&rl->bytes) >= rl->idx_mark)) {
+            ap_index_log(rl, s, tm);
+        }
+        return APR_SUCCESS;
+    }
+
+    apr_atomic_dec32(&rl->active);
+
+    /* Get the rotate lock */
+    start = apr_time_now();
+    if (rv = APR_ANYLOCK_LOCK(&rl->rotate_lock), APR_SUCCESS != rv) {
+        return rv;
+    }
+    ap_metric_wait(apr_time_now() - start);
+
+    /* Now check again in case someone else rotated the log while we waited
+     * for the rotate lock.
+     */
+    if (tm >= rl->slot_end || NULL == rl->fd ||
+        RL_BYTES_READ(&rl->bytes) >= rl->size_check) {
+        ap_quiesce_log(rl);
+        ap_rotate_log(rl, s, tm);
+        ap_resume_log(rl);
+    }
+    if (tm >= rl->prev_end) {
+        ap_end_grace(rl, s);
+    }
+
+    /* If we don't have a file, return an error */
+    if (NULL == rl->fd) {
+        APR_ANYLOCK_UNLOCK(&rl->rotate_lock);
+        return APR_ENOENT;
+    }
+
+    /* Take our reference before anyone else can start a rotation */
+    apr_atomic_inc32(&rl->active);
+    ap_touch_log(rl);
+    if (NULL != rl->idx_fd) {
+        ap_index_log(rl, s, tm);
+    }
+
+    return APR_ANYLOCK_UNLOCK(&rl->rotate_lock);
+}
+
+/* Release the reference on the log
+ */
+static apr_status_t ap_unlock_log(rotated_log *rl) {
+    apr_atomic_dec32(&rl->active);
+    return APR_SUCCESS;
+}
+
+#ifdef RL_HAVE_MMAP
+/* The mapping of a log is full: map the next chunk. This needs exclusive
+ * access so that nobody is still copying into the old mapping. A line too
+ * long to be worth mapping is appended to the file in between, in which
+ * case APR_SUCCESS is returned. APR_EAGAIN tells the caller to try its
+ * reservation again.
+ */
+static apr_status_t ap_remap_log(rotated_log *rl, server_rec *s,
+                                 const char **strs, int *strl,
+                                 int nelts, apr_size_t len) {
+    rl_map *m = rl->map;
+    apr_status_t rv;
+    apr_off_t end;
+
+    if (rv = APR_ANYLOCK_LOCK(&rl->rotate_lock), APR_SUCCESS != rv) {
+        return rv;
+    }
+
+    ap_quiesce_log(rl);
+    rv = APR_EAGAIN;
+
+    /* Somebody else may have mapped the next chunk while we waited */
+    if (NULL != m->mm && NULL != rl->fd &&
+        (len > MMAP_LINE_MAX || APR_UINT32_MAX != apr_atomic_read32(&m->cut))) {
+        end = m->offset + ap_map_fill(m);
+        apr_mmap_delete(m->mm);
+        m->mm = NULL;
+
+        if (len > MMAP_LINE_MAX) {
+            if (rv = apr_file_trunc(rl->fd, end), APR_SUCCESS == rv &&
+                (rv = ap_writev_log(rl->fd, NULL, 0, strs, strl, nelts)) == APR_SUCCESS) {
+                ap_count_log(rl, len);
+                end += len;
+            }
+        }
+
+        if (APR_SUCCESS != ap_map_chunk(rl, end)) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, APR_SUCCESS, s,
+                            "could not map more of transfer log file %s, "
+                            "writing it directly.", rl->fname);
+            apr_file_trunc(rl->fd, end);
+        }
+    }
+
+    ap_resume_log(rl);
+    APR_ANYLOCK_UNLOCK(&rl->rotate_lock);
+
+    return rv;
+}
+
+/* RotateLogsMmap: copy a line into the mapping of the log. A writer claims
+ * its space with a single atomic add, so threads don't serialise on a lock
+ * or make a system call for each line.
+ */
+static apr_status_t ap_mmap_write(rotated_log *rl, request_rec *r,
+                                  const char **strs, int *strl,
+                                  int nelts, apr_size_t len) {
+    rl_map *m = rl->map;
+    apr_uint32_t pos, cut;
+    apr_status_t rv;
+    char *d;
+    int i;
+
+    for (;;) {
+        if (rv = ap_lock_log(rl, r->server, r->request_time), APR_SUCCESS != rv) {
+            return rv;
+        }
+
+        if (NULL == m->mm) {
+            /* Couldn't map the file, write it the old way */
+            if (rv = ap_writev_log(rl->fd, NULL, 0, strs, strl, nelts), APR_SUCCESS == rv) {
+                ap_count_log(rl, len);
+            }
+            ap_unlock_log(rl);
+            return rv;
+        }
+
+        if (len <= MMAP_LINE_MAX) {
+            pos = apr_atomic_add32(&m->tail, (apr_uint32_t) len);
+            if ((apr_uint64_t) pos + len <= m->size) {
+                for (i = 0, d = m->base + pos; i < nelts; ++i) {
+                    memcpy(d, strs[i], strl[i]);
+                    d += strl[i];
+                }
+                ap_count_log(rl, len);
+                return ap_unlock_log(rl);
+            }
+
+            /* It doesn't fit, the lines end where the first misfit starts */
+            while (cut = apr_atomic_read32(&m->cut), pos < cut &&
+                   apr_atomic_cas32(&m->cut, pos, cut) != cut)
+                ;
+        }
+
+        ap_unlock_log(rl);
+        if (rv = ap_remap_log(rl, r->server, strs, strl, nelts, len), APR_EAGAIN != rv) {
+            return rv;
+        }
+    }
+}
+#endif
+
+#if APR_HAS_THREADS
+/* Wake the writer thread if it is waiting for work. Unless forced we only
+ * touch the mutex when the thread has said it is asleep.
+ */
+static void ap_service_wake(rl_service *sv, int force) {
+    if (force || 0 != apr_atomic_read32(&sv->sleeping)) {
+        apr_thread_mutex_lock(sv->mutex);
+        apr_thread_cond_signal(sv->cond);
+        apr_thread_mutex_unlock(sv->mutex);
+    }
+}
+
+/* Write a line that didn't fit in the async queue to the spill file.
+ */
+static apr_status_t ap_spill_log(rotated_log *rl, server_rec *s,
+                                 const char **strs, int *strl, int nelts) {
+    rl_ring *q = rl->ring;
+    apr_status_t rv;
+
+    if (rv = APR_ANYLOCK_LOCK(&q->spill_lock), APR_SUCCESS != rv) {
+        return rv;
+    }
+
+    if (NULL == q->spill_fd) {
+        if (rv = apr_file_open(&q->spill_fd, rl->st.spill, xfer_flags, xfer_perms, q->pool),
+            APR_SUCCESS != rv) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                            "could not open log spill file %s.", rl->st.spill);
+            q->spill_fd = NULL;
+        }
+    }
+
+    if (NULL != q->spill_fd) {
+        rv = ap_writev_log(q->spill_fd, NULL, 0, strs, strl, nelts);
+    }
+
+    APR_ANYLOCK_UNLOCK(&q->spill_lock);
+    return rv;
+}
+
+/* Queue a log line for the writer thread. Each cell carries a sequence
+ * number: a producer may claim the cell at head when its sequence equals
+ * head, and once it has filled the cell it sets the sequence to head + 1 to
+ * hand it to the writer thread. The writer thread in turn sets it to
+ * head + cells to give the cell back to the producers for the next lap.
+ */
+static apr_status_t ap_queue_log(rotated_log *rl, request_rec *r,
+                                 const char **strs, int *strl,
+                                 int nelts, apr_size_t len) {
+    rl_ring *q = rl->ring;
+    rl_cell *c;
+    apr_uint32_t pos;
+    apr_int32_t diff;
+    char *d;
+    int i;
+
+    for (;;) {
+        pos  = apr_atomic_read32(&q->head);
+        c    = &q->cells[pos & q->mask];
+        diff = (apr_int32_t) (apr_atomic_read32(&c->seq) - pos);
+
+        if (0 == diff) {
+            if (apr_atomic_cas32(&q->head, pos + 1, pos) == pos) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* The queue is full */
+            switch (rl->st.overflow) {
+            case RL_OVERFLOW_DROP:
+                apr_atomic_inc32(&q->dropped);
+                return APR_SUCCESS;
+            case RL_OVERFLOW_SPILL:
+                return ap_spill_log(rl, r->server, strs, strl, nelts);
+            default:
+                ap_service_wake(service, 1);
+                apr_sleep(BLOCK_WAIT);
+                break;
+            }
+        }
+    }
+
+    /* The cell is ours until we publish it */
+    if (c->size < len) {
+        free(c->data);
+        c->size = len > ASYNC_CELL_MIN ? len : ASYNC_CELL_MIN;
+        if (c->data = malloc(c->size), NULL == c->data) {
+            c->size = 0;
+        }
+    }
+
+    if (NULL == c->data) {
+        /* Out of memory, publish an empty line and count it as dropped */
+        apr_atomic_inc32(&q->dropped);
+        c->len = 0;
+    } else {
+        for (i = 0, d = c->data; i < nelts; ++i) {
+            memcpy(d, strs[i], strl[i]);
+            d += strl[i];
+        }
+        c->len = len;
+    }
+    c->time = r->request_time;
+
+    apr_atomic_xchg32(&c->seq, pos + 1);
+    ap_service_wake(service, 0);
+
+    return APR_SUCCESS;
+}
+
+/* Is there a line waiting at the tail of the queue?
+ */
+static int ap_ring_ready(rl_ring *q) {
+    rl_cell *c = &q->cells[q->tail & q->mask];
+    return (apr_int32_t) (apr_atomic_read32(&c->seq) - (q->tail + 1)) >= 0;
+}
+
+/* Move every queued line of a log into its buffer, rotating as required by
+ * the request time of each line, and write the batch out. Only the writer
+ * thread calls this. Returns the number of lines handled.
+ */
+static int ap_drain_log(rotated_log *rl, server_rec *s) {
+    rl_ring *q = rl->ring;
+    apr_uint32_t dropped;
+    int n = 0;
+
+    while (ap_ring_ready(q)) {
+        rl_cell *c = &q->cells[q->tail & q->mask];
+        const char *str = c->data;
+        int strl = (int) c->len;
+
+        if (APR_SUCCESS == ap_lock_log(rl, s, c->time)) {
+            ap_buffer_log(rl, s, &str, &strl, 1, c->len);
+            ap_unlock_log(rl);
+        }
+
+        apr_atomic_xchg32(&c->seq, q->tail + q->mask + 1);
+        ++q->tail;
+        ++n;
+    }
+
+    if (dropped = apr_atomic_xchg32(&q->dropped, 0), dropped > 0) {
+        RL_METRIC(RL_M_DROPS, dropped);
+        ap_log_error(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, s,
+                        "async log queue for %s overflowed, %lu lines dropped.",
+                        rl->fname, (unsigned long) dropped);
+    }
+
+    /* Write the batch out now unless RotateLogsBuffer asked us to hold it */
+    if (rl->buf_len > 0 &&
+        (q->flush || (rl->st.buffer_age > 0 &&
+                      apr_time_now() - rl->buf_time >= rl->st.buffer_age))) {
+        if (APR_SUCCESS == ap_lock_log(rl, s, apr_time_now())) {
+            ap_flush_log(rl, s);
+            ap_unlock_log(rl);
+        }
+    }
+
+    return n;
+}
+
+/* How long before the end of its slot the next file of a log is opened.
+ * With RotateScheduler the opens of logs sharing an interval are spread
+ * over the jitter window so that they don't all hit the file system at
+ * the same moment.
+ */
+static apr_time_t ap_preopen_lead(rotated_log *rl) {
+    apr_time_t lead = rl->st.preopen;
+
+    if (rl->st.schedule && rl->st.jitter > 0) {
+        lead += (apr_time_t) ((apr_uint32_t) rl->index * 2654435761U) % rl->st.jitter;
+    }
+
+    return lead;
+}
+
+/* Close the file of a log that wasn't written to during its slot and move
+ * the log on to the slot containing now. The next write opens the new
+ * file, so idle logs don't hold a descriptor or leave empty files behind.
+ * The caller must have exclusive access to the log.
+ */
+static void ap_idle_log(rotated_log *rl, server_rec *s, apr_time_t now) {
+    if (ap_release_log(rl, s), NULL != rl->fd) {
+        return;
+    }
+
+    RL_TRACE(s, (APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, s,
+                 "closing idle %s: time %" APR_TIME_T_FMT ", slot end %" APR_TIME_T_FMT,
+                 rl->fname, apr_time_sec(now), apr_time_sec(rl->slot_end)));
+    ap_set_slot(rl, now);
+    rl->seq = 0;
+    ap_set_size(rl, 0);
+}
+
+/* RotateScheduler: move a log on to its next slot at rollover instead of
+ * leaving it to the next write, so that all the logs sharing an interval
+ * are rotated in one pass of the service thread. RotateGrace does the same:
+ * every child then has written out what it holds for the old file and
+ * moved on well before the first of them gives the file its name. Returns
+ * when the log next needs the scheduler.
+ */
+static apr_time_t ap_schedule_log(rotated_log *rl, server_rec *s, apr_time_t now) {
+    apr_time_t due;
+
+    if (!rl->st.schedule && 0 == rl->st.grace) {
+        return SERVICE_NEVER;
+    }
+    if (now < rl->slot_end) {
+        return rl->slot_end;
+    }
+    if (APR_SUCCESS != APR_ANYLOCK_LOCK(&rl->rotate_lock)) {
+        return now + SERVICE_TICK;
+    }
+
+    /* A writer may have got there first */
+    if (now >= rl->slot_end) {
+        ap_quiesce_log(rl);
+        if (0 != apr_atomic_read32(&rl->written)) {
+            ap_rotate_log(rl, s, now);
+        } else {
+            ap_idle_log(rl, s, now);
+        }
+        apr_atomic_set32(&rl->written, 0);
+        ap_resume_log(rl);
+    }
+
+    /* Try again shortly if the log couldn't be moved on */
+    due = rl->slot_end > now ? rl->slot_end : now + SERVICE_TICK;
+    APR_ANYLOCK_UNLOCK(&rl->rotate_lock);
+
+    return due;
+}
+
+/* RotateIdleClose: close the file of a log nobody has written to for the
+ * configured time. The used flag is sampled and cleared on each visit, so
+ * the file is closed at the first visit that finds it still clear a full
+ * idle time after the last one that found it set. The same visits keep
+ * last_used up to date for RotateMaxOpen. Returns when the log next wants
+ * a visit.
+ */
+static apr_time_t ap_expire_log(rotated_log *rl, server_rec *s, apr_time_t now) {
+    if (rl->st.idle_close <= 0 && rl->st.max_open <= 0) {
+        return SERVICE_NEVER;
+    }
+
+    if (0 != apr_atomic_xchg32(&rl->used, 0) || 0 == rl->last_used) {
+        rl->last_used = now;
+    }
+
+    if (rl->st.idle_close <= 0) {
+        return now + LRU_SAMPLE;
+    }
+    if (NULL == rl->fd) {
+        /* Nothing to close until somebody writes again */
+        return now + (rl->st.max_open > 0 ? LRU_SAMPLE : rl->st.idle_close);
+    }
+    if (now - rl->last_used < rl->st.idle_close) {
+        return rl->last_used + rl->st.idle_close;
+    }
+
+    if (APR_SUCCESS != APR_ANYLOCK_LOCK(&rl->rotate_lock)) {
+        return now + SERVICE_TICK;
+    }
+    if (NULL != rl->fd && 0 == apr_atomic_read32(&rl->used)) {
+        RL_TRACE(s, (APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, s,
+                     "closing %s: idle since %" APR_TIME_T_FMT,
+                     rl->fname, apr_time_sec(rl->last_used)));
+        ap_quiesce_log(rl);
+        ap_release_log(rl, s);
+        ap_resume_log(rl);
+    }
+    APR_ANYLOCK_UNLOCK(&rl->rotate_lock);
+
+    return now + rl->st.idle_close;
+}
+
+/* RotateSync interval: sync the file of a log that has been written to
+ * since the last time. The rotate lock keeps the file from being closed
+ * under us but writers carry on. Returns when the log next wants a sync.
+ */
+static apr_time_t ap_sync_log(rotated_log *rl, server_rec *s, apr_time_t now) {
+    if (RL_SYNC_INTERVAL != rl->st.sync) {
+        return SERVICE_NEVER;
+    }
+    if (now < rl->synced + rl->st.sync_interval) {
+        return rl->synced + rl->st.sync_interval;
+    }
+
+    if (0 != apr_atomic_xchg32(&rl->dirty, 0)) {
+        if (APR_SUCCESS != APR_ANYLOCK_LOCK(&rl->rotate_lock)) {
+            apr_atomic_set32(&rl->dirty, 1);
+            return now + SERVICE_TICK;
+        }
+        if (NULL != rl->fd) {
+            ap_sync_file(s, rl->fd);
+        }
+        APR_ANYLOCK_UNLOCK(&rl->rotate_lock);
+    }
+
+    rl->synced = now;
+    return now + rl->st.sync_interval;
+}
+
+/* RotateGrace: finish the file before once its grace is over, even if no
+ * line comes along to do it. Returns when the log next wants a look.
+ */
+static apr_time_t ap_grace_log(rotated_log *rl, server_rec *s, apr_time_t now) {
+    if (GRACE_NONE == rl->prev_end) {
+        return SERVICE_NEVER;
+    }
+    if (now < rl->prev_end) {
+        return rl->prev_end;
+    }
+
+    if (APR_SUCCESS != APR_ANYLOCK_LOCK(&rl->rotate_lock)) {
+        return now + SERVICE_TICK;
+    }
+    if (now >= rl->prev_end) {
+        ap_end_grace(rl, s);
+    }
+    APR_ANYLOCK_UNLOCK(&rl->rotate_lock);
+
+    return SERVICE_NEVER;
+}
+
+#ifdef RL_HAVE_WRITEBEHIND
+/* RotateCacheHint dontneed <MB>: start writeback of each stretch of a log
+ * file as soon as that much has been written to it, and drop the stretch
+ * before from the page cache once it has reached the disk. That keeps the
+ * dirty and cached pages of a busy log down to about two stretches.
+ * Returns when the log next wants a look.
+ */
+static apr_time_t ap_writebehind_log(rotated_log *rl, server_rec *s, apr_time_t now) {
+    apr_os_file_t osfd;
+    apr_off_t size;
+
+    if (rl->st.writebehind <= 0) {
+        return SERVICE_NEVER;
+    }
+    if (APR_SUCCESS != APR_ANYLOCK_LOCK(&rl->rotate_lock)) {
+        return now + SERVICE_TICK;
+    }
+
+    if (NULL != rl->fd && APR_SUCCESS == apr_os_file_get(&osfd, rl->fd) &&
+        (size = ap_file_size(rl->fd)) - rl->wb_mark >= rl->st.writebehind) {
+        sync_file_range(osfd, rl->wb_mark, size - rl->wb_mark, SYNC_FILE_RANGE_WRITE);
+        if (rl->wb_mark > rl->wb_prev) {
+            sync_file_range(osfd, rl->wb_prev, rl->wb_mark - rl->wb_prev,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(osfd, rl->wb_prev, rl->wb_mark - rl->wb_prev,
+                          POSIX_FADV_DONTNEED);
+        }
+        rl->wb_prev = rl->wb_mark;
+        rl->wb_mark = size;
+    }
+    APR_ANYLOCK_UNLOCK(&rl->rotate_lock);
+
+    return now + SERVICE_TICK;
+}
+#endif
+
+/* RotateThreadBuffer with a maximum age: write out the buffers of request
+ * threads that have gone quiet, which would otherwise hold their lines
+ * until their next line, a rotation or the child's exit. A buffer that its
+ * thread is busy with is left to the thread, which checks the age itself.
+ * The rotate lock keeps a rotation from changing the file meanwhile.
+ * Returns when the oldest buffer left is due.
+ */
+static apr_time_t ap_age_threads(rotated_log *rl, server_rec *s, apr_time_t now) {
+    apr_time_t due = now + rl->st.buffer_age;
+    rl_tbuf *tb;
+
+    if (!rl->st.thread_buffer || 0 == rl->st.buffer_age ||
+        apr_anylock_none == rl->rotate_lock.type) {
+        return SERVICE_NEVER;
+    }
+    if (NULL == rl->tbufs) {
+        return due;
+    }
+    if (APR_SUCCESS != APR_ANYLOCK_LOCK(&rl->rotate_lock)) {
+        return now + SERVICE_TICK;
+    }
+
+    for (tb = rl->tbufs; NULL != tb; tb = tb->next) {
+        if (0 != apr_atomic_cas32(&tb->busy, 1, 0)) {
+            continue;
+        }
+        if (tb->len > 0 && now - tb->time >= rl->st.buffer_age) {
+            ap_thread_flush(rl, s, tb);
+        } else if (tb->len > 0 && tb->time + rl->st.buffer_age < due) {
+            due = tb->time + rl->st.buffer_age;
+        }
+        apr_atomic_set32(&tb->busy, 0);
+    }
+
+    APR_ANYLOCK_UNLOCK(&rl->rotate_lock);
+    return due;
+}
+
+/* Periodic housekeeping for a log: close the file the last rotation left
+ * behind and, with RotatePreopen or RotateScheduler, open the file of the
+ * next slot shortly before the current one ends so that the rotation
+ * itself only has to swap pointers. The slow parts run without the rotate
+ * lock held. Returns when the log next needs housekeeping.
+ */
+static apr_time_t ap_maintain_log(rotated_log *rl, server_rec *s, apr_time_t now) {
+    apr_file_t *ofd, *nfd;
+    apr_pool_t *opool, *np, *par;
+    apr_time_t logtime, start, end, lead, due = SERVICE_NEVER;
+    int want;
+
+    /* Without a lock the log is for request threads only */
+    if (apr_anylock_none == rl->rotate_lock.type) {
+        return SERVICE_NEVER;
+    }
+    if (APR_SUCCESS != APR_ANYLOCK_LOCK(&rl->rotate_lock)) {
+        return now + SERVICE_TICK;
+    }
+
+    ofd   = rl->old_fd;
+    opool = rl->old_pool;
+    rl->old_fd   = NULL;
+    rl->old_pool = NULL;
+
+    lead = ap_preopen_lead(rl);
+    want = (lead > 0 && NULL == rl->next_pool && NULL != rl->pool);
+    if (want && now < rl->slot_end - lead) {
+        /* Not yet */
+        due  = rl->slot_end - lead;
+        want = 0;
+    } else if (want && rl->st.schedule && 0 == rl->written) {
+        /* Nobody wants this log at the moment, see again later */
+        due  = now + SERVICE_TICK < rl->slot_end ? now + SERVICE_TICK : rl->slot_end;
+        want = 0;
+    }
+    if (want) {
+        ap_get_slot(rl, rl->slot_end, &logtime, &start, &end);
+        par = apr_pool_parent_get(rl->pool);
+    }
+
+    APR_ANYLOCK_UNLOCK(&rl->rotate_lock);
+
+    /* Nobody can be writing to the old file any more */
+    if (NULL != opool) {
+        if (NULL != ofd) {
+            ap_finish_log(rl, s, ofd);
+        }
+        apr_pool_destroy(opool);
+    }
+
+    if (!want) {
+        return due;
+    }
+    if (APR_SUCCESS != apr_pool_create(&np, par)) {
+        return now + SERVICE_TICK;
+    }
+
+    if (nfd = ap_open_slot(np, s, rl, logtime, 0), NULL == nfd) {
+        apr_pool_destroy(np);
+        return now + SERVICE_TICK;
+    }
+
+    if (APR_SUCCESS == APR_ANYLOCK_LOCK(&rl->rotate_lock)) {
+        /* Only keep it if the log hasn't moved on while we opened it */
+        if (NULL == rl->next_pool && rl->logtime < logtime) {
+            rl->next_fd      = nfd;
+            rl->next_pool    = np;
+            rl->next_logtime = logtime;
+            np = NULL;
+        }
+        APR_ANYLOCK_UNLOCK(&rl->rotate_lock);
+    }
+
+    if (NULL != np) {
+        ap_close_log(s, nfd);
+        apr_pool_destroy(np);
+    }
+
+    return due;
+}
+
+/* The service thread: drain the queues and do the housekeeping, then sleep
+ * until somebody queues a line or the tick expires.
+ */
+static void * APR_THREAD_FUNC ap_service_thread(apr_thread_t *thd, void *data) {
+    rl_service *sv = data;
+    apr_time_t now, d, due = 0, pushed = 0;
+    int i, n;
+
+#ifdef RL_HAVE_URING
+    if (NULL != uring) {
+        uring->owner = apr_os_thread_current();
+        uring->ready = 1;
+    }
+#endif
+
+    for (;;) {
+        int stop = (0 != apr_atomic_read32(&sv->stop));
+
+        for (i = 0, n = 0; i < rotated_logs->nelts; ++i) {
+            rotated_log *rl = APR_ARRAY_IDX(rotated_logs, i, rotated_log *);
+            if (NULL != rl->ring) {
+                n += ap_drain_log(rl, sv->s);
+            }
+        }
+#ifdef RL_HAVE_URING
+        ap_uring_reap(sv->s);
+#endif
+
+        if (stop) {
+            break;
+        }
+
+        /* Only walk the logs when one of them is due or has been rotated,
+         * not on every wakeup.
+         */
+        now = apr_time_now();
+        if (0 != apr_atomic_xchg32(&sv->poke, 0) || now >= due) {
+            due = SERVICE_NEVER;
+            for (i = 0; i < rotated_logs->nelts; ++i) {
+                rotated_log *rl = APR_ARRAY_IDX(rotated_logs, i, rotated_log *);
+
+                if (d = ap_schedule_log(rl, sv->s, now), d < due) {
+                    due = d;
+                }
+                if (d = ap_expire_log(rl, sv->s, now), d < due) {
+                    due = d;
+                }
+                if (d = ap_maintain_log(rl, sv->s, now), d < due) {
+                    due = d;
+                }
+                if (d = ap_sync_log(rl, sv->s, now), d < due) {
+                    due = d;
+                }
+                if (d = ap_grace_log(rl, sv->s, now), d < due) {
+                    due = d;
+                }
+#ifdef RL_HAVE_WRITEBEHIND
+                if (d = ap_writebehind_log(rl, sv->s, now), d < due) {
+                    due = d;
+                }
+#endif
+                if (d = ap_age_threads(rl, sv->s, now), d < due) {
+                    due = d;
+                }
+            }
+#ifdef RL_HAVE_URING
+            ap_uring_reap(sv->s);
+#endif
+        }
+
+        if (now - pushed >= METRICS_PUSH) {
+            ap_push_metrics();
+            pushed = now;
+        }
+
+        if (0 == n) {
+            apr_thread_mutex_lock(sv->mutex);
+            apr_atomic_xchg32(&sv->sleeping, 1);
+            for (i = 0, n = 0; i < rotated_logs->nelts && 0 == n; ++i) {
+                rotated_log *rl = APR_ARRAY_IDX(rotated_logs, i, rotated_log *);
+                n = (NULL != rl->ring && ap_ring_ready(rl->ring));
+            }
+            if (0 == n && 0 == apr_atomic_read32(&sv->stop)) {
+                apr_thread_cond_timedwait(sv->cond, sv->mutex, SERVICE_TICK);
+            }
+            apr_atomic_xchg32(&sv->sleeping, 0);
+            apr_thread_mutex_unlock(sv->mutex);
+        }
+    }
+
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+/* Stop the service thread when the child exits. The thread drains what is
+ * left in the queues before it goes.
+ */
+static apr_status_t ap_stop_service(void *data) {
+    rl_service *sv = data;
+    apr_status_t rv;
+
+    apr_atomic_xchg32(&sv->stop, 1);
+    ap_service_wake(sv, 1);
+    apr_thread_join(&rv, sv->thread);
+    service = NULL;
+
+    return APR_SUCCESS;
+}
+
+/* Release the line storage of a queue.
+ */
+static apr_status_t ap_ring_cleanup(void *data) {
+    rl_ring *q = data;
+    apr_uint32_t i;
+
+    for (i = 0; i <= q->mask; ++i) {
+        free(q->cells[i].data);
+        q->cells[i].data = NULL;
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Give a log an async queue in the child.
+ */
+static apr_status_t ap_ring_create(apr_pool_t *p, rotated_log *rl) {
+    apr_status_t rv;
+    apr_uint32_t i, n = ASYNC_QUEUE_MIN;
+    rl_ring *q;
+
+    while (n < (apr_uint32_t) rl->st.async_queue) {
+        n <<= 1;
+    }
+
+    q = apr_pcalloc(p, sizeof(rl_ring));
+    q->cells = apr_pcalloc(p, n * sizeof(rl_cell));
+    q->mask  = n - 1;
+    q->pool  = p;
+    q->spill_lock.type = apr_anylock_none;
+    for (i = 0; i < n; ++i) {
+        q->cells[i].seq = i;
+    }
+
+    if (RL_OVERFLOW_SPILL == rl->st.overflow) {
+        if (rv = apr_thread_mutex_create(&q->spill_lock.lock.tm,
+                                         APR_THREAD_MUTEX_DEFAULT, p),
+            APR_SUCCESS != rv) {
+            return rv;
+        }
+        q->spill_lock.type = apr_anylock_threadmutex;
+    }
+
+    /* Without RotateLogsBuffer the batch buffer is written after each drain */
+    if (NULL == rl->buf) {
+        rl->st.buffer_size = ASYNC_BUFFER;
+        rl->buf = apr_palloc(p, rl->st.buffer_size);
+        q->flush = 1;
+    }
+
+    apr_pool_cleanup_register(p, q, ap_ring_cleanup, apr_pool_cleanup_null);
+    rl->ring = q;
+
+    return APR_SUCCESS;
+}
+
+/* Start the service thread if any log in this configuration needs it.
+ */
+static void ap_start_service(apr_pool_t *p, server_rec *s) {
+    apr_status_t rv;
+    rl_service *sv;
+    int i, want = 0;
+
+    if (NULL == rotated_logs) {
+        return;
+    }
+
+    for (i = 0; i < rotated_logs->nelts; ++i) {
+        rotated_log *rl = APR_ARRAY_IDX(rotated_logs, i, rotated_log *);
+        if (RL_DISABLED == rl->st.enabled || !ap_wants_service(&rl->st)) {
+            continue;
+        }
+
+        want = 1;
+        if (rl->st.async) {
+            if (rv = ap_ring_create(p, rl), APR_SUCCESS != rv) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                                "could not create async log queue for %s, "
+                                "writing it inline.", rl->fname);
+            }
+        }
+    }
+
+    if (!want) {
+        return;
+    }
+
+#ifdef RL_HAVE_URING
+    ap_uring_create(p, s);
+#endif
+
+    sv = apr_pcalloc(p, sizeof(rl_service));
+    sv->s = s;
+    if ((rv = apr_thread_mutex_create(&sv->mutex, APR_THREAD_MUTEX_DEFAULT, p)) != APR_SUCCESS ||
+        (rv = apr_thread_cond_create(&sv->cond, p)) != APR_SUCCESS ||
+        (rv = apr_thread_create(&sv->thread, NULL, ap_service_thread, sv, p)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                        "could not start log rotation service thread, "
+                        "writing logs inline.");
+        for (i = 0; i < rotated_logs->nelts; ++i) {
+            APR_ARRAY_IDX(rotated_logs, i, rotated_log *)->ring = NULL;
+        }
+        return;
+    }
+
+    service = sv;
+    apr_pool_cleanup_register(p, sv, ap_stop_service, apr_pool_cleanup_null);
+}
+#endif
+
+/* RotateSample and RotateLinesPerSec: should the line be written? This
+ * comes before anything is copied or written, and takes no lock. Sampling
+ * keeps lines evenly spread at the configured share. The rate limit counts
+ * the lines of each calendar second, a fixed window: rate holds the low
+ * bits of the second in its top byte and the lines taken in it below, so
+ * that moving on to a new second and taking a line in it are one CAS. A
+ * second 256 seconds on looks the same, but only costs a wrong window if
+ * not a single line came in between.
+ */
+static int ap_admit_line(rotated_log *rl, apr_time_t now) {
+    if (rl->st.sample > 0) {
+        apr_uint64_t n = apr_atomic_inc32(&rl->sample_seq);
+
+        /* Kept when n * share passes a whole number */
+        if (((n + 1) * rl->st.sample) >> 32 == (n * rl->st.sample) >> 32) {
+            apr_atomic_inc32(&rl->sampled_out);
+            RL_METRIC(RL_M_SAMPLED, 1);
+            return 0;
+        }
+    }
+
+    if (rl->st.max_lines > 0) {
+        apr_uint32_t sec = ((apr_uint32_t) apr_time_sec(now) & 0xff) << 24;
+        apr_uint32_t cur, next;
+
+        do {
+            cur  = apr_atomic_read32(&rl->rate);
+            next = (cur & ~RATE_LINES) == sec ? cur + 1 : sec | 1;
+            if ((next & RATE_LINES) > rl->st.max_lines) {
+                apr_atomic_inc32(&rl->limited);
+                RL_METRIC(RL_M_LIMITED, 1);
+                return 0;
+            }
+        } while (apr_atomic_cas32(&rl->rate, next, cur) != cur);
+    }
+
+    return 1;
+}
+
+/* RotateGrace: a line from a request that started in the slot before goes
+ * to the file of that slot while it is still open. There are few of them,
+ * so they are written straight to the file under the rotate lock rather
+ * than through the buffers, which hold lines for the current file. Returns
+ * APR_EAGAIN if the line has to go to the current file after all.
+ */
+static apr_status_t ap_late_log(request_rec *r, rotated_log *rl,
+                                const char **strs, int *strl,
+                                int nelts, apr_size_t len) {
+    apr_time_t tm = r->request_time;
+    apr_status_t rv;
+
+    if (rv = APR_ANYLOCK_LOCK(&rl->rotate_lock), APR_SUCCESS != rv) {
+        return APR_EAGAIN;
+    }
+
+    if (NULL == rl->prev_fd || tm < rl->prev_start || tm >= rl->prev_slot_end ||
+        apr_time_now() >= rl->prev_end) {
+        APR_ANYLOCK_UNLOCK(&rl->rotate_lock);
+        return APR_EAGAIN;
+    }
+
+#ifdef RL_HAVE_COMPRESS
+    if (RL_COMPRESS_NONE != rl->st.compress) {
+        char *line = apr_palloc(r->pool, len), *d = line;
+        const char *out;
+        apr_size_t out_len;
+        int i;
+
+        for (i = 0; i < nelts; ++i) {
+            memcpy(d, strs[i], strl[i]);
+            d += strl[i];
+        }
+        if (rv = ap_compress_once(r->pool, &rl->st, line, len, &out, &out_len),
+            APR_SUCCESS == rv) {
+            RL_METRIC(RL_M_WRITES, 1);
+            if (rv = apr_file_write_full(rl->prev_fd, out, out_len, NULL), APR_SUCCESS != rv) {
+                RL_METRIC(RL_M_WRITE_ERRORS, 1);
+            }
+        }
+    } else
+#endif
+    rv = ap_writev_log(rl->prev_fd, NULL, 0, strs, strl, nelts);
+
+    /* Not ap_count_log: its count is of the current file, for RotateMaxSize
+     * and RotateIndex. The lines and bytes are in the metrics already.
+     */
+    APR_ANYLOCK_UNLOCK(&rl->rotate_lock);
+    return rv;
+}
+
+/* Write a log line that is to be written, in whatever way the log is set
+ * up for.
+ */
+static apr_status_t ap_write_line(request_rec *r, rotated_log *rl,
+                                  const char **strs, int *strl,
+                                  int nelts, apr_size_t len) {
+    apr_status_t rv = 0;
+
+    if (NULL != rl->pipe) {
+        return ap_pipe_log(rl, r->server, strs, strl, nelts, len);
+    }
+
+    if (RL_FORMAT_BINARY == rl->st.format) {
+        ap_make_record(r->pool, &strs, &strl, &nelts, &len);
+    }
+
+    if (rl->st.grace > 0 && r->request_time < rl->slot_start &&
+        RL_DISABLED != rl->st.enabled && NULL == rl->map && NULL == rl->dio &&
+        (rv = ap_late_log(r, rl, strs, strl, nelts, len), !APR_STATUS_IS_EAGAIN(rv))) {
+        return rv;
+    }
+
+#if APR_HAS_THREADS
+    if (NULL != rl->ring) {
+        return ap_queue_log(rl, r, strs, strl, nelts, len);
+    }
+#endif
+
+#ifdef RL_HAVE_MMAP
+    if (NULL != rl->map) {
+        return ap_mmap_write(rl, r, strs, strl, nelts, len);
+    }
+#endif
+
+#if APR_HAS_THREADS
+    if (RL_DISABLED != rl->st.enabled && rl->st.thread_buffer) {
+        if (rv = ap_lock_log(rl, r->server, r->request_time), APR_SUCCESS != rv) {
+            return rv;
+        }
+
+        rv = ap_thread_log(rl, r->server, strs, strl, nelts, len);
+        ap_unlock_log(rl);
+        return rv;
+    }
+#endif
+
+    if (RL_DISABLED != rl->st.enabled && NULL != rl->buf) {
+        if (rv = ap_lock_log(rl, r->server, r->request_time), APR_SUCCESS != rv) {
+            return rv;
+        }
+
+        rv = ap_buffer_log(rl, r->server, strs, strl, nelts, len);
+        ap_unlock_log(rl);
+        return rv;
+    }
+
+    if (RL_DISABLED == rl->st.enabled) {
+        return ap_writev_log(rl->fd, NULL, 0, strs, strl, nelts);
+    }
+
+    if (rv = ap_lock_log(rl, r->server, r->request_time), APR_SUCCESS != rv) {
+        return rv;
+    }
+
+    if (rv = ap_writev_log(rl->fd, NULL, 0, strs, strl, nelts), APR_SUCCESS != rv) {
+        ap_unlock_log(rl);
+        return rv;
+    }
+
+    ap_count_log(rl, len);
+    return ap_unlock_log(rl);
+}
+
+/* Every SUMMARY_EVERY seconds the next line written is preceded by a line
+ * saying how many lines were left out since the last one, if any were. It
+ * goes wherever the lines go. A binary log has no record for it, so there
+ * it goes to the error log.
+ */
+static void ap_write_summary(request_rec *r, rotated_log *rl, apr_time_t now) {
+    apr_uint32_t sec = (apr_uint32_t) apr_time_sec(now);
+    apr_uint32_t due = apr_atomic_read32(&rl->summary_sec);
+    apr_uint32_t sampled, limited;
+    const char *str;
+    rl_sink *sk;
+    int strl, i;
+
+    if (sec < due || apr_atomic_cas32(&rl->summary_sec, sec + SUMMARY_EVERY, due) != due) {
+        return;
+    }
+
+    sampled = apr_atomic_xchg32(&rl->sampled_out, 0);
+    limited = apr_atomic_xchg32(&rl->limited, 0);
+    if (0 == sampled && 0 == limited) {
+        return;
+    }
+
+    str  = apr_psprintf(r->pool, "mod_log_rotate summary at %" APR_TIME_T_FMT ": "
+                        "%lu lines left out by RotateSample, "
+                        "%lu over RotateLinesPerSec\n",
+                        apr_time_sec(now), (unsigned long) sampled, (unsigned long) limited);
+    strl = (int) strlen(str);
+
+    /* The sinks and copies get the same lines, so they get the summary too */
+    for (sk = rl->sinks; NULL != sk; sk = sk->next) {
+        ap_sink_log(sk, r->server, &str, &strl, 1, strl);
+    }
+    for (i = 0; NULL != rl->copies && i < rl->copies->nelts; ++i) {
+        rotated_log *copy = APR_ARRAY_IDX(rl->copies, i, rotated_log *);
+
+        if (RL_FORMAT_BINARY != copy->st.format || NULL != copy->pipe) {
+            ap_write_line(r, copy, &str, &strl, 1, strl);
+        }
+    }
+
+    if (RL_FORMAT_BINARY == rl->st.format && NULL == rl->pipe) {
+        ap_log_rerror(APLOG_MARK, APLOG_NOTICE, APR_SUCCESS, r,
+                        "%s: %lu lines left out by RotateSample, "
+                        "%lu over RotateLinesPerSec.",
+                        rl->fname, (unsigned long) sampled, (unsigned long) limited);
+        return;
+    }
+    ap_write_line(r, rl, &str, &strl, 1, strl);
+}
+
+/* Called by mod_log_config to write a log file line.
+ */
+static apr_status_t ap_rotated_log_writer(request_rec *r, void *handle,
+                                          const char **strs, int *strl,
+                                          int nelts, apr_size_t len) {
+    rotated_log *rl = (rotated_log *) handle;
+    rl_sink *sk;
+    int i;
+
+    if (NULL == rl) {
+        ap_log_rerror(APLOG_MARK, APLOG_CRIT, APR_EGENERAL, r,
+            "log rotation information not found.");
+        return APR_EGENERAL;
+    }
+
+    RL_METRIC(RL_M_BYTES, len);
+    if (RL_METRIC(RL_M_LINES, 1) % METRICS_PUSH_LINES == METRICS_PUSH_LINES - 1) {
+        ap_push_metrics();
+    }
+
+    if (rl->st.sample > 0 || rl->st.max_lines > 0) {
+        apr_time_t now = apr_time_now();
+
+        if (!ap_admit_line(rl, now)) {
+            return APR_SUCCESS;
+        }
+        ap_write_summary(r, rl, now);
+    }
+
+    /* RotateSink: the line as formatted once goes everywhere */
+    for (sk = rl->sinks; NULL != sk; sk = sk->next) {
+        ap_sink_log(sk, r->server, strs, strl, nelts, len);
+    }
+    for (i = 0; NULL != rl->copies && i < rl->copies->nelts; ++i) {
+        ap_write_line(r, APR_ARRAY_IDX(rl->copies, i, rotated_log *), strs, strl, nelts, len);
+    }
+
+    return ap_write_line(r, rl, strs, strl, nelts, len);
+}
+
+/* A child has opened the file of a log outside ap_rotate_log: set up the
+ * rest of what a rotation does for a new file.
+ */
+static void ap_log_opened(rotated_log *rl, server_rec *s) {
+    apr_atomic_inc32(&open_logs);
+#ifdef RL_HAVE_MMAP
+    if (NULL != rl->map) {
+        ap_map_log(rl, s);
+    }
+#endif
+#ifdef RL_HAVE_DIRECT
+    if (NULL != rl->dio) {
+        ap_direct_open(rl, s);
+    }
+#endif
+    ap_open_index(rl, s);
+}
+
+/* In a new child: take over the files the parent kept for the logs that are
+ * still in the slot they were opened for, rather than opening each one again
+ * at the first write. Logs opened through the broker get theirs from it.
+ */
+static void ap_adopt_logs(server_rec *s) {
+    rl_registry *reg = ap_registry(s, 0);
+    apr_time_t now = apr_time_now();
+    int i;
+
+    if (NULL == reg || NULL == rotated_logs) {
+        return;
+    }
+
+    for (i = 0; i < rotated_logs->nelts; ++i) {
+        rotated_log *rl = APR_ARRAY_IDX(rotated_logs, i, rotated_log *);
+        rl_kept *k = apr_hash_get(reg->logs, rl->fname, APR_HASH_KEY_STRING);
+
+        if (NULL == k || NULL == k->fd || NULL != rl->fd || rl->st.shared ||
+            rl->st.mmap || RL_CACHE_DIRECT == rl->st.cache_hint ||
+            RL_DISABLED == rl->st.enabled ||
+            k->logtime != rl->logtime || now >= rl->slot_end ||
+            !ap_kept_current(rl->pool, rl, k->fd)) {
+            continue;
+        }
+        if (rl->st.max_open > 0 &&
+            apr_atomic_read32(&open_logs) >= (apr_uint32_t) rl->st.max_open) {
+            continue;
+        }
+        if (APR_SUCCESS != apr_file_dup(&rl->fd, k->fd, rl->pool)) {
+            rl->fd = NULL;
+            continue;
+        }
+        ap_set_size(rl, ap_file_size(rl->fd));
+        ap_log_opened(rl, s);
+    }
+
+    ap_drop_kept(s);
+}
+
+/* Write out what the parent may have buffered before its generation of the
+ * config goes, while the files are still there. The children flush theirs
+ * when they exit.
+ */
+static int child_started = 0;
+
+static apr_status_t ap_flush_generation(void *data) {
+    return child_started ? APR_SUCCESS : ap_flush_all_logs(data);
+}
+
+/* Set up a log with the given options, for a CustomLog or a RotateSink.
+ */
+static rotated_log *ap_make_log(apr_pool_t *p, server_rec *s, const char *name,
+                                const log_options *ls) {
+    apr_status_t rv;
+    int i, keep;
+    rotated_log *rl     = apr_palloc(p, sizeof(rotated_log));
+    rl->pool            = NULL;
+    rl->fname           = NULL;
+    rl->tpl             = NULL;
+    rl->rotate_lock.type = apr_anylock_none;
+    rl->active          = 0;
+    rl->rotating        = 0;
+    rl->written         = 0;
+    rl->used            = 0;
+    rl->last_used       = 0;
+    rl->dirty           = 0;
+    rl->synced          = 0;
+    rl->buf_lock.type   = apr_anylock_none;
+    rl->buf             = NULL;
+    rl->buf_len         = 0;
+    rl->buf_time        = 0;
+    rl->ring            = NULL;
+    rl->zip             = NULL;
+    rl->map             = NULL;
+    rl->dio             = NULL;
+    rl->pipe            = NULL;
+    rl->sinks           = NULL;
+    rl->copies          = NULL;
+    rl->prev_fd         = NULL;
+    rl->prev_pool       = NULL;
+    rl->prev_name       = NULL;
+    rl->prev_start      = 0;
+    rl->prev_slot_end   = 0;
+    rl->prev_end        = GRACE_NONE;
+    rl->tbufs           = NULL;
+    rl->file_name       = NULL;
+    rl->idx_fd          = NULL;
+    rl->idx_due         = 0;
+    rl->idx_mark        = 0;
+    rl->indexing        = 0;
+    rl->sample_seq      = 0;
+    rl->rate            = 0;
+    rl->sampled_out     = 0;
+    rl->limited         = 0;
+    rl->summary_sec     = 0;
+    rl->wb_mark         = 0;
+    rl->wb_prev         = 0;
+#ifdef RL_HAVE_URING
+    rl->ubuf            = NULL;
+    rl->ulen            = 0;
+    rl->upending        = 0;
+    rl->ugen            = 0;
+#endif
+    rl->index           = 0;
+    rl->next_fd         = NULL;
+    rl->next_pool       = NULL;
+    rl->next_logtime    = 0;
+    rl->old_fd          = NULL;
+    rl->old_pool        = NULL;
+    rl->logtime         = 0;
+    rl->slot_start      = 0;
+    rl->slot_end        = 0;
+    rl->seq             = 0;
+    rl->bytes           = 0;
+    rl->conf            = ls;
+    rl->st              = *ls;
+    /* Look at the size of the file on the first write */
+    rl->size_check      = ls->max_size > 0 ? 0 : RL_BYTES_MAX;
+
+    /* We have piped log handling here because once log rotation has been
+     * enabled we become responsible for /all/ transfer log output server
+     * wide. That's a consequence of the way the log output hooks in
      * mod_log_config are implemented. Unfortunately this means we have to
      * duplicate functionality from mod_log_config. Note that we don't
-     * support the buffered logging mode that mlc implements.
+     * support the BufferedLogs mode that mlc implements; RotateLogsBuffer
+     * provides the equivalent, for piped logs too.
      */
     if (*name == '|') {
         piped_log *pl;
 
-        /* Can't rotate a piped log */
-        rl->st.enabled = RL_DISABLED;
-        ap_log_error(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, s,
-                        "disabled log rotation for piped log %s.", name);
+        /* Can't rotate a piped log */
+        rl->st.enabled = RL_DISABLED;
+        ap_log_error(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, s,
+                        "disabled log rotation for piped log %s.", name);
+
+        if (pl = ap_open_piped_log(p, name + 1), NULL == pl) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, APR_EGENERAL, s,
+              "piped log file not loaded.");
+           return NULL;
+        }
+
+        if (rl->fd = ap_piped_log_write_fd(pl), NULL == rl->fd) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, APR_EGENERAL, s,
+              "piped log file handle not loaded.");
+            return NULL;
+        }
+
+        /* Lines are buffered and written without blocking. Without
+         * RotateLogsBuffer each line is written straight away, otherwise
+         * they are held until there is a PIPE_BUF worth or they get old.
+         * O_NONBLOCK is a flag of the pipe that the parent and all the
+         * children share, not of this descriptor, so every process writes
+         * it without blocking from now on. Only this module writes to it,
+         * through ap_pipe_log; if it can't, the flag is taken off again.
+         */
+        if (rv = apr_file_pipe_timeout_set(rl->fd, 0), APR_SUCCESS != rv) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                            "can't make piped log %s non-blocking.", name);
+            return rl;
+        }
+
+        rl->fname = apr_pstrdup(p, name);
+        rl->pipe  = apr_pcalloc(p, sizeof(rl_pipe));
+        rl->pipe->batch = (rl->st.buffer_size > 0);
+        if (0 == rl->st.buffer_size) {
+            rl->st.buffer_size = PIPE_BUFFER;
+        }
+        rl->buf = apr_palloc(p, rl->st.buffer_size);
+
+#if APR_HAS_THREADS
+        {
+            int mpm_threads;
+
+            ap_mpm_query(AP_MPMQ_MAX_THREADS, &mpm_threads);
+            if (mpm_threads > 1) {
+                if (rv = apr_thread_mutex_create(&rl->buf_lock.lock.tm,
+                                                 APR_THREAD_MUTEX_DEFAULT, p),
+                    APR_SUCCESS != rv) {
+                    ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
+                            "could not initialize piped log buffer lock, "
+                            "writing piped log %s directly", name);
+                    rl->pipe = NULL;
+                    rl->buf  = NULL;
+                    rl->st.buffer_size = 0;
+                    apr_file_pipe_timeout_set(rl->fd, -1);
+                    return rl;
+                }
+                rl->buf_lock.type = apr_anylock_threadmutex;
+            }
+        }
+#endif
+
+        if (NULL == piped_logs) {
+            piped_logs = apr_array_make(p, 4, sizeof(rotated_log *));
+            apr_pool_cleanup_register(p, NULL, ap_clear_rotated_logs,
+                                      apr_pool_cleanup_null);
+        }
+        APR_ARRAY_PUSH(piped_logs, rotated_log *) = rl;
+
+        return rl;
+    }
+
+    rl->fname = ap_server_root_relative(p, name);
+    if (NULL == rl->fname) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, APR_EBADPATH, s,
+                        "invalid transfer log path %s.", name);
+        return NULL;
+    }
+
+    /* A file RotateSink that is the log itself would get every line twice */
+    for (i = 0; NULL != ls->sinks && i < ls->sinks->nelts; ++i) {
+        const rl_sink_conf *sc = &APR_ARRAY_IDX(ls->sinks, i, rl_sink_conf);
+        const char *target;
+        rl_compress compress = 'g' == sc->type ? RL_COMPRESS_GZIP :
+                               'z' == sc->type ? RL_COMPRESS_ZSTD : RL_COMPRESS_NONE;
+
+        if ('u' != sc->type && 't' != sc->type && compress == ls->compress &&
+            (target = ap_server_root_relative(p, sc->target), NULL != target) &&
+            !strcmp(target, rl->fname)) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, APR_EINVAL, s,
+                            "RotateSink %s is the transfer log itself.", sc->target);
+            return NULL;
+        }
+    }
+
+    /* Logs of different vhosts going to the same file with the same options
+     * share one rotated log, so each child has one descriptor, one lock and
+     * one buffer for the file instead of competing appenders.
+     */
+    if (NULL != rotated_names) {
+        rotated_log *dup = apr_hash_get(rotated_names, rl->fname, APR_HASH_KEY_STRING);
+
+        if (NULL != dup) {
+            if (ap_same_options(ls, dup->conf)) {
+                return dup;
+            }
+            ap_log_error(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, s,
+                            "transfer log %s is used with different rotation "
+                            "options, it can't be shared.", name);
+        }
+    }
+
+    /* A log that doesn't rotate is written plainly to the file it names,
+     * the way mod_log_config would write it. The options that change the
+     * name, or the way the file is written, only come with rotation.
+     */
+    if (RL_DISABLED == rl->st.enabled) {
+        rl->st.compress   = RL_COMPRESS_NONE;
+        rl->st.mmap       = 0;
+        rl->st.grace      = 0;
+        if (RL_CACHE_DIRECT == rl->st.cache_hint) {
+            rl->st.cache_hint = RL_CACHE_NONE;
+        }
+    }
+
+    /* A mapping replaces the write path, so it can't be combined with
+     * anything that writes the file from a buffer.
+     */
+    if (rl->st.mmap && (rl->st.async || rl->st.buffer_size > 0 ||
+                        RL_COMPRESS_NONE != rl->st.compress)) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, s,
+                        "RotateLogsMmap doesn't work with RotateLogsAsync, "
+                        "RotateLogsBuffer or RotateCompress, not mapping %s.", name);
+        rl->st.mmap = 0;
+    }
+    rl->st.shared &= !rl->st.mmap;
+
+    /* Every write waits for the disk anyway, and the broker's files aren't
+     * opened with O_DSYNC.
+     */
+    if (RL_SYNC_ALWAYS == rl->st.sync) {
+        if (rl->st.mmap) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, s,
+                            "RotateLogsMmap doesn't work with RotateSync always, "
+                            "not mapping %s.", name);
+            rl->st.mmap = 0;
+        }
+        rl->st.shared = 0;
+    }
+
+    /* Compressed logs are always written through the buffer */
+    if (RL_COMPRESS_NONE != rl->st.compress && 0 == rl->st.buffer_size) {
+        rl->st.buffer_size = COMPRESS_BUFFER;
+        rl->st.buffer_age  = COMPRESS_AGE;
+    }
+
+    /* O_DIRECT needs the whole write path to itself, and a buffer of whole
+     * blocks to write from. Write-behind is pointless without the page
+     * cache, and the size of a mapped file isn't what has been written.
+     */
+    if (RL_CACHE_DIRECT == rl->st.cache_hint &&
+        (rl->st.async || rl->st.mmap || RL_COMPRESS_NONE != rl->st.compress)) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, s,
+                        "RotateCacheHint direct doesn't work with RotateLogsAsync, "
+                        "RotateLogsMmap or RotateCompress, not using it for %s.", name);
+        rl->st.cache_hint = RL_CACHE_NONE;
+    }
+    if (RL_CACHE_DIRECT == rl->st.cache_hint) {
+        if (0 == rl->st.buffer_size) {
+            rl->st.buffer_size = DIRECT_BUFFER;
+            rl->st.buffer_age  = DIRECT_AGE;
+        }
+        rl->st.buffer_size = APR_ALIGN(rl->st.buffer_size, DIRECT_ALIGN);
+        if (rl->st.buffer_size < 2 * DIRECT_ALIGN) {
+            rl->st.buffer_size = 2 * DIRECT_ALIGN;
+        }
+        rl->st.shared      = 0;
+        rl->st.writebehind = 0;
+    }
+    if (rl->st.mmap) {
+        rl->st.writebehind = 0;
+    }
+
+#if APR_HAS_THREADS
+    {
+        int mpm_threads;
+
+        /* Locking is needed with more than one request thread or when the
+         * service thread also works on the log.
+         */
+        ap_mpm_query(AP_MPMQ_MAX_THREADS, &mpm_threads);
+
+        /* Per thread buffers only make sense with threads to have them,
+         * and only for plain writes: compressed and O_DIRECT logs need the
+         * one buffer, async logs are written by one thread anyway.
+         */
+        rl->st.thread_buffer &= (mpm_threads > 1 && rl->st.buffer_size > 0 &&
+                                 !rl->st.async && RL_COMPRESS_NONE == rl->st.compress &&
+                                 RL_CACHE_DIRECT != rl->st.cache_hint);
+
+        if (mpm_threads > 1 || ap_wants_service(&rl->st)) {
+            if (rv = apr_thread_mutex_create(&rl->rotate_lock.lock.tm,
+                                             APR_THREAD_MUTEX_DEFAULT, p),
+                APR_SUCCESS != rv) {
+                ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
+                        "could not initialize log rotation lock, "
+                        "transfer log may become corrupted");
+            } else {
+                rl->rotate_lock.type = apr_anylock_threadmutex;
+            }
+
+            if (rl->st.buffer_size > 0 && !rl->st.thread_buffer) {
+                if (rv = apr_thread_mutex_create(&rl->buf_lock.lock.tm,
+                                                 APR_THREAD_MUTEX_DEFAULT, p),
+                    APR_SUCCESS != rv) {
+                    ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
+                            "could not initialize log buffer lock, "
+                            "log buffering, compression and O_DIRECT disabled");
+                    /* Both write through the buffer only */
+                    rl->st.buffer_size = 0;
+                    rl->st.compress    = RL_COMPRESS_NONE;
+                    if (RL_CACHE_DIRECT == rl->st.cache_hint) {
+                        rl->st.cache_hint = RL_CACHE_NONE;
+                    }
+                } else {
+                    rl->buf_lock.type = apr_anylock_threadmutex;
+                }
+            }
+        }
+    }
+#endif
+
+#ifdef RL_HAVE_DIRECT
+    if (RL_CACHE_DIRECT == rl->st.cache_hint) {
+        /* O_DIRECT wants the buffer aligned as well */
+        char *b = apr_palloc(p, rl->st.buffer_size + DIRECT_ALIGN);
+
+        rl->buf = (char *) APR_ALIGN((apr_uintptr_t) b, DIRECT_ALIGN);
+        rl->dio = apr_pcalloc(p, sizeof(rl_direct));
+    } else
+#endif
+    if (rl->st.buffer_size > 0 && !rl->st.thread_buffer) {
+        rl->buf = apr_palloc(p, rl->st.buffer_size);
+    }
+
+#ifdef RL_HAVE_MMAP
+    if (rl->st.mmap && RL_DISABLED != rl->st.enabled) {
+        rl->map = apr_pcalloc(p, sizeof(rl_map));
+    }
+#endif
+
+#ifdef RL_HAVE_COMPRESS
+    if (RL_COMPRESS_NONE != rl->st.compress) {
+        if (rv = ap_compressor_create(p, rl), APR_SUCCESS != rv) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                            "can't set up compression for %s.", name);
+            return NULL;
+        }
+    }
+#endif
+
+    ap_set_slot(rl, apr_time_now());
+
+    if (RL_DISABLED != rl->st.enabled && strchr(name, '%') != NULL) {
+        rl->st.enabled = RL_SUBSTITUTIONS;
+    }
+
+    /* Catch a bad file name now rather than at the first rotation */
+    if (RL_SUBSTITUTIONS == rl->st.enabled) {
+        const char *err;
+
+        if (err = ap_compile_template(p, rl->fname, &rl->tpl), NULL != err) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, APR_EINVAL, s,
+                            "invalid transfer log name %s: %s.", name, err);
+            return NULL;
+        }
+    }
+
+    if (rv = apr_pool_create(&rl->pool, p), APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "can't make log rotation pool.");
+        return NULL;
+    }
+
+    /* The parent doesn't hold the file of a rotated log itself, but keeps it
+     * open across graceful restarts for the children to take over. A log of
+     * a vhost that doesn't rotate is opened once and inherited, the way
+     * mod_log_config does it. Mapped and O_DIRECT logs are neither: each
+     * child has a file of its own, named after it, and the parent's would
+     * only be an empty file named after the parent.
+     */
+    keep = NULL == getenv("AP_PARENT_PID") && RL_DISABLED != rl->st.enabled;
+    if (keep && (rl->st.mmap || RL_CACHE_DIRECT == rl->st.cache_hint)) {
+        rl->fd = NULL;
+    } else if (keep) {
+        rl->fd = NULL;
+        if (!ap_keep_log(s, rl)) {
+            return NULL;
+        }
+    } else if (rl->fd = ap_open_log(rl->pool, s, rl, rl->logtime, 0), NULL == rl->fd) {
+        return NULL;
+    }
+
+#ifdef RL_HAVE_ONCLOSE
+    if (rl->st.on_close_len > 0) {
+        rl->file_name = apr_palloc(p, PIPE_CHUNK);
+        apr_cpystrn(rl->file_name, ap_log_name(p, rl, rl->logtime, 0), PIPE_CHUNK);
+    }
+#endif
+
+    if (NULL == rotated_logs) {
+        rotated_logs  = apr_array_make(p, 16, sizeof(rotated_log *));
+        rotated_names = apr_hash_make(p);
+        apr_pool_cleanup_register(p, NULL, ap_clear_rotated_logs,
+                                  apr_pool_cleanup_null);
+        apr_pool_pre_cleanup_register(p, s, ap_flush_generation);
+    }
+    rl->index = rotated_logs->nelts;
+    APR_ARRAY_PUSH(rotated_logs, rotated_log *) = rl;
+    if (NULL == apr_hash_get(rotated_names, rl->fname, APR_HASH_KEY_STRING)) {
+        apr_hash_set(rotated_names, rl->fname, APR_HASH_KEY_STRING, rl);
+    }
+
+    /* A child that opened the file itself sets up the rest of it now. The
+     * children of the parent take the file over in child_init or open it
+     * on their first write.
+     */
+    if (!keep && RL_DISABLED != rl->st.enabled) {
+        ap_log_opened(rl, s);
+    }
+
+    /* RotateSink: the network sinks and the other files to write to. The
+     * files are logs of their own with the options of this one.
+     */
+    for (i = 0; NULL != ls->sinks && i < ls->sinks->nelts; ++i) {
+        const rl_sink_conf *sc = &APR_ARRAY_IDX(ls->sinks, i, rl_sink_conf);
+        log_options *cs;
+        rotated_log *copy;
+
+        if ('u' == sc->type || 't' == sc->type) {
+            ap_make_sink(p, s, rl, sc);
+            continue;
+        }
+
+        cs = apr_pmemdup(p, ls, sizeof(log_options));
+        cs->sinks          = NULL;
+        cs->compress       = 'g' == sc->type ? RL_COMPRESS_GZIP :
+                             'z' == sc->type ? RL_COMPRESS_ZSTD : RL_COMPRESS_NONE;
+        cs->compress_level = -1;
+        if (copy = ap_make_log(p, s, sc->target, cs), NULL == copy) {
+            continue;
+        }
+        if (NULL == rl->copies) {
+            rl->copies = apr_array_make(p, 2, sizeof(rotated_log *));
+        }
+        APR_ARRAY_PUSH(rl->copies, rotated_log *) = copy;
+    }
+
+    return rl;
+}
+
+/* Called my mod_log_config to initialise a log writer.
+ */
+static void *ap_rotated_log_writer_init(apr_pool_t *p, server_rec *s, const char* name) {
+    return ap_make_log(p, s, name, ap_get_module_config(s->module_config, &log_rotate_module));
+}
+
+static const char *set_rotated_logs(cmd_parms *cmd, void *dummy, int flag) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    RL_SET(ls, RL_SET_ENABLED);
+    ls->enabled = flag ? RL_ENABLED : RL_DISABLED;
+    return NULL;
+}
+
+static const char *set_localtime(cmd_parms *cmd, void *dummy, int flag) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    RL_SET(ls, RL_SET_LOCALT);
+    ls->localt = flag;
+    return NULL;
+}
+
+static const char *set_interval(cmd_parms *cmd, void *dummy,
+                                const char *inte, const char *offs) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    if (NULL != inte) {
+        /* Interval in seconds */
+        ls->interval = APR_USEC_PER_SEC * (apr_time_t) atol(inte);
+        if (ls->interval < INTERVAL_MIN) {
+            ls->interval = INTERVAL_MIN;
+        }
+        RL_SET(ls, RL_SET_INTERVAL);
+    }
+
+    if (NULL != offs) {
+        /* Offset in minutes */
+        ls->offset = APR_USEC_PER_SEC * 60 * (apr_time_t) atol(offs);
+        RL_SET(ls, RL_SET_OFFSET);
+    }
+
+    return NULL;
+}
+
+static const char *set_buffer(cmd_parms *cmd, void *dummy,
+                              const char *size, const char *age) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    long sz = atol(size);
+
+    RL_SET(ls, RL_SET_BUFFER);
+    if (sz < 0) {
+        return "RotateLogsBuffer size must not be negative";
+    }
+    /* Buffer size in bytes */
+    ls->buffer_size = (apr_size_t) sz;
+
+    if (NULL != age) {
+        /* Maximum age in milliseconds */
+        ls->buffer_age = 1000 * (apr_time_t) atol(age);
+        if (ls->buffer_age < 0) {
+            ls->buffer_age = 0;
+        }
+        RL_SET(ls, RL_SET_BUFFER_AGE);
+    }
+
+    return NULL;
+}
+
+static const char *set_async(cmd_parms *cmd, void *dummy, int flag) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    RL_SET(ls, RL_SET_ASYNC);
+#if APR_HAS_THREADS
+    ls->async = flag;
+    return NULL;
+#else
+    return flag ? "RotateLogsAsync requires thread support in APR" : NULL;
+#endif
+}
+
+static const char *set_async_queue(cmd_parms *cmd, void *dummy, const char *arg) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    RL_SET(ls, RL_SET_ASYNC_QUEUE);
+    ls->async_queue = atoi(arg);
+    if (ls->async_queue < ASYNC_QUEUE_MIN) {
+        ls->async_queue = ASYNC_QUEUE_MIN;
+    }
+    return NULL;
+}
+
+static const char *set_async_overflow(cmd_parms *cmd, void *dummy,
+                                      const char *policy, const char *file) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    RL_SET(ls, RL_SET_OVERFLOW);
 
-        if (pl = ap_open_piped_log(p, name + 1), NULL == pl) {
-            ap_log_error(APLOG_MARK, APLOG_CRIT, APR_EGENERAL, s,
-              "piped log file not loaded.");
-           return NULL;
+    if (!strcasecmp(policy, "block")) {
+        ls->overflow = RL_OVERFLOW_BLOCK;
+    } else if (!strcasecmp(policy, "drop")) {
+        ls->overflow = RL_OVERFLOW_DROP;
+    } else if (!strcasecmp(policy, "spill")) {
+        if (NULL == file) {
+            return "RotateAsyncOverflow spill requires a file name";
+        }
+        if (ls->spill = ap_server_root_relative(cmd->pool, file), NULL == ls->spill) {
+            return apr_pstrcat(cmd->pool, "Invalid RotateAsyncOverflow spill file ",
+                               file, NULL);
         }
+        ls->overflow = RL_OVERFLOW_SPILL;
+        return NULL;
+    } else {
+        return "RotateAsyncOverflow must be block, drop or spill";
+    }
 
-        if (rl->fd = ap_piped_log_write_fd(pl), NULL == rl->fd) {
-            ap_log_error(APLOG_MARK, APLOG_CRIT, APR_EGENERAL, s,
-              "piped log file handle not loaded.");
-            return NULL;
+    return file ? "Only RotateAsyncOverflow spill takes a file name" : NULL;
+}
+
+static const char *set_preopen(cmd_parms *cmd, void *dummy, const char *arg) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    RL_SET(ls, RL_SET_PREOPEN);
+#if APR_HAS_THREADS
+    /* Seconds before the end of the slot */
+    ls->preopen = APR_USEC_PER_SEC * (apr_time_t) atol(arg);
+    if (ls->preopen < 0) {
+        ls->preopen = 0;
+    }
+    return NULL;
+#else
+    return "RotatePreopen requires thread support in APR";
+#endif
+}
+
+static const char *set_compress(cmd_parms *cmd, void *dummy,
+                                const char *type, const char *level) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    RL_SET(ls, RL_SET_COMPRESS);
+
+    if (!strcasecmp(type, "none")) {
+        ls->compress = RL_COMPRESS_NONE;
+    } else if (!strcasecmp(type, "gzip")) {
+#ifdef HAVE_ZLIB
+        ls->compress = RL_COMPRESS_GZIP;
+#else
+        return "RotateCompress gzip needs mod_log_rotate built with HAVE_ZLIB";
+#endif
+    } else if (!strcasecmp(type, "zstd")) {
+#ifdef HAVE_ZSTD
+        ls->compress = RL_COMPRESS_ZSTD;
+#else
+        return "RotateCompress zstd needs mod_log_rotate built with HAVE_ZSTD";
+#endif
+    } else {
+        return "RotateCompress must be none, gzip or zstd";
+    }
+
+    ls->compress_level = -1;
+    if (NULL != level) {
+        ls->compress_level = atoi(level);
+        if (ls->compress_level < 0) {
+            return "RotateCompress level must not be negative";
+        }
+#ifdef HAVE_ZLIB
+        if (RL_COMPRESS_GZIP == ls->compress && ls->compress_level > Z_BEST_COMPRESSION) {
+            return "RotateCompress gzip level must be from 0 to 9";
+        }
+#endif
+#ifdef HAVE_ZSTD
+        if (RL_COMPRESS_ZSTD == ls->compress && ls->compress_level > ZSTD_maxCLevel()) {
+            return apr_psprintf(cmd->pool, "RotateCompress zstd level must be from 0 to %d",
+                                ZSTD_maxCLevel());
         }
+#endif
+    }
 
-        return rl;
+    return NULL;
+}
+
+static const char *set_max_size(cmd_parms *cmd, void *dummy, const char *arg) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    char *end;
+
+    RL_SET(ls, RL_SET_MAX_SIZE);
+    /* Size in bytes, 0 for no limit */
+    ls->max_size = (apr_off_t) apr_strtoi64(arg, &end, 10);
+    if (*end || ls->max_size < 0) {
+        return "RotateMaxSize must be a size in bytes";
+    }
+    if ((apr_uint64_t) ls->max_size > (apr_uint64_t) RL_BYTES_MAX) {
+        return "RotateMaxSize above 4GB needs APR 1.7 or later";
     }
 
-#if APR_HAS_THREADS
-    {
-        int mpm_threads;
+    return NULL;
+}
 
-        ap_mpm_query(AP_MPMQ_MAX_THREADS, &mpm_threads);
-        if (mpm_threads > 1) {
-            if (rv = apr_thread_rwlock_create(&rl->write_lock.lock.rw, p), APR_SUCCESS != rv) {
-                ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
-                        "could not initialize log rotation write lock, "
-                        "transfer log may become corrupted");
-            } else {
-                rl->write_lock.type = apr_anylock_writelock;
-                rl->read_lock.type = apr_anylock_readlock;
-                rl->read_lock.lock.rw = rl->write_lock.lock.rw;
-            }
+static const char *set_scheduler(cmd_parms *cmd, void *dummy,
+                                 const char *flag, const char *jitter) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    RL_SET(ls, RL_SET_SCHEDULE);
+
+    if (!strcasecmp(flag, "off")) {
+        ls->schedule = 0;
+        return jitter ? "RotateScheduler Off takes no jitter" : NULL;
+    }
+    if (strcasecmp(flag, "on")) {
+        return "RotateScheduler must be On or Off";
+    }
+#if APR_HAS_THREADS
+    ls->schedule = 1;
+    if (NULL != jitter) {
+        /* Jitter in milliseconds */
+        ls->jitter = 1000 * (apr_time_t) atol(jitter);
+        if (ls->jitter < 0) {
+            ls->jitter = 0;
         }
+        RL_SET(ls, RL_SET_JITTER);
     }
+    return NULL;
+#else
+    return "RotateScheduler requires thread support in APR";
 #endif
+}
 
-    rl->logtime = ap_get_quantized_time(rl, apr_time_now());
+static const char *set_idle_close(cmd_parms *cmd, void *dummy, const char *arg) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    RL_SET(ls, RL_SET_IDLE_CLOSE);
+#if APR_HAS_THREADS
+    /* Idle time in seconds, 0 keeps files open */
+    ls->idle_close = APR_USEC_PER_SEC * (apr_time_t) atol(arg);
+    if (ls->idle_close < 0) {
+        ls->idle_close = 0;
+    }
+    return NULL;
+#else
+    return "RotateIdleClose requires thread support in APR";
+#endif
+}
 
-    if (strchr(name, '%') != NULL) {
-        rl->st.enabled = RL_SUBSTITUTIONS;
+static const char *set_max_open(cmd_parms *cmd, void *dummy, const char *arg) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    RL_SET(ls, RL_SET_MAX_OPEN);
+#if APR_HAS_THREADS
+    if (ls->max_open = atoi(arg), ls->max_open < 0) {
+        return "RotateMaxOpen must not be negative";
     }
+    return NULL;
+#else
+    return "RotateMaxOpen requires thread support in APR";
+#endif
+}
 
-    rl->fname = ap_server_root_relative(p, name);
-    if (NULL == rl->fname) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, APR_EBADPATH, s,
-                        "invalid transfer log path %s.", name);
+static const char *set_mmap(cmd_parms *cmd, void *dummy, int flag) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    RL_SET(ls, RL_SET_MMAP);
+#ifdef RL_HAVE_MMAP
+    ls->mmap = flag;
+    return NULL;
+#else
+    return flag ? "RotateLogsMmap is not supported on this platform" : NULL;
+#endif
+}
+
+static const char *set_sync(cmd_parms *cmd, void *dummy,
+                            const char *mode, const char *ms) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    RL_SET(ls, RL_SET_SYNC);
+
+    if (!strcasecmp(mode, "interval")) {
+#if APR_HAS_THREADS
+        /* Interval in milliseconds */
+        ls->sync_interval = NULL != ms ? 1000 * (apr_time_t) atol(ms) : 0;
+        if (ls->sync_interval <= 0) {
+            return "RotateSync interval needs a time in milliseconds";
+        }
+        ls->sync = RL_SYNC_INTERVAL;
         return NULL;
+#else
+        return "RotateSync interval requires thread support in APR";
+#endif
     }
 
-    if (rv = apr_pool_create(&rl->pool, p), APR_SUCCESS != rv) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "can't make log rotation pool.");
+    if (NULL != ms) {
+        return "Only RotateSync interval takes a time";
+    }
+    if (!strcasecmp(mode, "none")) {
+        ls->sync = RL_SYNC_NONE;
+    } else if (!strcasecmp(mode, "rotate")) {
+        ls->sync = RL_SYNC_ROTATE;
+    } else if (!strcasecmp(mode, "always")) {
+#ifdef RL_HAVE_DSYNC
+        ls->sync = RL_SYNC_ALWAYS;
+#else
+        return "RotateSync always is not supported on this platform";
+#endif
+    } else {
+        return "RotateSync must be none, rotate, interval or always";
+    }
+
+    return NULL;
+}
+
+static const char *set_cache_hint(cmd_parms *cmd, void *dummy,
+                                  const char *mode, const char *mb) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    RL_SET(ls, RL_SET_CACHE_HINT);
+
+    ls->writebehind = 0;
+    if (!strcasecmp(mode, "dontneed")) {
+#if defined(POSIX_FADV_DONTNEED) && !defined(WIN32)
+        ls->cache_hint = RL_CACHE_DONTNEED;
+#else
+        return "RotateCacheHint dontneed is not supported on this platform";
+#endif
+        if (NULL != mb) {
+#ifdef RL_HAVE_WRITEBEHIND
+            /* Write-behind stretch in megabytes */
+            ls->writebehind = (apr_off_t) atol(mb) * 1024 * 1024;
+            if (ls->writebehind <= 0) {
+                return "RotateCacheHint dontneed takes a size in megabytes";
+            }
+#else
+            return "RotateCacheHint write-behind is not supported on this platform";
+#endif
+        }
         return NULL;
     }
 
-    if (rl->fd = ap_open_log(rl->pool, s, rl->fname, &rl->st, rl->logtime), NULL == rl->fd) {
+    if (NULL != mb) {
+        return "Only RotateCacheHint dontneed takes a size";
+    }
+    if (!strcasecmp(mode, "none")) {
+        ls->cache_hint = RL_CACHE_NONE;
+    } else if (!strcasecmp(mode, "direct")) {
+#ifdef RL_HAVE_DIRECT
+        ls->cache_hint = RL_CACHE_DIRECT;
+#else
+        return "RotateCacheHint direct is not supported on this platform";
+#endif
+    } else {
+        return "RotateCacheHint must be none, dontneed or direct";
+    }
+
+    return NULL;
+}
+
+static const char *set_thread_buffer(cmd_parms *cmd, void *dummy, int flag) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    RL_SET(ls, RL_SET_THREAD_BUFFER);
+#if APR_HAS_THREADS
+    ls->thread_buffer = flag;
+    return NULL;
+#else
+    return flag ? "RotateThreadBuffer requires thread support in APR" : NULL;
+#endif
+}
+
+static const char *set_on_close(cmd_parms *cmd, void *dummy,
+                                const char *action, const char *arg) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+#ifdef RL_HAVE_ONCLOSE
+    char type, *acts;
+    apr_size_t len;
+
+    RL_SET(ls, RL_SET_ON_CLOSE);
+    if (!strcasecmp(action, "none")) {
+        ls->on_close     = NULL;
+        ls->on_close_len = 0;
         return NULL;
+    } else if (!strcasecmp(action, "rename")) {
+        type = 'r';
+    } else if (!strcasecmp(action, "link")) {
+        type = 'l';
+    } else if (!strcasecmp(action, "compress")) {
+        type = 'c';
+    } else if (!strcasecmp(action, "exec")) {
+        type = 'x';
+    } else {
+        return "RotateOnClose must be none, rename, link, compress or exec";
     }
 
-    /* If we are the parent */
-    if (NULL == getenv("AP_PARENT_PID")) {
-        /* Close the file so we don't hold the handle for forever */
-        ap_close_log(s, rl->fd);
-        /* If we ever need to log, it will be re-opened on the first write */
-        rl->fd = NULL;
+    if ('c' == type) {
+#ifdef HAVE_ZLIB
+        if (NULL != arg) {
+            return "RotateOnClose compress takes no argument";
+        }
+        arg = "";
+#else
+        return "RotateOnClose compress requires zlib";
+#endif
+    } else if (NULL == arg) {
+        return "RotateOnClose rename, link and exec need an argument";
+    } else if (arg = ap_server_root_relative(cmd->pool, arg), NULL == arg) {
+        return "Invalid RotateOnClose path";
     }
 
-    return rl;
+    /* Actions are kept in the form the helper gets them in */
+    len  = ls->on_close_len + 1 + strlen(arg) + 1;
+    acts = apr_palloc(cmd->pool, len);
+    if (ls->on_close_len > 0) {
+        memcpy(acts, ls->on_close, ls->on_close_len);
+    }
+    acts[ls->on_close_len] = type;
+    strcpy(acts + ls->on_close_len + 1, arg);
+    ls->on_close     = acts;
+    ls->on_close_len = len;
+    return NULL;
+#else
+    return "RotateOnClose is not supported on this platform";
+#endif
 }
 
-static const char *set_rotated_logs(cmd_parms *cmd, void *dummy, int flag) {
+static const char *set_on_close_delay(cmd_parms *cmd, void *dummy, const char *arg) {
     log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
-    ls->enabled = flag ? RL_ENABLED : RL_DISABLED;
+    long secs = atol(arg);
+
+    RL_SET(ls, RL_SET_ON_CLOSE_DELAY);
+    if (secs < 0) {
+        return "RotateOnCloseDelay must not be negative";
+    }
+    ls->on_close_delay = apr_time_from_sec(secs);
     return NULL;
 }
 
-static const char *set_localtime(cmd_parms *cmd, void *dummy, int flag) {
+static const char *set_format(cmd_parms *cmd, void *dummy, const char *arg) {
     log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
-    ls->localt = flag;
+    RL_SET(ls, RL_SET_FORMAT);
+
+    if (!strcasecmp(arg, "text")) {
+        ls->format = RL_FORMAT_TEXT;
+    } else if (!strcasecmp(arg, "binary")) {
+        ls->format = RL_FORMAT_BINARY;
+    } else {
+        return "RotateFormat must be text or binary";
+    }
     return NULL;
 }
 
-static const char *set_interval(cmd_parms *cmd, void *dummy,
-                                const char *inte, const char *offs) {
+static const char *set_index(cmd_parms *cmd, void *dummy,
+                             const char *secs, const char *bytes) {
     log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
-    if (NULL != inte) {
-        /* Interval in seconds */
-        ls->interval = APR_USEC_PER_SEC * (apr_time_t) atol(inte);
-        if (ls->interval < INTERVAL_MIN) {
-            ls->interval = INTERVAL_MIN;
+    long every = atol(secs);
+
+    RL_SET(ls, RL_SET_INDEX);
+    if (every < 0) {
+        return "RotateIndex interval must not be negative";
+    }
+    ls->index_every = apr_time_from_sec(every);
+
+    ls->index_bytes = 0;
+    if (NULL != bytes) {
+        char *end;
+
+        ls->index_bytes = (apr_off_t) apr_strtoi64(bytes, &end, 10);
+        if (*end || ls->index_bytes < 0) {
+            return "RotateIndex size must be a size in bytes";
         }
     }
+    return NULL;
+}
 
-    if (NULL != offs) {
-        /* Offset in minutes */
-        ls->offset = APR_USEC_PER_SEC * 60 * (apr_time_t) atol(offs);
+static const char *set_sample(cmd_parms *cmd, void *dummy, const char *arg) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    double rate = atof(arg);
+
+    RL_SET(ls, RL_SET_SAMPLE);
+    if (rate <= 0 || rate > 1) {
+        return "RotateSample must be a share of the lines above 0 and up to 1";
+    }
+    /* All lines when the share can't be told from 1 */
+    ls->sample = rate * 4294967296.0 >= 4294967295.0
+               ? 0 : (apr_uint32_t) (rate * 4294967296.0);
+    return NULL;
+}
+
+static const char *set_max_lines(cmd_parms *cmd, void *dummy, const char *arg) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    long n = atol(arg);
+
+    RL_SET(ls, RL_SET_MAX_LINES);
+    if (n < 0 || n > RATE_LINES) {
+        return apr_psprintf(cmd->pool, "RotateLinesPerSec must be between 0 and %lu",
+                            (unsigned long) RATE_LINES);
+    }
+    ls->max_lines = (apr_uint32_t) n;
+    return NULL;
+}
+
+static const char *set_sink(cmd_parms *cmd, void *dummy,
+                            const char *dest, const char *batch) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    rl_sink_conf *sc;
+    const char *target;
+    long n = 0;
+    char type;
+
+    RL_SET(ls, RL_SET_SINKS);
+    if (!strncasecmp(dest, "udp://", 6)) {
+        type = 'u', target = dest + 6;
+    } else if (!strncasecmp(dest, "tcp://", 6)) {
+        type = 't', target = dest + 6;
+    } else if (!strncasecmp(dest, "file:", 5)) {
+        type = 'f', target = dest + 5;
+    } else if (!strncasecmp(dest, "gzip:", 5)) {
+#ifdef HAVE_ZLIB
+        type = 'g', target = dest + 5;
+#else
+        return "RotateSink gzip needs mod_log_rotate built with HAVE_ZLIB";
+#endif
+    } else if (!strncasecmp(dest, "zstd:", 5)) {
+#ifdef HAVE_ZSTD
+        type = 'z', target = dest + 5;
+#else
+        return "RotateSink zstd needs mod_log_rotate built with HAVE_ZSTD";
+#endif
+    } else {
+        return "RotateSink must be udp://host:port, tcp://host:port or "
+               "file:, gzip: or zstd: and a file name";
     }
 
+    if ('u' == type || 't' == type) {
+        char *host, *scope;
+        apr_port_t port;
+
+        if (APR_SUCCESS != apr_parse_addr_port(&host, &scope, &port, target, cmd->pool) ||
+            NULL == host || 0 == port) {
+            return "RotateSink needs a host and a port to send to";
+        }
+        if (NULL != batch) {
+            /* Batch size in bytes */
+            n = atol(batch);
+            if (n < 0 || ('u' == type && n > SINK_DATAGRAM_MAX)) {
+                return "RotateSink batch size must be from 0 up to 65507 bytes for udp";
+            }
+        }
+    } else if (NULL != batch) {
+        return "Only udp and tcp RotateSinks take a batch size";
+    } else if ('\0' == *target) {
+        return "RotateSink needs a file name";
+    }
+
+    /* A vhost's sinks are its own, not added to the main server's */
+    if (NULL == ls->sinks) {
+        ls->sinks = apr_array_make(cmd->pool, 2, sizeof(rl_sink_conf));
+    }
+    sc = apr_array_push(ls->sinks);
+    sc->type   = type;
+    sc->target = apr_pstrdup(cmd->pool, target);
+    sc->batch  = (apr_size_t) n;
+    return NULL;
+}
+
+static const char *set_grace(cmd_parms *cmd, void *dummy, const char *arg) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    RL_SET(ls, RL_SET_GRACE);
+    /* Grace in seconds, 0 closes the file at once */
+    ls->grace = APR_USEC_PER_SEC * (apr_time_t) atol(arg);
+    if (ls->grace < 0) {
+        ls->grace = 0;
+    }
+    return NULL;
+}
+
+static const char *set_shared(cmd_parms *cmd, void *dummy, int flag) {
+    log_options *ls = ap_get_module_config(cmd->server->module_config, &log_rotate_module);
+    RL_SET(ls, RL_SET_SHARED);
+#ifdef RL_HAVE_BROKER
+    ls->shared = flag;
     return NULL;
+#else
+    return flag ? "RotateLogsShared is not supported on this platform" : NULL;
+#endif
 }
 
 static const command_rec rotate_log_cmds[] = {
@@ -425,6 +6869,63 @@ static const command_rec rotate_log_cmds[] = {
     AP_INIT_TAKE12("RotateInterval", set_interval, NULL, RSRC_CONF,
                    "Set rotation interval in seconds with"
                    " optional offset in minutes"),
+    AP_INIT_TAKE12("RotateLogsBuffer", set_buffer, NULL, RSRC_CONF,
+                   "Set log buffer size in bytes with"
+                   " optional maximum age in milliseconds"),
+    AP_INIT_FLAG(  "RotateLogsAsync", set_async, NULL, RSRC_CONF,
+                   "Write logs from a separate thread"),
+    AP_INIT_TAKE1( "RotateAsyncQueue", set_async_queue, NULL, RSRC_CONF,
+                   "Set the number of entries in the async log queue"),
+    AP_INIT_TAKE12("RotateAsyncOverflow", set_async_overflow, NULL, RSRC_CONF,
+                   "Set what happens when the async log queue is full:"
+                   " block, drop or spill followed by a file name"),
+    AP_INIT_FLAG(  "RotateLogsShared", set_shared, NULL, RSRC_CONF,
+                   "Open rotated logs once for all child processes"),
+    AP_INIT_TAKE1( "RotatePreopen", set_preopen, NULL, RSRC_CONF,
+                   "Open the next log file this many seconds before rollover"),
+    AP_INIT_TAKE12("RotateCompress", set_compress, NULL, RSRC_CONF,
+                   "Compress log files with none, gzip or zstd and"
+                   " optional compression level"),
+    AP_INIT_TAKE1( "RotateMaxSize", set_max_size, NULL, RSRC_CONF,
+                   "Start a new log file within the interval past this many bytes"),
+    AP_INIT_TAKE12("RotateScheduler", set_scheduler, NULL, RSRC_CONF,
+                   "Rotate all logs from a background thread, On or Off with"
+                   " optional jitter in milliseconds"),
+    AP_INIT_TAKE1( "RotateIdleClose", set_idle_close, NULL, RSRC_CONF,
+                   "Close log files nobody has written to for this many seconds"),
+    AP_INIT_TAKE1( "RotateMaxOpen", set_max_open, NULL, RSRC_CONF,
+                   "Set the most rotated log files a child keeps open"),
+    AP_INIT_FLAG(  "RotateLogsMmap", set_mmap, NULL, RSRC_CONF,
+                   "Write logs through a memory mapping of the file"),
+    AP_INIT_TAKE12("RotateSync", set_sync, NULL, RSRC_CONF,
+                   "Set when log data is synced to disk: none, rotate, "
+                   "interval <ms> or always"),
+    AP_INIT_TAKE12("RotateCacheHint", set_cache_hint, NULL, RSRC_CONF,
+                   "Set how log files use the page cache: none, "
+                   "dontneed [MB] or direct"),
+    AP_INIT_FLAG(  "RotateThreadBuffer", set_thread_buffer, NULL, RSRC_CONF,
+                   "Give each request thread its own log buffer"),
+    AP_INIT_TAKE12("RotateOnClose", set_on_close, NULL, RSRC_CONF,
+                   "Add an action for rotated out log files: rename <dir>, "
+                   "link <dir>, compress, exec <program> or none"),
+    AP_INIT_TAKE1( "RotateOnCloseDelay", set_on_close_delay, NULL, RSRC_CONF,
+                   "Seconds to wait for the other children before RotateOnClose"),
+    AP_INIT_TAKE1( "RotateFormat", set_format, NULL, RSRC_CONF,
+                   "Write log lines as text or as binary records"),
+    AP_INIT_TAKE12("RotateIndex", set_index, NULL, RSRC_CONF,
+                   "Keep a time index of each log file with an entry every so"
+                   " many seconds and optionally every so many bytes"),
+    AP_INIT_TAKE1( "RotateSample", set_sample, NULL, RSRC_CONF,
+                   "Write only this share of the log lines, e.g. 0.1"),
+    AP_INIT_TAKE1( "RotateLinesPerSec", set_max_lines, NULL, RSRC_CONF,
+                   "Write at most this many log lines a second"),
+    AP_INIT_TAKE12("RotateSink", set_sink, NULL, RSRC_CONF,
+                   "Also send log lines to udp://host:port or tcp://host:port"
+                   " with optional batch size, or write them to file:, gzip: or"
+                   " zstd: and a file name"),
+    AP_INIT_TAKE1( "RotateGrace", set_grace, NULL, RSRC_CONF,
+                   "Keep writing late lines to the log file before for this"
+                   " many seconds after rollover"),
     {NULL}
 };
 
@@ -432,10 +6933,42 @@ static void *make_log_options(apr_pool_t *p, server_rec *s) {
     log_options *ls;
 
     ls = (log_options *) apr_palloc(p, sizeof(log_options));
+    ls->set         = 0;
     ls->enabled     = RL_ENABLED;
     ls->interval    = INTERVAL_DEFAULT;
     ls->offset      = 0;
     ls->localt      = 0;
+    ls->buffer_size = 0;
+    ls->buffer_age  = 0;
+    ls->async       = 0;
+    ls->async_queue = ASYNC_QUEUE_DEFAULT;
+    ls->overflow    = RL_OVERFLOW_BLOCK;
+    ls->spill       = NULL;
+    ls->shared      = 0;
+    ls->preopen     = 0;
+    ls->compress    = RL_COMPRESS_NONE;
+    ls->compress_level = -1;
+    ls->max_size    = 0;
+    ls->schedule    = 0;
+    ls->jitter      = JITTER_DEFAULT;
+    ls->idle_close  = 0;
+    ls->max_open    = 0;
+    ls->mmap        = 0;
+    ls->sync        = RL_SYNC_NONE;
+    ls->sync_interval = 0;
+    ls->cache_hint  = RL_CACHE_NONE;
+    ls->writebehind = 0;
+    ls->thread_buffer = 0;
+    ls->on_close    = NULL;
+    ls->on_close_len = 0;
+    ls->on_close_delay = ONCLOSE_DELAY;
+    ls->format      = RL_FORMAT_TEXT;
+    ls->index_every = 0;
+    ls->index_bytes = 0;
+    ls->sample      = 0;
+    ls->max_lines   = 0;
+    ls->sinks       = NULL;
+    ls->grace       = 0;
 
     return ls;
 }
@@ -443,31 +6976,137 @@ static void *make_log_options(apr_pool_t *p, server_rec *s) {
 static void *merge_log_options(apr_pool_t *p, void *basev, void *addv) {
     log_options *base = (log_options *) basev;
     log_options *add  = (log_options *) addv;
+    log_options *ls   = (log_options *) apr_palloc(p, sizeof(log_options));
+
+    /* What the vhost didn't set comes from the main server */
+    *ls = *add;
+#define RL_MERGE(o, field)  if (!RL_IS_SET(add, o)) ls->field = base->field
+    RL_MERGE(RL_SET_ENABLED,        enabled);
+    RL_MERGE(RL_SET_LOCALT,         localt);
+    RL_MERGE(RL_SET_INTERVAL,       interval);
+    RL_MERGE(RL_SET_OFFSET,         offset);
+    RL_MERGE(RL_SET_BUFFER,         buffer_size);
+    RL_MERGE(RL_SET_BUFFER_AGE,     buffer_age);
+    RL_MERGE(RL_SET_ASYNC,          async);
+    RL_MERGE(RL_SET_ASYNC_QUEUE,    async_queue);
+    RL_MERGE(RL_SET_OVERFLOW,       overflow);
+    RL_MERGE(RL_SET_OVERFLOW,       spill);
+    RL_MERGE(RL_SET_SHARED,         shared);
+    RL_MERGE(RL_SET_PREOPEN,        preopen);
+    RL_MERGE(RL_SET_COMPRESS,       compress);
+    RL_MERGE(RL_SET_COMPRESS,       compress_level);
+    RL_MERGE(RL_SET_MAX_SIZE,       max_size);
+    RL_MERGE(RL_SET_SCHEDULE,       schedule);
+    RL_MERGE(RL_SET_JITTER,         jitter);
+    RL_MERGE(RL_SET_IDLE_CLOSE,     idle_close);
+    RL_MERGE(RL_SET_MAX_OPEN,       max_open);
+    RL_MERGE(RL_SET_MMAP,           mmap);
+    RL_MERGE(RL_SET_SYNC,           sync);
+    RL_MERGE(RL_SET_SYNC,           sync_interval);
+    RL_MERGE(RL_SET_CACHE_HINT,     cache_hint);
+    RL_MERGE(RL_SET_CACHE_HINT,     writebehind);
+    RL_MERGE(RL_SET_THREAD_BUFFER,  thread_buffer);
+    RL_MERGE(RL_SET_ON_CLOSE,       on_close);
+    RL_MERGE(RL_SET_ON_CLOSE,       on_close_len);
+    RL_MERGE(RL_SET_ON_CLOSE_DELAY, on_close_delay);
+    RL_MERGE(RL_SET_FORMAT,         format);
+    RL_MERGE(RL_SET_INDEX,          index_every);
+    RL_MERGE(RL_SET_INDEX,          index_bytes);
+    RL_MERGE(RL_SET_SAMPLE,         sample);
+    RL_MERGE(RL_SET_MAX_LINES,      max_lines);
+    RL_MERGE(RL_SET_SINKS,          sinks);
+    RL_MERGE(RL_SET_GRACE,          grace);
+#undef RL_MERGE
+    ls->set = base->set | add->set;
+
+    return ls;
+}
+
+/* Print the counters for the whole server, or only this child if there
+ * is no shared memory. Each one is a "Name: value" line, the names given
+ * prefix, or rows of a table when html is set.
+ */
+static void ap_print_metrics(request_rec *r, const char *prefix, int html) {
+    int i;
+
+    ap_push_metrics();
+    if (html) {
+        ap_rputs("<hr />\n<h2>Log rotation</h2>\n<table>\n", r);
+    }
+    for (i = 0; i < RL_M_COUNT; ++i) {
+        apr_uint64_t v = (apr_uint64_t) (NULL != metrics_shm ?
+                                         RL_BYTES_READ(&metrics_shm->count[i]) :
+                                         ap_metric_read(i));
+
+        if (html) {
+            ap_rprintf(r, "<tr><th align=\"left\">%s</th><td>%" APR_UINT64_T_FMT
+                          "</td></tr>\n", metric_names[i], v);
+        } else {
+            ap_rprintf(r, "%s%s: %" APR_UINT64_T_FMT "\n", prefix, metric_names[i], v);
+        }
+    }
+    if (html) {
+        ap_rputs("</table>\n", r);
+    }
+}
+
+/* The log-rotate-status handler.
+ */
+static int log_rotate_handler(request_rec *r) {
+    if (NULL == r->handler || strcmp(r->handler, "log-rotate-status")) {
+        return DECLINED;
+    }
+    if (M_GET != r->method_number) {
+        return DECLINED;
+    }
 
-    *add = *base;
+    ap_set_content_type(r, "text/plain; charset=ISO-8859-1");
+    if (!r->header_only) {
+        ap_print_metrics(r, "", 0);
+    }
+    return OK;
+}
 
-    return add;
+/* Add our counters to the mod_status page.
+ */
+static int log_rotate_status_hook(request_rec *r, int flags) {
+    ap_print_metrics(r, "LogRotate", !(flags & AP_STATUS_SHORT));
+    return OK;
 }
 
 /* set the log writer callbacks */
 static int log_rotate_open_logs(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s) {
-    log_options *ls = ap_get_module_config(s->module_config, &log_rotate_module);
     APR_OPTIONAL_FN_TYPE(ap_log_set_writer_init) *set_writer_init;
     APR_OPTIONAL_FN_TYPE(ap_log_set_writer)      *set_writer;
+    server_rec *vs;
+    int want = 0;
 
-    if (RL_DISABLED == ls->enabled) {
+    /* A new generation of the config, whether it rotates anything or not */
+    if (NULL == getenv("AP_PARENT_PID")) {
+        rl_registry *reg = ap_registry(s, 1);
+
+        if (NULL != reg) {
+            ++reg->gen;
+        }
+    }
+
+    /* The writers are for all logs, so they're needed if any vhost rotates */
+    for (vs = s; NULL != vs && !want; vs = vs->next) {
+        log_options *ls = ap_get_module_config(vs->module_config, &log_rotate_module);
+        want = RL_DISABLED != ls->enabled;
+    }
+
+    if (!want) {
         return DECLINED;
     }
     if (set_writer_init = APR_RETRIEVE_OPTIONAL_FN(ap_log_set_writer_init), NULL == set_writer_init) {
         ap_log_error(APLOG_MARK, APLOG_ERR, APR_SUCCESS, s,
                 "can't install log rotator - ap_log_set_writer_init not available");
-        ls->enabled = RL_DISABLED;
         return DECLINED;
     }
     if (set_writer = APR_RETRIEVE_OPTIONAL_FN(ap_log_set_writer), NULL == set_writer) {
         ap_log_error(APLOG_MARK, APLOG_ERR, APR_SUCCESS, s,
                 "can't install log rotator - ap_log_set_writer not available");
-        ls->enabled = RL_DISABLED;
         return DECLINED;
     }
 
@@ -477,10 +7116,89 @@ static int log_rotate_open_logs(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *pte
     return OK;
 }
 
+/* flush buffered log data when the child goes away */
+static void log_rotate_child_init(apr_pool_t *p, server_rec *s) {
+    child_started = 1;
+    apr_pool_cleanup_register(p, s, ap_flush_all_logs, apr_pool_cleanup_null);
+    /* A child that opened its own logs has nothing to take over */
+    if (NULL == getenv("AP_PARENT_PID")) {
+        ap_adopt_logs(s);
+    }
+#if APR_HAS_THREADS
+    {
+        int i;
+
+        /* Key to the request threads' buffers for RotateThreadBuffer */
+        thread_key = NULL;
+        for (i = 0; NULL != rotated_logs && i < rotated_logs->nelts; ++i) {
+            rotated_log *rl = APR_ARRAY_IDX(rotated_logs, i, rotated_log *);
+
+            if (rl->st.thread_buffer) {
+                if (APR_SUCCESS != apr_threadkey_private_create(&thread_key, NULL, p)) {
+                    thread_key = NULL;
+                } else {
+                    threads = NULL;
+                    apr_pool_cleanup_register(p, s, ap_drop_threads, apr_pool_cleanup_null);
+                }
+                break;
+            }
+        }
+    }
+    ap_start_service(p, s);
+#endif
+}
+
 /* map into the first apache */
 static int log_rotate_post_config( apr_pool_t * p, apr_pool_t * plog, apr_pool_t * ptemp, server_rec * s)
 {
     ap_add_version_component(p, "mod_log_rotate/1.02");
+
+    /* Every log of this generation has been opened by now */
+    if (NULL == getenv("AP_PARENT_PID")) {
+        ap_sweep_registry(s);
+    }
+
+    /* Shared totals for the metrics, inherited by the children. They are
+     * made once in the process pool so that a restart doesn't reset them.
+     */
+    {
+        apr_shm_t *shm;
+        void *data;
+        const char *key = "log_rotate_metrics";
+        int i;
+
+        apr_pool_userdata_get(&data, key, s->process->pool);
+        if (metrics_shm = data, NULL == metrics_shm &&
+            APR_SUCCESS == apr_shm_create(&shm, sizeof(rl_metrics), NULL, s->process->pool)) {
+            metrics_shm = apr_shm_baseaddr_get(shm);
+            memset(metrics_shm, 0, sizeof(rl_metrics));
+            apr_pool_userdata_set(metrics_shm, key, apr_pool_cleanup_null, s->process->pool);
+        }
+        for (i = 0; i < RL_M_COUNT; ++i) {
+            metrics_pushed[i] = ap_metric_read(i);
+        }
+    }
+#if defined(RL_HAVE_BROKER) || defined(RL_HAVE_ONCLOSE)
+    {
+        void *data;
+        const char *key = "log_rotate_post_config";
+
+        /* Don't start the helpers during the first pass over the config */
+        apr_pool_userdata_get(&data, key, s->process->pool);
+        if (NULL == data) {
+            apr_pool_userdata_set((const void *) 1, key, apr_pool_cleanup_null,
+                                  s->process->pool);
+            return OK;
+        }
+
+#ifdef RL_HAVE_BROKER
+        ap_start_broker(p, s);
+#endif
+#ifdef RL_HAVE_ONCLOSE
+        ap_start_onclose(s);
+#endif
+    }
+#endif
     return OK;
 }
 
@@ -488,6 +7206,10 @@ static void log_rotate_register_hooks(apr_pool_t *p)
 {
     ap_hook_open_logs(   log_rotate_open_logs,     NULL, NULL, APR_HOOK_FIRST  );
     ap_hook_post_config( log_rotate_post_config,   NULL, NULL, APR_HOOK_MIDDLE );
+    ap_hook_child_init(  log_rotate_child_init,    NULL, NULL, APR_HOOK_MIDDLE );
+    ap_hook_monitor(     log_rotate_monitor,       NULL, NULL, APR_HOOK_MIDDLE );
+    ap_hook_handler(     log_rotate_handler,       NULL, NULL, APR_HOOK_MIDDLE );
+    APR_OPTIONAL_HOOK(ap, status_hook, log_rotate_status_hook, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 